@@ -0,0 +1,171 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "eventaggregator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+struct EventAggregator::Private
+{
+  typedef std::chrono::steady_clock Clock;
+
+  EventAggregator* mpSelf;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  Clock::duration mQuietPeriod, mMaxDelay;
+  Clock::time_point mFirstEvent, mLastEvent;
+  Summary mPending;
+  bool mProcessing = false;
+  bool mTerminate = false;
+  std::thread mThread;
+
+  explicit Private(EventAggregator* pSelf)
+    : mpSelf(pSelf)
+    , mQuietPeriod(std::chrono::seconds(1))
+    , mMaxDelay(std::chrono::seconds(10))
+  {}
+
+  void threadFunc();
+};
+
+void
+EventAggregator::Private::threadFunc()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (!mTerminate) {
+    if (mPending.empty() || mProcessing) {
+      mCondition.wait(lock);
+      continue;
+    }
+    auto deadline = std::min(mLastEvent + mQuietPeriod, mFirstEvent + mMaxDelay);
+    if (Clock::now() < deadline) {
+      mCondition.wait_until(lock, deadline);
+      continue;
+    }
+    Summary events;
+    events.swap(mPending);
+    lock.unlock();
+    bool processing = mpSelf->onEvents(events);
+    lock.lock();
+    mProcessing = processing;
+  }
+}
+
+EventAggregator::EventAggregator()
+  : p(new Private(this))
+{
+  p->mThread = std::thread([this]() { p->threadFunc(); });
+}
+
+EventAggregator::~EventAggregator()
+{
+  stop();
+  delete p;
+}
+
+void
+EventAggregator::stop()
+{
+  std::unique_lock<std::mutex> lock(p->mMutex);
+  p->mTerminate = true;
+  p->mPending.clear();
+  lock.unlock();
+  p->mCondition.notify_one();
+  if (p->mThread.joinable())
+    p->mThread.join();
+}
+
+EventAggregator&
+EventAggregator::setQuietPeriodSeconds(double s)
+{
+  std::lock_guard<std::mutex> lock(p->mMutex);
+  p->mQuietPeriod = std::chrono::duration_cast<Private::Clock::duration>(
+    std::chrono::duration<double>(s));
+  return *this;
+}
+
+double
+EventAggregator::quietPeriodSeconds() const
+{
+  std::lock_guard<std::mutex> lock(p->mMutex);
+  return std::chrono::duration<double>(p->mQuietPeriod).count();
+}
+
+EventAggregator&
+EventAggregator::setMaxDelaySeconds(double s)
+{
+  std::lock_guard<std::mutex> lock(p->mMutex);
+  p->mMaxDelay = std::chrono::duration_cast<Private::Clock::duration>(
+    std::chrono::duration<double>(s));
+  return *this;
+}
+
+double
+EventAggregator::maxDelaySeconds() const
+{
+  std::lock_guard<std::mutex> lock(p->mMutex);
+  return std::chrono::duration<double>(p->mMaxDelay).count();
+}
+
+void
+EventAggregator::post(const std::string& event)
+{
+  std::unique_lock<std::mutex> lock(p->mMutex);
+  auto now = Private::Clock::now();
+  if (p->mPending.empty())
+    p->mFirstEvent = now;
+  p->mLastEvent = now;
+  ++p->mPending[event];
+  lock.unlock();
+  p->mCondition.notify_one();
+}
+
+void
+EventAggregator::beginProcessing()
+{
+  std::unique_lock<std::mutex> lock(p->mMutex);
+  if (!p->mProcessing)
+    return;
+  p->mProcessing = false;
+  if (!p->mPending.empty()) {
+    std::clog << "dropping events covered by current processing: "
+              << describe(p->mPending) << std::endl;
+    p->mPending.clear();
+  }
+  lock.unlock();
+  p->mCondition.notify_one();
+}
+
+std::string
+EventAggregator::describe(const Summary& summary)
+{
+  std::ostringstream oss;
+  for (const auto& event : summary) {
+    if (oss.tellp() > 0)
+      oss << ", ";
+    oss << event.first;
+    if (event.second > 1)
+      oss << " (" << event.second << "x)";
+  }
+  return oss.str();
+}
@@ -0,0 +1,65 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EVENT_AGGREGATOR_H
+#define EVENT_AGGREGATOR_H
+
+#include <map>
+#include <string>
+
+// Collects bursts of events, and reports them in a single call to
+// onEvents() from an internal thread. Events are reported once no event has
+// arrived for the quiet period, or when the oldest pending event has been
+// waiting for the maximum delay.
+class EventAggregator
+{
+public:
+  EventAggregator();
+  virtual ~EventAggregator();
+
+  EventAggregator(const EventAggregator&) = delete;
+  EventAggregator& operator=(const EventAggregator&) = delete;
+
+  EventAggregator& setQuietPeriodSeconds(double);
+  double quietPeriodSeconds() const;
+  EventAggregator& setMaxDelaySeconds(double);
+  double maxDelaySeconds() const;
+
+  // Does not block.
+  void post(const std::string& event);
+  // If onEvents() returned true, events are held back until
+  // beginProcessing() is called. Events that arrived before that call
+  // are covered by the processing that begins, and are dropped.
+  void beginProcessing();
+  // Stops the internal thread, discarding pending events. Derived classes
+  // must call this from their destructor, so onEvents() is never called on
+  // a partially destroyed object.
+  void stop();
+
+protected:
+  // Event descriptions with number of occurrences.
+  typedef std::map<std::string, int> Summary;
+  virtual bool onEvents(const Summary&) = 0;
+  static std::string describe(const Summary&);
+
+private:
+  struct Private;
+  Private* p;
+};
+
+#endif // EVENT_AGGREGATOR_H
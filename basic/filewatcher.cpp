@@ -0,0 +1,246 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "filewatcher.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if __linux__
+#include <sys/inotify.h>
+#endif
+
+namespace {
+
+const int PollIntervalMs = 2000;
+
+} // namespace
+
+struct FileWatcher::Private
+{
+  struct File
+  {
+    std::string path, dir, name;
+    int wd = -1;
+    // polled state
+    bool exists = false;
+    struct stat status;
+  };
+
+  FileWatcher* mpSelf;
+  std::mutex mMutex;
+  std::vector<File> mFiles;
+  bool mTerminate = false;
+  int mInotify = -1;
+  int mPipe[2] = { -1, -1 };
+  std::thread mThread;
+
+  explicit Private(FileWatcher* pSelf);
+  ~Private();
+
+  void wakeUp();
+  void threadFunc();
+  void readInotify(std::vector<std::string>& changed);
+  void pollFiles(std::vector<std::string>& changed);
+  static bool statusChanged(File&);
+};
+
+FileWatcher::Private::Private(FileWatcher* pSelf)
+  : mpSelf(pSelf)
+{
+  if (::pipe(mPipe) < 0)
+    std::cerr << "FileWatcher: pipe(): " << ::strerror(errno) << std::endl;
+#if __linux__
+  mInotify = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (mInotify < 0)
+    std::cerr << "FileWatcher: inotify_init1(): " << ::strerror(errno)
+              << ", polling files" << std::endl;
+#endif
+}
+
+FileWatcher::Private::~Private()
+{
+  if (mInotify >= 0)
+    ::close(mInotify);
+  for (int fd : mPipe)
+    if (fd >= 0)
+      ::close(fd);
+}
+
+void
+FileWatcher::Private::wakeUp()
+{
+  char c = 0;
+  if (mPipe[1] >= 0 && ::write(mPipe[1], &c, 1) < 0)
+    std::cerr << "FileWatcher: write(): " << ::strerror(errno) << std::endl;
+}
+
+void
+FileWatcher::Private::threadFunc()
+{
+  while (true) {
+    int timeout = -1;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      if (mTerminate)
+        break;
+      for (const auto& file : mFiles)
+        if (file.wd < 0)
+          timeout = PollIntervalMs;
+    }
+    struct pollfd fds[] = { { mPipe[0], POLLIN, 0 }, { mInotify, POLLIN, 0 } };
+    int nfds = mInotify >= 0 ? 2 : 1;
+    if (::poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+      std::cerr << "FileWatcher: poll(): " << ::strerror(errno) << std::endl;
+      break;
+    }
+    if (fds[0].revents & POLLIN) {
+      char c;
+      if (::read(mPipe[0], &c, 1) < 0)
+        std::cerr << "FileWatcher: read(): " << ::strerror(errno) << std::endl;
+      continue;
+    }
+    std::vector<std::string> changed;
+    if (nfds > 1 && (fds[1].revents & POLLIN))
+      readInotify(changed);
+    pollFiles(changed);
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+    for (const auto& path : changed)
+      mpSelf->onFileChanged(path);
+  }
+}
+
+void
+FileWatcher::Private::readInotify(std::vector<std::string>& changed)
+{
+#if __linux__
+  alignas(struct inotify_event) char buf[4096];
+  ssize_t len;
+  while ((len = ::read(mInotify, buf, sizeof(buf))) > 0) {
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (char* ptr = buf; ptr < buf + len;) {
+      const struct inotify_event* ev = reinterpret_cast<inotify_event*>(ptr);
+      ptr += sizeof(struct inotify_event) + ev->len;
+      for (auto& file : mFiles) {
+        if (ev->mask & IN_Q_OVERFLOW) {
+          changed.push_back(file.path);
+        } else if (ev->wd == file.wd) {
+          if (ev->mask & (IN_IGNORED | IN_DELETE_SELF)) {
+            // The directory is gone, fall back to polling.
+            file.wd = -1;
+            statusChanged(file);
+            changed.push_back(file.path);
+          } else if (ev->len > 0 && file.name == ev->name) {
+            changed.push_back(file.path);
+          }
+        }
+      }
+    }
+  }
+#else
+  (void)changed;
+#endif
+}
+
+void
+FileWatcher::Private::pollFiles(std::vector<std::string>& changed)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  for (auto& file : mFiles)
+    if (file.wd < 0 && statusChanged(file))
+      changed.push_back(file.path);
+}
+
+bool
+FileWatcher::Private::statusChanged(File& file)
+{
+  struct stat status;
+  bool exists = ::stat(file.path.c_str(), &status) == 0;
+  bool changed = exists != file.exists;
+  if (exists && file.exists)
+    changed = status.st_mtime != file.status.st_mtime
+              || status.st_size != file.status.st_size
+              || status.st_ino != file.status.st_ino;
+  file.exists = exists;
+  if (exists)
+    file.status = status;
+  return changed;
+}
+
+FileWatcher::FileWatcher()
+  : p(new Private(this))
+{
+  p->mThread = std::thread([this]() { p->threadFunc(); });
+}
+
+FileWatcher::~FileWatcher()
+{
+  stop();
+  delete p;
+}
+
+void
+FileWatcher::stop()
+{
+  std::unique_lock<std::mutex> lock(p->mMutex);
+  p->mTerminate = true;
+  lock.unlock();
+  p->wakeUp();
+  if (p->mThread.joinable())
+    p->mThread.join();
+}
+
+void
+FileWatcher::watch(const std::string& path)
+{
+  Private::File file;
+  file.path = path;
+  size_t pos = path.rfind('/');
+  if (pos == std::string::npos) {
+    file.dir = ".";
+    file.name = path;
+  } else {
+    file.dir = pos == 0 ? "/" : path.substr(0, pos);
+    file.name = path.substr(pos + 1);
+  }
+#if __linux__
+  if (p->mInotify >= 0) {
+    file.wd = ::inotify_add_watch(p->mInotify, file.dir.c_str(),
+                                  IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+                                    | IN_MOVED_FROM | IN_MOVED_TO
+                                    | IN_DELETE_SELF);
+    if (file.wd < 0)
+      std::clog << "cannot watch directory " << file.dir << ": "
+                << ::strerror(errno) << ", polling " << path << std::endl;
+  }
+#endif
+  Private::statusChanged(file);
+  std::unique_lock<std::mutex> lock(p->mMutex);
+  p->mFiles.push_back(file);
+  lock.unlock();
+  p->wakeUp();
+}
@@ -0,0 +1,53 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef FILE_WATCHER_H
+#define FILE_WATCHER_H
+
+#include <string>
+
+// Reports changes to files from an internal thread. A file's directory is
+// watched rather than the file itself, so files that do not exist yet, and
+// files replaced by rename, are covered. Where inotify is not available,
+// files are polled for changes to their modification time, size, and inode.
+class FileWatcher
+{
+public:
+  FileWatcher();
+  virtual ~FileWatcher();
+
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  void watch(const std::string& path);
+  // Stops the internal thread. Derived classes must call this from their
+  // destructor, so onFileChanged() is never called on a partially
+  // destroyed object.
+  void stop();
+
+protected:
+  // Called with the path as given to watch(). A single change to a file
+  // may be reported more than once.
+  virtual void onFileChanged(const std::string& path) = 0;
+
+private:
+  struct Private;
+  Private* p;
+};
+
+#endif // FILE_WATCHER_H
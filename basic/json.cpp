@@ -0,0 +1,45 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "json.h"
+
+#include <iomanip>
+#include <sstream>
+
+std::string
+jsonEscape(const std::string& s)
+{
+  std::ostringstream oss;
+  for (char c : s) {
+    switch (c) {
+      case '"':
+        oss << "\\\"";
+        break;
+      case '\\':
+        oss << "\\\\";
+        break;
+      default:
+        if (static_cast<unsigned char>(c) < 0x20)
+          oss << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+              << int(c) << std::dec;
+        else
+          oss << c;
+    }
+  }
+  return oss.str();
+}
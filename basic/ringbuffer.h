@@ -0,0 +1,80 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// A bounded single-producer, single-consumer queue of reusable slots.
+// Slots are filled and drained in place, so their contents keep any
+// memory they allocated. Neither side blocks: beginWrite() returns null
+// while the ring is full, and beginRead() returns null while it is empty.
+template<class T>
+class RingBuffer
+{
+public:
+  explicit RingBuffer(size_t capacity)
+    : mSlots(capacity + 1)
+    , mReadPos(0)
+    , mWritePos(0)
+  {}
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+
+  size_t capacity() const { return mSlots.size() - 1; }
+
+  // Producer side. The slot returned is published by endWrite().
+  T* beginWrite()
+  {
+    size_t pos = mWritePos.load(std::memory_order_relaxed);
+    if (next(pos) == mReadPos.load(std::memory_order_acquire))
+      return nullptr;
+    return &mSlots[pos];
+  }
+  void endWrite()
+  {
+    size_t pos = mWritePos.load(std::memory_order_relaxed);
+    mWritePos.store(next(pos), std::memory_order_release);
+  }
+
+  // Consumer side. The slot returned is released by endRead().
+  T* beginRead()
+  {
+    size_t pos = mReadPos.load(std::memory_order_relaxed);
+    if (pos == mWritePos.load(std::memory_order_acquire))
+      return nullptr;
+    return &mSlots[pos];
+  }
+  void endRead()
+  {
+    size_t pos = mReadPos.load(std::memory_order_relaxed);
+    mReadPos.store(next(pos), std::memory_order_release);
+  }
+
+private:
+  size_t next(size_t pos) const { return pos + 1 == mSlots.size() ? 0 : pos + 1; }
+
+  std::vector<T> mSlots;
+  std::atomic<size_t> mReadPos, mWritePos;
+};
+
+#endif // RING_BUFFER_H
@@ -21,14 +21,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <condition_variable>
 #include <thread>
 #include <iostream>
-#include <cassert>
 
 struct WorkerThread::Private
 {
   std::mutex mMutex;
   std::condition_variable mThreadCondition, mExecuteCondition;
   Callable* mpCallable = nullptr;
-  bool mCallDone = false;
+  unsigned long mCallsQueued = 0, mCallsDone = 0;
   bool mStarted = false;
   bool mTerminate = false;
 
@@ -59,11 +58,12 @@ WorkerThread::~WorkerThread()
 void WorkerThread::executeSynchronously(Callable& c)
 {
   std::unique_lock<std::mutex> lock(p->mMutex);
-  assert(p->mpCallable == nullptr);
+  // Calls from several threads are executed one after the other.
+  p->mThreadCondition.wait(lock, [this](){ return !p->mpCallable; });
   p->mpCallable = &c;
-  p->mCallDone = false;
+  unsigned long call = ++p->mCallsQueued;
   p->mExecuteCondition.notify_one();
-  p->mThreadCondition.wait(lock, [this](){ return p->mCallDone; });
+  p->mThreadCondition.wait(lock, [this, call](){ return p->mCallsDone >= call; });
 }
 
 void WorkerThread::Private::threadFunc()
@@ -77,12 +77,15 @@ void WorkerThread::Private::threadFunc()
     std::unique_lock<std::mutex> lock(mMutex);
     mExecuteCondition.wait(lock, [this](){ return mTerminate || mpCallable; });
     if (mpCallable) {
-      assert(!mCallDone);
-      mpCallable->onCall();
+      // Other threads may queue a call meanwhile.
+      Callable* pCallable = mpCallable;
+      lock.unlock();
+      pCallable->onCall();
+      lock.lock();
       mpCallable = nullptr;
-      mCallDone = true;
+      ++mCallsDone;
       lock.unlock();
-      mThreadCondition.notify_one();
+      mThreadCondition.notify_all();
     }
   }
 }
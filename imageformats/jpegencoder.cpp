@@ -97,6 +97,7 @@ struct JpegEncoder::Private
   OstreamDestinationMgr mDestMgr;
 
   int mQualityPercent;
+  bool mFast;
   bool mCompressing;
 
   [[noreturn]] static void throwOnError(::jpeg_common_struct* p)
@@ -111,6 +112,7 @@ struct JpegEncoder::Private
 
   Private()
     : mQualityPercent(90)
+    , mFast(false)
     , mCompressing(false)
   {
     ::jpeg_std_error(&mErrorMgr);
@@ -172,6 +174,20 @@ JpegEncoder::qualityPercent() const
   return p->mQualityPercent;
 }
 
+JpegEncoder&
+JpegEncoder::setFast(bool b)
+{
+  onParamChange();
+  p->mFast = b;
+  return *this;
+}
+
+bool
+JpegEncoder::fast() const
+{
+  return p->mFast;
+}
+
 void
 JpegEncoder::onImageBegin()
 {
@@ -208,6 +224,10 @@ JpegEncoder::onImageBegin()
     p->mCompressStruct.comp_info[2].h_samp_factor = 1;
     p->mCompressStruct.comp_info[2].v_samp_factor = 1;
   }
+  if (p->mFast) {
+    p->mCompressStruct.dct_method = JDCT_IFAST;
+    p->mCompressStruct.optimize_coding = FALSE;
+  }
   p->mCompressStruct.density_unit = 1;
   p->mCompressStruct.X_density = resolutionDpi();
   p->mCompressStruct.Y_density = resolutionDpi();
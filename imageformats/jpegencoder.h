@@ -31,6 +31,9 @@ public:
   double gamma() const;
   JpegEncoder& setQualityPercent(int);
   int qualityPercent() const;
+  // Trades image quality for encoding speed.
+  JpegEncoder& setFast(bool);
+  bool fast() const;
 
 protected:
   void onImageBegin() override;
@@ -39,6 +39,7 @@ struct PngEncoder::Private
   png_structp mpPng = nullptr;
   png_infop mpInfo = nullptr;
   std::ostream* mpStream = nullptr;
+  int mCompressionLevel = -1;
 #if BYTE_ORDER == LITTLE_ENDIAN
   std::vector<uint16_t> mLineBuffer;
 #endif
@@ -77,6 +78,23 @@ PngEncoder::~PngEncoder()
   delete p;
 }
 
+PngEncoder&
+PngEncoder::setCompressionLevel(int level)
+{
+  onParamChange();
+  if (level < -1 || level > 9)
+    throw std::runtime_error(
+      "PngEncoder: compression level outside -1..9 range");
+  p->mCompressionLevel = level;
+  return *this;
+}
+
+int
+PngEncoder::compressionLevel() const
+{
+  return p->mCompressionLevel;
+}
+
 void
 PngEncoder::onImageBegin()
 {
@@ -120,6 +138,12 @@ PngEncoder::onImageBegin()
                  PNG_INTERLACE_NONE,
                  PNG_COMPRESSION_TYPE_BASE,
                  PNG_FILTER_TYPE_BASE);
+  if (p->mCompressionLevel >= 0) {
+    ::png_set_compression_level(p->mpPng, p->mCompressionLevel);
+    // Filtering costs more than it saves at low compression levels.
+    if (p->mCompressionLevel <= 1)
+      ::png_set_filter(p->mpPng, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+  }
   uint32_t px_per_m = resolutionDpi() * 10000 / 254;
   ::png_set_pHYs(p->mpPng, p->mpInfo, px_per_m, px_per_m, PNG_RESOLUTION_METER);
   ::png_write_info(p->mpPng, p->mpInfo);
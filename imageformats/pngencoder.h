@@ -27,6 +27,10 @@ public:
   PngEncoder();
   ~PngEncoder();
 
+  // zlib compression level, 1 for fastest, or -1 for the default.
+  PngEncoder& setCompressionLevel(int);
+  int compressionLevel() const;
+
 protected:
   void onImageBegin() override;
   void onImageEnd() override;
@@ -0,0 +1,1081 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "host.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace sanecpp {
+
+namespace {
+
+const char* const host_flag = "--sane-host";
+// File descriptors inherited by a host process.
+const int control_fd = 3, cancel_fd = 4, shm_fd = 5;
+// Scan data is passed through shared memory rather than the socket.
+const size_t shm_size = 1 << 20;
+// A host that does not reply within this time is considered hung. Starting
+// a scan and reading scan data may legitimately take much longer, so they
+// are not timed here; scan jobs have a watchdog of their own, and may
+// cancel or terminate the host.
+const int reply_timeout_ms = 120 * 1000;
+// A host that has died is restarted at most this often.
+const int restart_interval_seconds = 5;
+
+typedef std::chrono::steady_clock Clock;
+
+enum opcode : int32_t
+{
+  op_get_devices = 1,
+  op_open,
+  op_close,
+  op_get_descriptors,
+  op_control_option,
+  op_start,
+  op_get_parameters,
+  op_read,
+};
+
+// A sequence of 32-bit integers and length-prefixed byte strings.
+// Hosts run the daemon's executable, so byte order and sizes agree.
+class message
+{
+public:
+  message& put(int32_t i)
+  {
+    m_data.append(reinterpret_cast<const char*>(&i), sizeof(i));
+    return *this;
+  }
+  message& put(const void* p, size_t size)
+  {
+    put(static_cast<int32_t>(size));
+    m_data.append(static_cast<const char*>(p), size);
+    return *this;
+  }
+  message& put(const std::string& s) { return put(s.data(), s.size()); }
+  // Null strings are sent with a negative length.
+  message& put_cstr(const char* s)
+  {
+    return s ? put(s, ::strlen(s)) : put(static_cast<int32_t>(-1));
+  }
+
+  int32_t get_int()
+  {
+    int32_t i = 0;
+    if (m_pos + sizeof(i) > m_data.size())
+      m_ok = false;
+    else
+      ::memcpy(&i, m_data.data() + m_pos, sizeof(i));
+    m_pos += sizeof(i);
+    return i;
+  }
+  std::string get_string()
+  {
+    std::string s;
+    get_cstr(s);
+    return s;
+  }
+  // Returns false for a null string.
+  bool get_cstr(std::string& s)
+  {
+    int32_t size = get_int();
+    if (size < 0 || !m_ok)
+      return false;
+    if (m_pos + size > m_data.size()) {
+      m_ok = false;
+      return false;
+    }
+    s.assign(m_data.data() + m_pos, size);
+    m_pos += size;
+    return true;
+  }
+
+  bool ok() const { return m_ok; }
+  std::string& data() { return m_data; }
+  const std::string& data() const { return m_data; }
+  void clear()
+  {
+    m_data.clear();
+    m_pos = 0;
+    m_ok = true;
+  }
+
+private:
+  std::string m_data;
+  size_t m_pos = 0;
+  bool m_ok = true;
+};
+
+bool
+write_all(int fd, const char* p, size_t size)
+{
+  while (size > 0) {
+    ssize_t r = ::write(fd, p, size);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+// With a timeout of -1, waits indefinitely.
+bool
+read_all(int fd, char* p, size_t size, int timeout_ms)
+{
+  auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+  while (size > 0) {
+    int wait_ms = -1;
+    if (timeout_ms >= 0) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - Clock::now());
+      wait_ms = std::max<int>(0, left.count());
+    }
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    int count = ::poll(&pfd, 1, wait_ms);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+    ssize_t r = ::read(fd, p, size);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return false;
+    p += r;
+    size -= r;
+  }
+  return true;
+}
+
+bool
+send_frame(int fd, const message& m)
+{
+  uint32_t size = m.data().size();
+  return write_all(fd, reinterpret_cast<const char*>(&size), sizeof(size)) &&
+         write_all(fd, m.data().data(), size);
+}
+
+bool
+receive_frame(int fd, message& m, int timeout_ms)
+{
+  const uint32_t max_size = 16 << 20;
+  m.clear();
+  uint32_t size = 0;
+  if (!read_all(fd, reinterpret_cast<char*>(&size), sizeof(size), timeout_ms))
+    return false;
+  if (size > max_size)
+    return false;
+  m.data().resize(size);
+  return read_all(fd, &m.data()[0], size, timeout_ms);
+}
+
+std::string
+backend_of(const std::string& device_name)
+{
+  return device_name.substr(0, device_name.find(':'));
+}
+
+// Host process side.
+
+struct served_devices
+{
+  std::mutex mutex;
+  std::map<int32_t, SANE_Handle> handles;
+  int32_t next_id = 1;
+
+  SANE_Handle find(int32_t id)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto i = handles.find(id);
+    return i == handles.end() ? nullptr : i->second;
+  }
+};
+
+void
+serve_descriptors(SANE_Handle h, message& reply)
+{
+  std::vector<const SANE_Option_Descriptor*> descs;
+  const SANE_Option_Descriptor* desc = nullptr;
+  for (int i = 1; (desc = ::sane_get_option_descriptor(h, i)); ++i)
+    descs.push_back(desc);
+  reply.put(static_cast<int32_t>(descs.size()));
+  for (auto desc : descs) {
+    reply.put_cstr(desc->name).put_cstr(desc->title).put_cstr(desc->desc);
+    reply.put(desc->type).put(desc->unit).put(desc->size).put(desc->cap);
+    reply.put(desc->constraint_type);
+    switch (desc->constraint_type) {
+      case SANE_CONSTRAINT_RANGE:
+        reply.put(desc->constraint.range->min)
+          .put(desc->constraint.range->max)
+          .put(desc->constraint.range->quant);
+        break;
+      case SANE_CONSTRAINT_WORD_LIST:
+        reply.put(desc->constraint.word_list[0]);
+        for (int i = 1; i <= desc->constraint.word_list[0]; ++i)
+          reply.put(desc->constraint.word_list[i]);
+        break;
+      case SANE_CONSTRAINT_STRING_LIST: {
+        int32_t count = 0;
+        while (desc->constraint.string_list[count])
+          ++count;
+        reply.put(count);
+        for (int i = 0; i < count; ++i)
+          reply.put_cstr(desc->constraint.string_list[i]);
+      } break;
+      case SANE_CONSTRAINT_NONE:
+        break;
+    }
+  }
+}
+
+void
+serve_request(message& request,
+              message& reply,
+              served_devices& devices,
+              char* shm)
+{
+  int32_t op = request.get_int();
+  if (op == op_get_devices) {
+    bool localonly = request.get_int();
+    const SANE_Device** p = nullptr;
+    SANE_Status status = ::sane_get_devices(&p, localonly);
+    reply.put(status);
+    std::vector<const SANE_Device*> list;
+    for (; status == SANE_STATUS_GOOD && *p; ++p)
+      list.push_back(*p);
+    reply.put(static_cast<int32_t>(list.size()));
+    for (auto device : list)
+      reply.put_cstr(device->name)
+        .put_cstr(device->vendor)
+        .put_cstr(device->model)
+        .put_cstr(device->type);
+    return;
+  }
+  if (op == op_open) {
+    std::string name = request.get_string();
+    SANE_Handle h = nullptr;
+    SANE_Status status = ::sane_open(name.c_str(), &h);
+    int32_t id = 0;
+    if (status == SANE_STATUS_GOOD) {
+      std::lock_guard<std::mutex> lock(devices.mutex);
+      id = devices.next_id++;
+      devices.handles[id] = h;
+    }
+    reply.put(status).put(id);
+    return;
+  }
+  int32_t id = request.get_int();
+  SANE_Handle h = devices.find(id);
+  if (!h) {
+    reply.put(SANE_STATUS_INVAL);
+    return;
+  }
+  switch (op) {
+    case op_close: {
+      {
+        std::lock_guard<std::mutex> lock(devices.mutex);
+        devices.handles.erase(id);
+      }
+      ::sane_close(h);
+      reply.put(SANE_STATUS_GOOD);
+    } break;
+    case op_get_descriptors:
+      serve_descriptors(h, reply);
+      break;
+    case op_control_option: {
+      SANE_Int n = request.get_int();
+      SANE_Action action = static_cast<SANE_Action>(request.get_int());
+      std::string value = request.get_string();
+      const SANE_Option_Descriptor* desc = ::sane_get_option_descriptor(h, n);
+      if (!desc) {
+        reply.put(SANE_STATUS_INVAL);
+        break;
+      }
+      size_t size = std::max<size_t>(desc->size, sizeof(SANE_Word));
+      value.resize(std::max(size, value.size()));
+      SANE_Int info = 0;
+      SANE_Status status =
+        ::sane_control_option(h, n, action, &value[0], &info);
+      value.resize(desc->size);
+      reply.put(status).put(info).put(value);
+    } break;
+    case op_start:
+      reply.put(::sane_start(h));
+      break;
+    case op_get_parameters: {
+      SANE_Parameters p;
+      ::memset(&p, 0, sizeof(p));
+      SANE_Status status = ::sane_get_parameters(h, &p);
+      reply.put(status).put(p.format).put(p.last_frame);
+      reply.put(p.bytes_per_line).put(p.pixels_per_line).put(p.lines);
+      reply.put(p.depth);
+    } break;
+    case op_read: {
+      SANE_Int max_length = std::min<SANE_Int>(request.get_int(), shm_size);
+      SANE_Int length = 0;
+      SANE_Status status = ::sane_read(
+        h, reinterpret_cast<SANE_Byte*>(shm), std::max(max_length, 0), &length);
+      reply.put(status).put(length);
+    } break;
+    default:
+      reply.put(SANE_STATUS_UNSUPPORTED);
+  }
+}
+
+int
+serve(const std::string& backend, const std::string& configDir)
+{
+  struct sigaction action = { 0 };
+  sigemptyset(&action.sa_mask);
+  action.sa_handler = SIG_IGN;
+  ::sigaction(SIGPIPE, &action, nullptr);
+
+  void* shm =
+    ::mmap(nullptr, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if (shm == MAP_FAILED) {
+    std::cerr << "SANE host for " << backend
+              << ": could not map shared memory: " << ::strerror(errno)
+              << std::endl;
+    return 1;
+  }
+  ::close(shm_fd);
+  if (configDir.empty())
+    set_backends({ backend });
+  else
+    use_backend_config(configDir);
+  SANE_Int version = 0;
+  ::sane_init(&version, nullptr);
+
+  served_devices devices;
+  // sane_cancel() must be able to interrupt a blocking call, so
+  // cancel requests arrive on a connection of their own.
+  std::thread canceller([&devices] {
+    message m;
+    while (receive_frame(cancel_fd, m, -1)) {
+      SANE_Handle h = devices.find(m.get_int());
+      if (h)
+        ::sane_cancel(h);
+    }
+  });
+
+  message request, reply;
+  while (receive_frame(control_fd, request, -1)) {
+    reply.clear();
+    reply.put(version);
+    serve_request(request, reply, devices, static_cast<char*>(shm));
+    if (!send_frame(control_fd, reply))
+      break;
+  }
+
+  for (const auto& device : devices.handles)
+    ::sane_close(device.second);
+  ::sane_exit();
+  ::shutdown(cancel_fd, SHUT_RDWR);
+  canceller.join();
+  set_backends({});
+  return 0;
+}
+
+// Daemon side.
+
+class host;
+
+std::mutex s_hosts_mutex;
+host_mode s_mode = host_mode::off;
+std::string s_executable;
+std::map<std::string, std::shared_ptr<host>> s_backend_hosts;
+// Hosts of single devices, by device name.
+std::multimap<std::string, std::weak_ptr<host>> s_device_hosts;
+std::atomic<SANE_Int> s_version_code(0);
+
+class host
+{
+public:
+  host(const std::string& name, const std::string& backend)
+    : m_name(name)
+    , m_backend(backend)
+  {}
+  ~host() { stop(); }
+
+  host(const host&) = delete;
+  host& operator=(const host&) = delete;
+
+  bool start(const std::string& executable);
+  // Closes the connection, and waits for the host to exit. A request in
+  // progress, such as a read waiting for scan data, fails rather than
+  // delay the stop.
+  void stop();
+  bool dead() const { return m_dead; }
+  Clock::time_point started() const { return m_started; }
+
+  // Sends a request, and waits for the reply. If the host has died or
+  // does not reply in time, it is killed, and false is returned. With a
+  // timeout of -1, waits indefinitely.
+  // Requests are serialized, including reads, so devices sharing a host
+  // never transfer data at the same time. Within try_calls, fails rather
+  // than wait for another request.
+  bool call(const message& request,
+            message& reply,
+            int timeout_ms = reply_timeout_ms);
+  SANE_Status read(int32_t id, SANE_Byte*, SANE_Int, SANE_Int*);
+  void cancel(int32_t id);
+  // Kills the host without waiting for a pending request, which then
+  // fails. Returns false if the host is not running.
+  bool terminate();
+
+private:
+  bool call_locked(const message& request, message& reply, int timeout_ms);
+  void kill(const char* reason);
+  void close_connection();
+  void reap(bool wait);
+
+  std::string m_name, m_backend, m_config_dir;
+  std::atomic<pid_t> m_pid{ -1 };
+  int m_control = -1, m_cancel = -1;
+  char* m_shm = nullptr;
+  std::atomic<bool> m_dead{ true };
+  Clock::time_point m_started;
+  // m_cancel_mutex is never held for long, and also guards closing the
+  // control connection, which stop() may shut down without m_mutex.
+  std::mutex m_mutex, m_cancel_mutex;
+};
+
+bool
+host::start(const std::string& executable)
+{
+  m_started = Clock::now();
+  // Created here rather than in the host, so it is removed even when
+  // the host is killed.
+  m_config_dir = create_backend_config({ m_backend });
+  if (m_config_dir.empty())
+    return false;
+  int control[2] = { -1, -1 }, cancel[2] = { -1, -1 };
+  static std::atomic<int> counter(0);
+  std::string shm_name = "/airsane-" + std::to_string(::getpid()) + "-" +
+                         std::to_string(++counter);
+  int shm = ::shm_open(shm_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (shm >= 0)
+    ::shm_unlink(shm_name.c_str());
+  bool ok = shm >= 0 && ::ftruncate(shm, shm_size) == 0 &&
+            ::socketpair(AF_UNIX, SOCK_STREAM, 0, control) == 0 &&
+            ::socketpair(AF_UNIX, SOCK_STREAM, 0, cancel) == 0;
+  void* p = MAP_FAILED;
+  if (ok)
+    p = ::mmap(nullptr, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, shm, 0);
+  ok = ok && p != MAP_FAILED;
+  if (!ok) {
+    std::cerr << "could not start SANE host for " << m_name << ": "
+              << ::strerror(errno) << std::endl;
+    for (int fd : { shm, control[0], control[1], cancel[0], cancel[1] })
+      if (fd >= 0)
+        ::close(fd);
+    remove_backend_config(m_config_dir);
+    m_config_dir.clear();
+    return false;
+  }
+  m_shm = static_cast<char*>(p);
+  // Other hosts must not inherit these.
+  for (int fd : { shm, control[0], control[1], cancel[0], cancel[1] })
+    ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // Only async-signal-safe calls are allowed between fork() and exec().
+  std::vector<char*> argv = { const_cast<char*>(executable.c_str()),
+                              const_cast<char*>(host_flag),
+                              const_cast<char*>(m_backend.c_str()),
+                              const_cast<char*>(m_config_dir.c_str()),
+                              nullptr };
+  struct rlimit limit = { 0, 0 };
+  int max_fd = 1024;
+  if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+    max_fd = std::min<rlim_t>(limit.rlim_cur, 65536);
+  m_pid = ::fork();
+  if (m_pid == 0) {
+    int fds[] = { control[1], cancel[1], shm };
+    for (int& fd : fds)
+      fd = ::fcntl(fd, F_DUPFD, 16);
+    for (int i = 0; i < 3; ++i) {
+      ::dup2(fds[i], control_fd + i);
+      ::fcntl(control_fd + i, F_SETFD, 0);
+    }
+    for (int fd = control_fd + 3; fd < max_fd; ++fd)
+      ::close(fd);
+    ::execv(argv[0], argv.data());
+    ::_exit(127);
+  }
+  ::close(control[1]);
+  ::close(cancel[1]);
+  ::close(shm);
+  if (m_pid < 0) {
+    std::cerr << "could not fork SANE host for " << m_name << ": "
+              << ::strerror(errno) << std::endl;
+    ::close(control[0]);
+    ::close(cancel[0]);
+    ::munmap(m_shm, shm_size);
+    m_shm = nullptr;
+    remove_backend_config(m_config_dir);
+    m_config_dir.clear();
+    return false;
+  }
+  m_control = control[0];
+  m_cancel = cancel[0];
+  m_dead = false;
+  std::clog << "started SANE host for " << m_name << ", pid " << m_pid
+            << std::endl;
+  return true;
+}
+
+void
+host::stop()
+{
+  pid_t pid = m_pid;
+  if (pid <= 0)
+    return;
+  std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    // A request holds the mutex, possibly a read waiting for data that
+    // never comes. The busy host would not notice the connection closing,
+    // so it is killed, and the pending request sees the end of the
+    // connection.
+    m_dead = true;
+    ::kill(pid, SIGKILL);
+    {
+      std::lock_guard<std::mutex> lock(m_cancel_mutex);
+      if (m_control >= 0)
+        ::shutdown(m_control, SHUT_RDWR);
+    }
+    lock.lock();
+  }
+  if (m_pid <= 0)
+    return;
+  close_connection();
+  m_dead = true;
+  reap(true);
+}
+
+void
+host::kill(const char* reason)
+{
+  std::cerr << "SANE host for " << m_name << " (pid " << m_pid << ") "
+            << reason << ", killing it" << std::endl;
+  ::kill(m_pid, SIGKILL);
+  close_connection();
+  m_dead = true;
+  reap(false);
+}
+
+void
+host::close_connection()
+{
+  std::lock_guard<std::mutex> lock(m_cancel_mutex);
+  ::close(m_cancel);
+  m_cancel = -1;
+  ::close(m_control);
+  m_control = -1;
+}
+
+// Waits for the host process to exit. Without waiting, a host that has
+// not exited is killed.
+void
+host::reap(bool wait)
+{
+  int status = 0;
+  pid_t pid = 0;
+  for (int i = 0; wait && i < 20; ++i) {
+    pid = ::waitpid(m_pid, &status, WNOHANG);
+    if (pid != 0)
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if (pid == 0) {
+    ::kill(m_pid, SIGKILL);
+    pid = ::waitpid(m_pid, &status, 0);
+  }
+  if (pid == m_pid) {
+    if (WIFSIGNALED(status))
+      std::clog << "SANE host for " << m_name << " terminated by signal "
+                << WTERMSIG(status) << std::endl;
+    else if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+      std::clog << "SANE host for " << m_name << " exited with status "
+                << WEXITSTATUS(status) << std::endl;
+  }
+  m_pid = -1;
+  if (m_shm)
+    ::munmap(m_shm, shm_size);
+  m_shm = nullptr;
+  remove_backend_config(m_config_dir);
+  m_config_dir.clear();
+}
+
+bool
+host::call(const message& request, message& reply, int timeout_ms)
+{
+  std::unique_lock<std::mutex> lock(m_mutex, std::defer_lock);
+  if (!trying_calls())
+    lock.lock();
+  else if (!lock.try_lock()) {
+    note_busy_call();
+    return false;
+  }
+  return call_locked(request, reply, timeout_ms);
+}
+
+bool
+host::call_locked(const message& request, message& reply, int timeout_ms)
+{
+  if (m_dead)
+    return false;
+  // When stopped during the request, the host is cleaned up by stop().
+  if (!send_frame(m_control, request)) {
+    if (!m_dead)
+      kill("has closed its connection");
+    return false;
+  }
+  if (!receive_frame(m_control, reply, timeout_ms)) {
+    if (!m_dead)
+      kill("has died or does not respond");
+    return false;
+  }
+  s_version_code = reply.get_int();
+  return reply.ok();
+}
+
+SANE_Status
+host::read(int32_t id, SANE_Byte* data, SANE_Int max_length, SANE_Int* length)
+{
+  *length = 0;
+  message request, reply;
+  request.put(op_read).put(id).put(std::min<SANE_Int>(max_length, shm_size));
+  // The shared memory is in use until the data has been copied.
+  std::lock_guard<std::mutex> lock(m_mutex);
+  if (!call_locked(request, reply, -1))
+    return SANE_STATUS_IO_ERROR;
+  SANE_Status status = static_cast<SANE_Status>(reply.get_int());
+  SANE_Int size = reply.get_int();
+  if (!reply.ok() || size < 0 || size > max_length ||
+      size > static_cast<SANE_Int>(shm_size))
+    return SANE_STATUS_IO_ERROR;
+  ::memcpy(data, m_shm, size);
+  *length = size;
+  return status;
+}
+
+void
+host::cancel(int32_t id)
+{
+  std::lock_guard<std::mutex> lock(m_cancel_mutex);
+  if (m_cancel >= 0)
+    send_frame(m_cancel, message().put(id));
+}
+
+bool
+host::terminate()
+{
+  pid_t pid = m_pid;
+  if (pid <= 0 || m_dead)
+    return false;
+  std::cerr << "terminating SANE host for " << m_name << " (pid " << pid
+            << ")" << std::endl;
+  return ::kill(pid, SIGKILL) == 0;
+}
+
+// Returns the host serving a backend, starting or restarting it
+// if necessary.
+std::shared_ptr<host>
+backend_host(const std::string& backend)
+{
+  std::lock_guard<std::mutex> lock(s_hosts_mutex);
+  auto& pHost = s_backend_hosts[backend];
+  if (pHost && pHost->dead()) {
+    auto since = Clock::now() - pHost->started();
+    if (since < std::chrono::seconds(restart_interval_seconds))
+      return nullptr;
+    std::clog << "restarting SANE host for " << backend << std::endl;
+    pHost.reset();
+  }
+  if (!pHost) {
+    pHost = std::make_shared<host>(backend, backend);
+    pHost->start(s_executable);
+  }
+  return pHost->dead() ? nullptr : pHost;
+}
+
+// A device opened in a host process. Option descriptors are fetched in a
+// single request, and again after a reload has been reported.
+class remote_device : public device_api
+{
+public:
+  remote_device(std::shared_ptr<host> pHost, int32_t id, bool owns_host)
+    : m_host(pHost)
+    , m_id(id)
+    , m_owns_host(owns_host)
+  {}
+
+  const SANE_Option_Descriptor* get_option_descriptor(SANE_Handle,
+                                                      SANE_Int n) override
+  {
+    if (m_stale && !fetch_descriptors())
+      return nullptr;
+    if (n < 1 || n > static_cast<SANE_Int>(m_descriptors.size()))
+      return nullptr;
+    return &m_descriptors[n - 1]->desc;
+  }
+
+  SANE_Status control_option(SANE_Handle h,
+                             SANE_Int n,
+                             SANE_Action action,
+                             void* v,
+                             SANE_Int* pInfo) override
+  {
+    const SANE_Option_Descriptor* desc = get_option_descriptor(h, n);
+    if (!desc)
+      return SANE_STATUS_INVAL;
+    size_t size = desc->size;
+    std::string value;
+    if (action == SANE_ACTION_SET_VALUE && v) {
+      if (desc->type == SANE_TYPE_STRING)
+        size = std::min(size, ::strlen(static_cast<const char*>(v)) + 1);
+      value.assign(static_cast<const char*>(v), size);
+    }
+    message request, reply;
+    request.put(op_control_option).put(m_id).put(n).put(action).put(value);
+    if (!m_host->call(request, reply))
+      return SANE_STATUS_IO_ERROR;
+    SANE_Status status = static_cast<SANE_Status>(reply.get_int());
+    SANE_Int info = reply.get_int();
+    std::string result = reply.get_string();
+    if (!reply.ok())
+      return SANE_STATUS_IO_ERROR;
+    if (v && action != SANE_ACTION_SET_AUTO)
+      ::memcpy(v, result.data(), std::min(size, result.size()));
+    if (pInfo)
+      *pInfo = info;
+    if (info & SANE_INFO_RELOAD_OPTIONS)
+      m_stale = true;
+    return status;
+  }
+
+  SANE_Status start(SANE_Handle) override
+  {
+    message reply;
+    if (!m_host->call(message().put(op_start).put(m_id), reply, -1))
+      return SANE_STATUS_IO_ERROR;
+    return static_cast<SANE_Status>(reply.get_int());
+  }
+
+  SANE_Status get_parameters(SANE_Handle, SANE_Parameters* p) override
+  {
+    message reply;
+    if (!m_host->call(message().put(op_get_parameters).put(m_id), reply))
+      return SANE_STATUS_IO_ERROR;
+    SANE_Status status = static_cast<SANE_Status>(reply.get_int());
+    p->format = static_cast<SANE_Frame>(reply.get_int());
+    p->last_frame = reply.get_int();
+    p->bytes_per_line = reply.get_int();
+    p->pixels_per_line = reply.get_int();
+    p->lines = reply.get_int();
+    p->depth = reply.get_int();
+    return reply.ok() ? status : SANE_STATUS_IO_ERROR;
+  }
+
+  SANE_Status read(SANE_Handle,
+                   SANE_Byte* data,
+                   SANE_Int max_length,
+                   SANE_Int* length) override
+  {
+    return m_host->read(m_id, data, max_length, length);
+  }
+
+  void cancel(SANE_Handle) override { m_host->cancel(m_id); }
+
+  bool terminate(SANE_Handle) override { return m_host->terminate(); }
+
+  // Scan data is read through blocking requests.
+  SANE_Status set_io_mode(SANE_Handle, SANE_Bool) override
+  {
+    return SANE_STATUS_UNSUPPORTED;
+  }
+  SANE_Status get_select_fd(SANE_Handle, SANE_Int*) override
+  {
+    return SANE_STATUS_UNSUPPORTED;
+  }
+
+  void close(SANE_Handle) override
+  {
+    message reply;
+    m_host->call(message().put(op_close).put(m_id), reply);
+    if (m_owns_host)
+      m_host->stop();
+  }
+
+private:
+  struct descriptor
+  {
+    SANE_Option_Descriptor desc;
+    std::string name, title, text;
+    SANE_Range range;
+    std::vector<SANE_Word> words;
+    std::vector<std::string> strings;
+    std::vector<SANE_String_Const> string_ptrs;
+  };
+
+  bool fetch_descriptors();
+
+  std::shared_ptr<host> m_host;
+  int32_t m_id;
+  bool m_owns_host;
+  bool m_stale = true;
+  // Pointers to the previous descriptors remain valid until the next
+  // fetch, as callers refresh them after a reload.
+  std::vector<std::unique_ptr<descriptor>> m_descriptors, m_previous;
+};
+
+bool
+remote_device::fetch_descriptors()
+{
+  message reply;
+  if (!m_host->call(message().put(op_get_descriptors).put(m_id), reply))
+    return false;
+  std::vector<std::unique_ptr<descriptor>> descriptors;
+  int32_t count = reply.get_int();
+  for (int32_t i = 0; reply.ok() && i < count; ++i) {
+    std::unique_ptr<descriptor> d(new descriptor);
+    ::memset(&d->desc, 0, sizeof(d->desc));
+    if (reply.get_cstr(d->name))
+      d->desc.name = d->name.c_str();
+    if (reply.get_cstr(d->title))
+      d->desc.title = d->title.c_str();
+    if (reply.get_cstr(d->text))
+      d->desc.desc = d->text.c_str();
+    d->desc.type = static_cast<SANE_Value_Type>(reply.get_int());
+    d->desc.unit = static_cast<SANE_Unit>(reply.get_int());
+    d->desc.size = reply.get_int();
+    d->desc.cap = reply.get_int();
+    d->desc.constraint_type = static_cast<SANE_Constraint_Type>(reply.get_int());
+    switch (d->desc.constraint_type) {
+      case SANE_CONSTRAINT_RANGE:
+        d->range.min = reply.get_int();
+        d->range.max = reply.get_int();
+        d->range.quant = reply.get_int();
+        d->desc.constraint.range = &d->range;
+        break;
+      case SANE_CONSTRAINT_WORD_LIST: {
+        int32_t n = reply.get_int();
+        d->words.push_back(n);
+        for (int32_t j = 0; reply.ok() && j < n; ++j)
+          d->words.push_back(reply.get_int());
+        d->desc.constraint.word_list = d->words.data();
+      } break;
+      case SANE_CONSTRAINT_STRING_LIST: {
+        int32_t n = reply.get_int();
+        for (int32_t j = 0; reply.ok() && j < n; ++j)
+          d->strings.push_back(reply.get_string());
+        for (const auto& s : d->strings)
+          d->string_ptrs.push_back(s.c_str());
+        d->string_ptrs.push_back(nullptr);
+        d->desc.constraint.string_list = d->string_ptrs.data();
+      } break;
+      case SANE_CONSTRAINT_NONE:
+        break;
+    }
+    descriptors.push_back(std::move(d));
+  }
+  if (!reply.ok())
+    return false;
+  m_previous = std::move(m_descriptors);
+  m_descriptors = std::move(descriptors);
+  m_stale = false;
+  return true;
+}
+
+} // namespace
+
+bool
+parse_host_mode(const std::string& s, host_mode& mode)
+{
+  if (s == "off" || s == "false" || s.empty())
+    mode = host_mode::off;
+  else if (s == "backend")
+    mode = host_mode::backend;
+  else if (s == "device")
+    mode = host_mode::device;
+  else
+    return false;
+  return true;
+}
+
+void
+set_host_mode(host_mode mode, const std::string& executable)
+{
+  std::lock_guard<std::mutex> lock(s_hosts_mutex);
+  s_mode = mode;
+  s_executable = executable;
+}
+
+host_mode
+get_host_mode()
+{
+  std::lock_guard<std::mutex> lock(s_hosts_mutex);
+  return s_mode;
+}
+
+bool
+run_host_if_requested(int argc, char** argv, int* exit_code)
+{
+  if (argc < 3 || std::string(argv[1]) != host_flag)
+    return false;
+  *exit_code = serve(argv[2], argc > 3 ? argv[3] : "");
+  return true;
+}
+
+SANE_Status
+host_get_devices(bool localonly, std::vector<device_info>& devices)
+{
+  // Backends are enumerated in parallel, each in its own host.
+  auto backends = backend_list();
+  std::vector<std::vector<device_info>> results(backends.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < backends.size(); ++i)
+    threads.emplace_back([&backends, &results, localonly, i] {
+      auto pHost = backend_host(backends[i]);
+      message reply;
+      if (!pHost ||
+          !pHost->call(message().put(op_get_devices).put(localonly), reply))
+        return;
+      if (reply.get_int() != SANE_STATUS_GOOD)
+        return;
+      int32_t count = reply.get_int();
+      for (int32_t j = 0; reply.ok() && j < count; ++j) {
+        device_info info;
+        info.name = reply.get_string();
+        info.vendor = reply.get_string();
+        info.model = reply.get_string();
+        info.type = reply.get_string();
+        if (reply.ok())
+          results[i].push_back(info);
+      }
+    });
+  for (auto& thread : threads)
+    thread.join();
+  devices.clear();
+  for (const auto& result : results)
+    devices.insert(devices.end(), result.begin(), result.end());
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+host_open(const std::string& name,
+          SANE_Handle* pHandle,
+          std::shared_ptr<device_api>* pApi)
+{
+  std::string backend = backend_of(name);
+  std::shared_ptr<host> pHost;
+  bool device_host = get_host_mode() == host_mode::device;
+  if (device_host) {
+    pHost = std::make_shared<host>(name, backend);
+    std::string executable;
+    {
+      std::lock_guard<std::mutex> lock(s_hosts_mutex);
+      executable = s_executable;
+      for (auto i = s_device_hosts.begin(); i != s_device_hosts.end();)
+        i = i->second.expired() ? s_device_hosts.erase(i) : ++i;
+      s_device_hosts.insert(std::make_pair(name, pHost));
+    }
+    if (!pHost->start(executable))
+      return SANE_STATUS_IO_ERROR;
+  } else {
+    pHost = backend_host(backend);
+    if (!pHost)
+      return SANE_STATUS_IO_ERROR;
+  }
+  message reply;
+  if (!pHost->call(message().put(op_open).put(name), reply))
+    return SANE_STATUS_IO_ERROR;
+  SANE_Status status = static_cast<SANE_Status>(reply.get_int());
+  int32_t id = reply.get_int();
+  if (!reply.ok())
+    return SANE_STATUS_IO_ERROR;
+  if (status != SANE_STATUS_GOOD)
+    return status;
+  auto pDevice = std::make_shared<remote_device>(pHost, id, device_host);
+  *pHandle = pDevice.get();
+  *pApi = pDevice;
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Int
+host_version_code()
+{
+  return s_version_code;
+}
+
+bool
+terminate_device_host(const std::string& device_name)
+{
+  std::vector<std::shared_ptr<host>> hosts;
+  {
+    std::lock_guard<std::mutex> lock(s_hosts_mutex);
+    auto range = s_device_hosts.equal_range(device_name);
+    for (auto i = range.first; i != range.second; ++i)
+      if (auto pHost = i->second.lock())
+        hosts.push_back(pHost);
+    auto i = s_backend_hosts.find(backend_of(device_name));
+    if (i != s_backend_hosts.end() && i->second)
+      hosts.push_back(i->second);
+  }
+  bool terminated = false;
+  for (const auto& pHost : hosts)
+    terminated = pHost->terminate() || terminated;
+  return terminated;
+}
+
+void
+stop_hosts()
+{
+  std::map<std::string, std::shared_ptr<host>> hosts;
+  {
+    std::lock_guard<std::mutex> lock(s_hosts_mutex);
+    hosts.swap(s_backend_hosts);
+  }
+  for (auto& entry : hosts)
+    if (entry.second)
+      entry.second->stop();
+}
+
+} // namespace sanecpp
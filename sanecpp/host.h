@@ -0,0 +1,122 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SANE_CPP_HOST_H
+#define SANE_CPP_HOST_H
+
+#include "sanecpp.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace sanecpp {
+
+// SANE entry points for an open device, either called directly or
+// forwarded to a host process.
+class device_api
+{
+public:
+  virtual ~device_api() {}
+  virtual const SANE_Option_Descriptor* get_option_descriptor(SANE_Handle,
+                                                              SANE_Int) = 0;
+  virtual SANE_Status control_option(SANE_Handle,
+                                     SANE_Int,
+                                     SANE_Action,
+                                     void*,
+                                     SANE_Int*) = 0;
+  virtual SANE_Status start(SANE_Handle) = 0;
+  virtual SANE_Status get_parameters(SANE_Handle, SANE_Parameters*) = 0;
+  virtual SANE_Status read(SANE_Handle, SANE_Byte*, SANE_Int, SANE_Int*) = 0;
+  virtual void cancel(SANE_Handle) = 0;
+  virtual SANE_Status set_io_mode(SANE_Handle, SANE_Bool) = 0;
+  virtual SANE_Status get_select_fd(SANE_Handle, SANE_Int*) = 0;
+  virtual void close(SANE_Handle) = 0;
+  // Interrupts a call blocked in the backend, leaving the device unusable.
+  // Returns false if not possible.
+  virtual bool terminate(SANE_Handle) { return false; }
+};
+// Calls SANE in this process.
+device_api*
+local_api();
+
+// With host processes, SANE backends are loaded in helper processes
+// rather than in the daemon, so a crashing or hanging backend does not
+// affect other scanners. A host process serves either all devices of
+// a single backend, or a single device. Hosts that die are restarted
+// when next used. Takes effect at the next sanecpp::init.
+enum class host_mode
+{
+  off,
+  backend,
+  device
+};
+bool
+parse_host_mode(const std::string&, host_mode&);
+void
+set_host_mode(host_mode, const std::string& executable);
+host_mode
+get_host_mode();
+
+// To be called first thing in main(). If the process has been started as
+// a host process, serves requests until the daemon closes the connection,
+// and returns true.
+bool
+run_host_if_requested(int argc, char** argv, int* exit_code);
+
+// Used by sanecpp when host processes are enabled.
+// Backends given to set_backends(), or else the system's backends.
+std::vector<std::string>
+backend_list();
+SANE_Status
+host_get_devices(bool localonly, std::vector<device_info>&);
+SANE_Status
+host_open(const std::string& name,
+          SANE_Handle*,
+          std::shared_ptr<device_api>*);
+SANE_Int
+host_version_code();
+// Whether the calling thread is within try_calls, and marks its calls as
+// having found the device busy.
+bool
+trying_calls();
+void
+note_busy_call();
+// A configuration directory as generated by set_backends(). Hosts are
+// given a directory created by the daemon, so it does not remain behind
+// when a host is killed.
+std::string
+create_backend_config(const std::vector<std::string>&);
+void
+remove_backend_config(const std::string& dir);
+// Uses an existing directory in place of set_backends(), without taking
+// ownership.
+void
+use_backend_config(const std::string& dir);
+void
+stop_hosts();
+
+// Kills the host processes serving a device, so calls blocked in them
+// return with an error. Returns false if there is no such host, e.g.
+// when the device's backend is loaded into the daemon.
+bool
+terminate_device_host(const std::string& device_name);
+
+} // namespace sanecpp
+
+#endif // SANE_CPP_HOST_H
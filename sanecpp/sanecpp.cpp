@@ -17,20 +17,128 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "sanecpp.h"
+#include "host.h"
+#include <sane/saneopts.h>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <limits>
 #include <locale>
 #include <map>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
 
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 namespace {
 // locale-independent conversions
 const std::locale clocale = std::locale("C");
 
+void
+removeConfigDir(const std::string& dir)
+{
+  ::unlink((dir + "/dll.conf").c_str());
+  ::rmdir((dir + "/dll.d").c_str());
+  ::rmdir(dir.c_str());
+}
+
+// A generated SANE configuration directory containing a dll.conf file,
+// and an empty dll.d directory. As the dll backend only reads the first
+// dll.d directory it finds, backends from the system's dll.d are not
+// loaded either.
+bool
+createConfigDir(const std::vector<std::string>& backends, std::string& dir)
+{
+  const char* tmp = ::getenv("TMPDIR");
+  std::string dirTemplate = std::string(tmp ? tmp : "/tmp") + "/airsane-sane.XXXXXX";
+  std::vector<char> buf(dirTemplate.begin(), dirTemplate.end());
+  buf.push_back(0);
+  if (!::mkdtemp(buf.data()))
+    return false;
+  dir = buf.data();
+  std::ofstream dllconf(dir + "/dll.conf");
+  for (const auto& backend : backends)
+    dllconf << backend << "\n";
+  dllconf.close();
+  if (!dllconf || ::mkdir((dir + "/dll.d").c_str(), 0700) != 0) {
+    removeConfigDir(dir);
+    dir.clear();
+    return false;
+  }
+  return true;
+}
+
+// Prepends a configuration directory to SANE_CONFIG_DIR. The directory
+// is removed again only if it has been created here.
+struct BackendConfig
+{
+  std::string mDir, mOriginalConfigDir;
+  bool mHadOriginalConfigDir = false, mActive = false;
+
+  ~BackendConfig() { remove(); }
+
+  bool create(const std::vector<std::string>& backends)
+  {
+    remove();
+    if (!createConfigDir(backends, mDir))
+      return false;
+    use(mDir);
+    return true;
+  }
+
+  void use(const std::string& dir)
+  {
+    if (!mActive) {
+      const char* env = ::getenv("SANE_CONFIG_DIR");
+      mHadOriginalConfigDir = env;
+      mOriginalConfigDir = env ? env : "";
+    }
+    // A trailing colon makes SANE append its default directories,
+    // so backend configuration files are still found there.
+    std::string configDir = dir + ":";
+    if (mHadOriginalConfigDir)
+      configDir += mOriginalConfigDir;
+    ::setenv("SANE_CONFIG_DIR", configDir.c_str(), 1);
+    mActive = true;
+  }
+
+  void remove()
+  {
+    if (!mDir.empty()) {
+      removeConfigDir(mDir);
+      mDir.clear();
+    }
+    if (mActive) {
+      if (mHadOriginalConfigDir)
+        ::setenv("SANE_CONFIG_DIR", mOriginalConfigDir.c_str(), 1);
+      else
+        ::unsetenv("SANE_CONFIG_DIR");
+      mActive = false;
+    }
+  }
+};
+BackendConfig backendConfig;
+std::vector<std::string> configuredBackends;
+
+void
+readBackends(std::istream& is, std::vector<std::string>& backends)
+{
+  std::string line;
+  while (std::getline(is, line)) {
+    std::string backend;
+    if (std::istringstream(line) >> backend && backend[0] != '#')
+      backends.push_back(backend);
+  }
+}
+
 } // namespace
 
 namespace sanecpp {
@@ -61,18 +169,433 @@ dtostr_c(double d)
 
 std::ostream log(nullptr);
 
+call_counts&
+thread_call_counts()
+{
+  static thread_local call_counts counts;
+  return counts;
+}
+
+struct try_state
+{
+  int depth = 0;
+  bool busy = false;
+};
+
+static try_state&
+thread_try_state()
+{
+  static thread_local try_state state;
+  return state;
+}
+
+try_calls::try_calls()
+{
+  if (thread_try_state().depth++ == 0)
+    thread_try_state().busy = false;
+}
+
+try_calls::~try_calls()
+{
+  --thread_try_state().depth;
+}
+
+bool
+try_calls::busy() const
+{
+  return thread_try_state().busy;
+}
+
+bool
+trying_calls()
+{
+  return thread_try_state().depth > 0;
+}
+
+void
+note_busy_call()
+{
+  thread_try_state().busy = true;
+}
+
+struct backend_lock
+{
+  concurrency level;
+  std::mutex mutex;
+};
+
+static std::mutex s_concurrency_mutex;
+static std::map<std::string, concurrency> s_concurrency;
+static std::map<std::string, std::shared_ptr<backend_lock>> s_backend_locks;
+static std::mutex s_global_call_mutex;
+
+static std::string
+backend_of(const std::string& device_name)
+{
+  return device_name.substr(0, device_name.find(':'));
+}
+
+static std::shared_ptr<backend_lock>
+get_backend_lock(const std::string& backend)
+{
+  std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+  auto& pLock = s_backend_locks[backend];
+  if (!pLock) {
+    pLock = std::make_shared<backend_lock>();
+    auto i = s_concurrency.find(backend);
+    pLock->level = i == s_concurrency.end() ? concurrency::backend : i->second;
+  }
+  return pLock;
+}
+
+static std::mutex*
+mutex_for(const std::shared_ptr<backend_lock>& pLock)
+{
+  if (!pLock)
+    return nullptr;
+  switch (pLock->level) {
+    case concurrency::parallel:
+      return nullptr;
+    case concurrency::backend:
+      return &pLock->mutex;
+    case concurrency::global:
+      return &s_global_call_mutex;
+  }
+  return nullptr;
+}
+
+void
+set_concurrency(const std::string& backend, concurrency level)
+{
+  std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+  s_concurrency[backend] = level;
+  // Devices already open keep the lock they were opened with.
+  s_backend_locks.erase(backend);
+}
+
+void
+clear_concurrency()
+{
+  std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+  s_concurrency.clear();
+  s_backend_locks.clear();
+}
+
+concurrency
+get_concurrency(const std::string& backend)
+{
+  std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+  auto i = s_concurrency.find(backend);
+  return i == s_concurrency.end() ? concurrency::backend : i->second;
+}
+
+bool
+parse_concurrency(const std::string& s, concurrency& level)
+{
+  if (s == "parallel")
+    level = concurrency::parallel;
+  else if (s == "backend")
+    level = concurrency::backend;
+  else if (s == "global")
+    level = concurrency::global;
+  else
+    return false;
+  return true;
+}
+
+const char*
+concurrency_name(concurrency level)
+{
+  switch (level) {
+    case concurrency::parallel:
+      return "parallel";
+    case concurrency::backend:
+      return "backend";
+    case concurrency::global:
+      return "global";
+  }
+  return "";
+}
+
+// Serializes SANE calls for a device according to its backend's
+// concurrency class. sane_cancel() is exempt, as it must be able to
+// interrupt a blocking call, including a sane_read() waiting for data.
+class call_guard
+{
+public:
+  // Within try_calls, does not wait for a busy backend, and makes the
+  // call fail instead.
+  explicit call_guard(const device_handle&);
+  explicit call_guard(const std::shared_ptr<backend_lock>&);
+  ~call_guard();
+
+  call_guard(const call_guard&) = delete;
+  call_guard& operator=(const call_guard&) = delete;
+
+  // The API to call the device through.
+  device_api* api() const;
+
+private:
+  void lock(const std::shared_ptr<backend_lock>&, bool wait = true);
+
+  std::mutex* m_mutex;
+  bool m_busy;
+  std::shared_ptr<device_api> m_api;
+};
+
+void
+sane_init_release();
+
+namespace {
+
+struct local_device_api : device_api
+{
+  const SANE_Option_Descriptor* get_option_descriptor(SANE_Handle h,
+                                                      SANE_Int n) override
+  {
+    return ::sane_get_option_descriptor(h, n);
+  }
+  SANE_Status control_option(SANE_Handle h,
+                             SANE_Int n,
+                             SANE_Action a,
+                             void* v,
+                             SANE_Int* i) override
+  {
+    return ::sane_control_option(h, n, a, v, i);
+  }
+  SANE_Status start(SANE_Handle h) override { return ::sane_start(h); }
+  SANE_Status get_parameters(SANE_Handle h, SANE_Parameters* p) override
+  {
+    return ::sane_get_parameters(h, p);
+  }
+  SANE_Status read(SANE_Handle h,
+                   SANE_Byte* data,
+                   SANE_Int max_length,
+                   SANE_Int* length) override
+  {
+    return ::sane_read(h, data, max_length, length);
+  }
+  void cancel(SANE_Handle h) override { ::sane_cancel(h); }
+  SANE_Status set_io_mode(SANE_Handle h, SANE_Bool b) override
+  {
+    return ::sane_set_io_mode(h, b);
+  }
+  SANE_Status get_select_fd(SANE_Handle h, SANE_Int* fd) override
+  {
+    return ::sane_get_select_fd(h, fd);
+  }
+  void close(SANE_Handle h) override { ::sane_close(h); }
+};
+
+// Fails all calls, in place of a device whose backend is busy.
+struct busy_device_api : device_api
+{
+  const SANE_Option_Descriptor* get_option_descriptor(SANE_Handle,
+                                                      SANE_Int) override
+  {
+    return nullptr;
+  }
+  SANE_Status control_option(SANE_Handle,
+                             SANE_Int,
+                             SANE_Action,
+                             void*,
+                             SANE_Int*) override
+  {
+    return SANE_STATUS_DEVICE_BUSY;
+  }
+  SANE_Status start(SANE_Handle) override { return SANE_STATUS_DEVICE_BUSY; }
+  SANE_Status get_parameters(SANE_Handle, SANE_Parameters*) override
+  {
+    return SANE_STATUS_DEVICE_BUSY;
+  }
+  SANE_Status read(SANE_Handle, SANE_Byte*, SANE_Int, SANE_Int* length) override
+  {
+    *length = 0;
+    return SANE_STATUS_DEVICE_BUSY;
+  }
+  void cancel(SANE_Handle) override {}
+  SANE_Status set_io_mode(SANE_Handle, SANE_Bool) override
+  {
+    return SANE_STATUS_DEVICE_BUSY;
+  }
+  SANE_Status get_select_fd(SANE_Handle, SANE_Int*) override
+  {
+    return SANE_STATUS_DEVICE_BUSY;
+  }
+  void close(SANE_Handle) override {}
+};
+
+} // namespace
+
+device_api*
+local_api()
+{
+  static local_device_api api;
+  return &api;
+}
+
+static device_api*
+busy_api()
+{
+  static busy_device_api api;
+  return &api;
+}
+
+// The lock an open device's calls are serialized with, and the API it is
+// called through. Looked up by handle, as the build has no RTTI for
+// std::get_deleter().
+struct handle_info
+{
+  std::shared_ptr<backend_lock> lock;
+  std::shared_ptr<device_api> api;
+};
+static std::map<SANE_Handle, handle_info> s_handles;
+
+// Closes a device handle.
+struct handle_deleter
+{
+  std::shared_ptr<backend_lock> lock;
+  std::shared_ptr<device_api> api;
+
+  void operator()(SANE_Handle h) const
+  {
+    {
+      call_guard guard(lock);
+      log << "sane_close(" << h << ")" << std::endl;
+      (api ? api.get() : local_api())->close(h);
+    }
+    {
+      std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+      s_handles.erase(h);
+    }
+    sane_init_release();
+  }
+};
+
+static handle_info
+find_handle(SANE_Handle h)
+{
+  std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+  auto i = s_handles.find(h);
+  return i == s_handles.end() ? handle_info() : i->second;
+}
+
+static device_api*
+api_of(const device_handle& d)
+{
+  auto pApi = find_handle(d.get()).api;
+  return pApi ? pApi.get() : local_api();
+}
+
+call_guard::call_guard(const device_handle& d)
+  : m_mutex(nullptr)
+  , m_busy(false)
+{
+  handle_info info = find_handle(d.get());
+  m_api = info.api;
+  lock(info.lock, !trying_calls());
+}
+
+// sane_get_devices() calls into every backend, so it is serialized with
+// calls for all devices of serialized backends.
+class enumeration_guard
+{
+public:
+  enumeration_guard()
+  {
+    std::set<std::mutex*> mutexes; // locked in address order
+    {
+      std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+      for (const auto& entry : s_backend_locks) {
+        std::mutex* pMutex = mutex_for(entry.second);
+        if (pMutex)
+          mutexes.insert(pMutex);
+      }
+    }
+    for (auto pMutex : mutexes) {
+      pMutex->lock();
+      m_mutexes.push_back(pMutex);
+    }
+  }
+  ~enumeration_guard()
+  {
+    for (auto i = m_mutexes.rbegin(); i != m_mutexes.rend(); ++i)
+      (*i)->unlock();
+  }
+
+  enumeration_guard(const enumeration_guard&) = delete;
+  enumeration_guard& operator=(const enumeration_guard&) = delete;
+
+private:
+  std::vector<std::mutex*> m_mutexes;
+};
+
+call_guard::call_guard(const std::shared_ptr<backend_lock>& pLock)
+  : m_mutex(nullptr)
+  , m_busy(false)
+{
+  lock(pLock);
+}
+
+void
+call_guard::lock(const std::shared_ptr<backend_lock>& pLock, bool wait)
+{
+  m_mutex = mutex_for(pLock);
+  if (!m_mutex)
+    return;
+  if (wait)
+    m_mutex->lock();
+  else if (!m_mutex->try_lock()) {
+    m_mutex = nullptr;
+    m_busy = true;
+    note_busy_call();
+  }
+}
+
+device_api*
+call_guard::api() const
+{
+  if (m_busy)
+    return busy_api();
+  return m_api ? m_api.get() : local_api();
+}
+
+call_guard::~call_guard()
+{
+  if (m_mutex)
+    m_mutex->unlock();
+}
+
+static SANE_Status
+control_option(const device_handle& d,
+               SANE_Int n,
+               SANE_Action a,
+               void* v,
+               SANE_Int* i)
+{
+  ++thread_call_counts().control_option;
+  call_guard guard(d);
+  return guard.api()->control_option(d.get(), n, a, v, i);
+}
+
 option option_set::s_nulloption;
 
 static int sane_init_refcount = 0;
 static std::mutex sane_init_mutex;
+static SANE_Int sane_version_code = 0;
+// With host processes, SANE is only initialized inside the hosts.
+static bool sane_in_hosts = false;
 
 void
 sane_init_addref()
 {
   std::lock_guard<std::mutex> lock(sane_init_mutex);
   if (++sane_init_refcount == 1) {
-    log << "sane_init(nullptr, nullptr)" << std::endl;
-    ::sane_init(nullptr, nullptr);
+    sane_in_hosts = get_host_mode() != host_mode::off;
+    if (!sane_in_hosts) {
+      log << "sane_init(&version_code, nullptr)" << std::endl;
+      ::sane_init(&sane_version_code, nullptr);
+    }
   }
 }
 
@@ -82,75 +605,270 @@ sane_init_release()
   std::lock_guard<std::mutex> lock(sane_init_mutex);
   assert(sane_init_refcount > 0);
   if (--sane_init_refcount == 0) {
-    log << "sane_exit()" << std::endl;
-    ::sane_exit();
+    if (sane_in_hosts) {
+      stop_hosts();
+    } else {
+      log << "sane_exit()" << std::endl;
+      ::sane_exit();
+    }
   }
 }
 
+// Only meaningful while holding a reference.
+static bool
+using_hosts()
+{
+  std::lock_guard<std::mutex> lock(sane_init_mutex);
+  return sane_in_hosts;
+}
+
 init::init()
 {
   sane_init_addref();
 }
 
+bool
+initialized()
+{
+  std::lock_guard<std::mutex> lock(sane_init_mutex);
+  return sane_init_refcount > 0;
+}
+
 init::~init()
 {
   sane_init_release();
 }
 
-option_set::option_set() {}
+SANE_Int
+version_code()
+{
+  std::lock_guard<std::mutex> lock(sane_init_mutex);
+  return sane_in_hosts ? host_version_code() : sane_version_code;
+}
+
+void
+set_backends(const std::vector<std::string>& backends)
+{
+  std::lock_guard<std::mutex> lock(sane_init_mutex);
+  if (sane_init_refcount > 0)
+    std::cerr << "SANE backends changed while SANE is initialized" << std::endl;
+  configuredBackends = backends;
+  if (backends.empty())
+    backendConfig.remove();
+  else if (!backendConfig.create(backends))
+    std::cerr << "could not create SANE configuration directory: "
+              << ::strerror(errno) << std::endl;
+  else
+    log << "SANE_CONFIG_DIR=" << ::getenv("SANE_CONFIG_DIR") << std::endl;
+}
+
+std::string
+create_backend_config(const std::vector<std::string>& backends)
+{
+  std::string dir;
+  if (!createConfigDir(backends, dir))
+    std::cerr << "could not create SANE configuration directory: "
+              << ::strerror(errno) << std::endl;
+  return dir;
+}
+
+void
+remove_backend_config(const std::string& dir)
+{
+  if (!dir.empty())
+    removeConfigDir(dir);
+}
+
+void
+use_backend_config(const std::string& dir)
+{
+  std::lock_guard<std::mutex> lock(sane_init_mutex);
+  configuredBackends.clear();
+  backendConfig.remove();
+  backendConfig.use(dir);
+}
+
+// Returns false if no dll.conf was found.
+static bool
+read_system_backends(std::vector<std::string>& backends)
+{
+  std::vector<std::string> dirs;
+  std::string configDir = backendConfig.mActive
+                            ? backendConfig.mOriginalConfigDir
+                            : (::getenv("SANE_CONFIG_DIR") ? ::getenv("SANE_CONFIG_DIR") : "");
+  std::istringstream iss(configDir);
+  std::string dir;
+  while (std::getline(iss, dir, ':'))
+    if (!dir.empty())
+      dirs.push_back(dir);
+  for (const char* d : { "/etc/sane.d", "/usr/local/etc/sane.d",
+                         "/opt/homebrew/etc/sane.d", "/opt/local/etc/sane.d" })
+    dirs.push_back(d);
+  bool found = false;
+  for (const auto& dir : dirs) {
+    std::ifstream dllconf(dir + "/dll.conf");
+    if (dllconf.is_open()) {
+      readBackends(dllconf, backends);
+      found = true;
+      break;
+    }
+  }
+  for (const auto& dir : dirs) {
+    DIR* pDir = ::opendir((dir + "/dll.d").c_str());
+    if (pDir) {
+      while (struct dirent* pEntry = ::readdir(pDir)) {
+        if (pEntry->d_name[0] == '.')
+          continue;
+        std::ifstream file(dir + "/dll.d/" + pEntry->d_name);
+        readBackends(file, backends);
+        found = true;
+      }
+      ::closedir(pDir);
+      break;
+    }
+  }
+  return found;
+}
+
+int
+system_backend_count()
+{
+  std::lock_guard<std::mutex> lock(sane_init_mutex);
+  std::vector<std::string> backends;
+  if (!read_system_backends(backends))
+    return -1;
+  return backends.size();
+}
+
+std::vector<std::string>
+backend_list()
+{
+  std::lock_guard<std::mutex> lock(sane_init_mutex);
+  std::vector<std::string> backends = configuredBackends;
+  if (backends.empty())
+    read_system_backends(backends);
+  std::sort(backends.begin(), backends.end());
+  backends.erase(std::unique(backends.begin(), backends.end()), backends.end());
+  return backends;
+}
+
+const char*
+known_option_name(known_option opt)
+{
+  static const char* names[] = {
+    SANE_NAME_SCAN_SOURCE,       SANE_NAME_SCAN_MODE,
+    SANE_NAME_BIT_DEPTH,         SANE_NAME_SCAN_RESOLUTION,
+    SANE_NAME_SCAN_X_RESOLUTION, SANE_NAME_SCAN_Y_RESOLUTION,
+    SANE_NAME_SCAN_TL_X,         SANE_NAME_SCAN_TL_Y,
+    SANE_NAME_SCAN_BR_X,         SANE_NAME_SCAN_BR_Y,
+  };
+  static_assert(sizeof(names) / sizeof(*names) ==
+                  static_cast<size_t>(known_option::count),
+                "known option names out of sync");
+  int i = static_cast<int>(opt);
+  return i >= 0 && i < static_cast<int>(known_option::count) ? names[i] : "";
+}
+
+option_set::option_set()
+{
+  clear();
+}
 
 option_set::option_set(device_handle h)
 {
   init(h);
 }
 
+void
+option_set::clear()
+{
+  m_options.clear();
+  m_index.clear();
+  for (auto& known : m_known)
+    known = -1;
+}
+
 void
 option_set::init(device_handle h)
 {
   m_device = h;
-  m_options.clear();
+  clear();
   if (h) {
+    call_guard guard(h);
     const SANE_Option_Descriptor* desc = nullptr;
-    for (int i = 1; (desc = ::sane_get_option_descriptor(h.get(), i)); ++i) {
-      if (desc->name && *desc->name)
-        m_options[desc->name] = option(this, desc, i);
-    }
+    device_api* api = guard.api();
+    for (int i = 1; (desc = api->get_option_descriptor(h.get(), i)); ++i)
+      m_options.push_back(option(this, desc, i));
   }
+  build_index();
 }
 
 void
 option_set::reload()
 {
+  ++thread_call_counts().option_reloads;
   SANE_Handle h = m_device.get();
+  call_guard guard(m_device);
+  // Descriptors are refetched, as backends may reallocate them, but
+  // options are normally neither added nor renamed by a reload.
+  bool renamed = false;
+  size_t count = 0;
   const SANE_Option_Descriptor* desc = nullptr;
-  for (int i = 1; (desc = ::sane_get_option_descriptor(h, i)); ++i) {
-    if (desc->name && *desc->name) {
-      auto j = m_options.find(desc->name);
-      if (j == m_options.end())
-        m_options[desc->name] = option(this, desc, i);
-      else {
-        j->second.m_desc = desc;
-        j->second.m_index = i;
+  device_api* api = guard.api();
+  for (int i = 1; (desc = api->get_option_descriptor(h, i)); ++i, ++count) {
+    if (count < m_options.size()) {
+      option& opt = m_options[count];
+      if (opt.m_desc != desc) {
+        const char* name = desc->name ? desc->name : "";
+        renamed = renamed || opt.m_name != name;
+        opt.m_desc = desc;
+        opt.m_name = name;
       }
+    } else {
+      m_options.push_back(option(this, desc, i));
+      renamed = true;
     }
   }
+  // Options that have disappeared become null options, as callers may
+  // still hold references to them.
+  for (; count < m_options.size(); ++count) {
+    option& opt = m_options[count];
+    renamed = renamed || !opt.m_name.empty();
+    opt.m_desc = nullptr;
+    opt.m_name.clear();
+  }
+  if (renamed)
+    build_index();
+}
+
+void
+option_set::build_index()
+{
+  m_index.clear();
+  for (size_t i = 0; i < m_options.size(); ++i)
+    if (!m_options[i].m_name.empty())
+      m_index[m_options[i].m_name] = i;
+  for (int i = 0; i < static_cast<int>(known_option::count); ++i) {
+    auto j = m_index.find(known_option_name(static_cast<known_option>(i)));
+    m_known[i] = j == m_index.end() ? -1 : j->second;
+  }
 }
 
 std::ostream&
 option_set::print(std::ostream& os) const
 {
   for (const auto& opt : m_options)
-    if (opt.second.is_active()) {
-      os << "\n[" << opt.first << "] = ";
-      if (opt.second.is_null())
+    if (!opt.name().empty() && opt.is_active()) {
+      os << "\n[" << opt.name() << "] = ";
+      if (opt.is_null())
         os << "null";
-      else if (opt.second.is_string())
-        os << "\"" << opt.second.string_value() << "\"";
-      else if (opt.second.array_size() == 1)
-        os << opt.second.value();
+      else if (opt.is_string())
+        os << "\"" << opt.string_value() << "\"";
+      else if (opt.array_size() == 1)
+        os << opt.value();
       else
-        for (int i = 0; i < opt.second.array_size(); ++i)
-          os << opt.second.value(i) << ' ';
+        for (int i = 0; i < opt.array_size(); ++i)
+          os << opt.value(i) << ' ';
     }
   return os;
 }
@@ -158,21 +876,36 @@ option_set::print(std::ostream& os) const
 option&
 option_set::operator[](const std::string& s)
 {
-  auto i = m_options.find(s);
-  return i == m_options.end() ? s_nulloption : i->second;
+  auto i = m_index.find(s);
+  return i == m_index.end() ? s_nulloption : m_options[i->second];
 }
 
 const option&
 option_set::operator[](const std::string& s) const
 {
-  auto i = m_options.find(s);
-  return i == m_options.end() ? s_nulloption : i->second;
+  auto i = m_index.find(s);
+  return i == m_index.end() ? s_nulloption : m_options[i->second];
+}
+
+option&
+option_set::operator[](known_option opt)
+{
+  int i = m_known[static_cast<int>(opt)];
+  return i < 0 ? s_nulloption : m_options[i];
+}
+
+const option&
+option_set::operator[](known_option opt) const
+{
+  int i = m_known[static_cast<int>(opt)];
+  return i < 0 ? s_nulloption : m_options[i];
 }
 
 option::option(option_set* set, const SANE_Option_Descriptor* d, SANE_Int i)
   : m_set(set)
   , m_desc(d)
   , m_index(i)
+  , m_name(d && d->name ? d->name : "")
 {}
 
 option::option()
@@ -283,6 +1016,29 @@ option::value(int index) const
   return "n/a";
 }
 
+bool
+option::has_value(int index, const std::string& value) const
+{
+  if (is_string())
+    return index == 0 && string_value() == value;
+  return has_value(index, strtod_c(value));
+}
+
+bool
+option::has_value(int index, double value) const
+{
+  if (is_string())
+    return has_value(index, dtostr_c(value));
+  if (!is_numeric() || index < 0 || index >= array_size())
+    return false;
+  double current = numeric_value(index);
+  if (std::isnan(current))
+    return false;
+  if (m_desc->type == SANE_TYPE_FIXED)
+    return SANE_FIX(current) == SANE_FIX(value);
+  return static_cast<SANE_Word>(current) == static_cast<SANE_Word>(value);
+}
+
 bool
 option::set_string_value(int index, const std::string& value)
 {
@@ -296,8 +1052,9 @@ option::set_string_value(int index, const std::string& value)
   if (!is_settable() || !is_active())
     return false;
   SANE_Int info = 0;
-  SANE_Status status = ::sane_control_option(
-    h, m_index, SANE_ACTION_SET_VALUE, const_cast<char*>(value.c_str()), &info);
+  SANE_Status status = control_option(
+    m_set->m_device, m_index, SANE_ACTION_SET_VALUE,
+    const_cast<char*>(value.c_str()), &info);
   log << "[" << m_desc->name << "] := \"" << value << "\"";
   if (status != SANE_STATUS_GOOD)
     log << " -> " << status;
@@ -316,7 +1073,8 @@ option::string_value(int index) const
   SANE_Handle h = m_set ? m_set->m_device.get() : nullptr;
   if (h && is_string() && index == 0) {
     std::vector<SANE_Char> value(m_desc->size);
-    SANE_Status status = ::sane_control_option(h, m_index, SANE_ACTION_GET_VALUE, value.data(), nullptr);
+    SANE_Status status = control_option(
+      m_set->m_device, m_index, SANE_ACTION_GET_VALUE, value.data(), nullptr);
     if (status == SANE_STATUS_GOOD)
       s = value.data();
     else
@@ -352,17 +1110,17 @@ option::set_numeric_value(int index, double value)
   SANE_Int info = 0;
   SANE_Status status = SANE_STATUS_GOOD;
   if (array_size() == 1 && index == 0) {
-    status =
-      ::sane_control_option(h, m_index, SANE_ACTION_SET_VALUE, &w, &info);
+    status = control_option(
+      m_set->m_device, m_index, SANE_ACTION_SET_VALUE, &w, &info);
     log << "[" << m_desc->name << "] := " << value << m_desc->unit;
   } else if (index >= 0 && index < array_size()) {
     std::vector<SANE_Word> data(array_size());
-    status = ::sane_control_option(
-      h, m_index, SANE_ACTION_GET_VALUE, data.data(), &info);
+    status = control_option(
+      m_set->m_device, m_index, SANE_ACTION_GET_VALUE, data.data(), &info);
     if (status == SANE_STATUS_GOOD) {
       data[index] = w;
-      status = ::sane_control_option(
-        h, m_index, SANE_ACTION_SET_VALUE, data.data(), &info);
+      status = control_option(
+        m_set->m_device, m_index, SANE_ACTION_SET_VALUE, data.data(), &info);
     }
     log << "[" << m_desc->name << "][" << index << "] := " << value
         << m_desc->unit;
@@ -380,6 +1138,36 @@ option::set_numeric_value(int index, double value)
   return status == SANE_STATUS_GOOD;
 }
 
+bool
+option::set_numeric_values(const std::vector<double>& values)
+{
+  SANE_Handle h = m_set ? m_set->m_device.get() : nullptr;
+  if (!h)
+    return false;
+  if (!is_numeric() || !is_settable() || !is_active())
+    return false;
+  if (values.size() != static_cast<size_t>(array_size())) {
+    log << "invalid array size for parameter " << m_desc->name << ": "
+        << values.size() << std::endl;
+    return false;
+  }
+  std::vector<SANE_Word> data(values.size());
+  for (size_t i = 0; i < values.size(); ++i)
+    data[i] = m_desc->type == SANE_TYPE_FIXED ? SANE_FIX(values[i]) : values[i];
+  SANE_Int info = 0;
+  SANE_Status status = control_option(
+    m_set->m_device, m_index, SANE_ACTION_SET_VALUE, data.data(), &info);
+  log << "[" << m_desc->name << "] := " << values.size() << " values";
+  if (status != SANE_STATUS_GOOD)
+    log << " -> " << status;
+  else if (info & SANE_INFO_RELOAD_OPTIONS)
+    log << " -> reload options";
+  log << std::endl;
+  if (info & SANE_INFO_RELOAD_OPTIONS)
+    m_set->reload();
+  return status == SANE_STATUS_GOOD;
+}
+
 double
 option::numeric_value(int index) const
 {
@@ -390,7 +1178,8 @@ option::numeric_value(int index) const
   if (index < 0 || index >= array_size())
     return value;
   std::vector<SANE_Word> data(array_size());
-  SANE_Status status = ::sane_control_option(h, m_index, SANE_ACTION_GET_VALUE, data.data(), nullptr);
+  SANE_Status status = control_option(
+    m_set->m_device, m_index, SANE_ACTION_GET_VALUE, data.data(), nullptr);
   if (status != SANE_STATUS_GOOD) {
     log << "sane_control_option(" << h << ", " << m_index << ", SANE_ACTION_GET_VALUE) -> " << status << std::endl;
     return value;
@@ -485,23 +1274,27 @@ device_handle
 open(const std::string& name, SANE_Status* pStatus)
 {
   sane_init_addref();
-  log << "sane_open(" << name << ") -> ";
+  auto pLock = get_backend_lock(backend_of(name));
   SANE_Handle h;
-  SANE_Status status = ::sane_open(name.c_str(), &h);
+  SANE_Status status;
+  std::shared_ptr<device_api> pApi;
+  {
+    call_guard guard(pLock);
+    log << "sane_open(" << name << ") -> ";
+    if (using_hosts())
+      status = host_open(name, &h, &pApi);
+    else
+      status = ::sane_open(name.c_str(), &h);
+  }
   if (pStatus)
     *pStatus = status;
   if (SANE_STATUS_GOOD == status) {
     log << h << std::endl;
-    struct handle_deleter
     {
-      void operator()(SANE_Handle h) const
-      {
-        log << "sane_close(" << h << ")" << std::endl;
-        ::sane_close(h);
-        sane_init_release();
-      }
-    };
-    return std::shared_ptr<void>(h, handle_deleter());
+      std::lock_guard<std::mutex> lock(s_concurrency_mutex);
+      s_handles[h] = handle_info{ pLock, pApi };
+    }
+    return std::shared_ptr<void>(h, handle_deleter{ pLock, pApi });
   } else {
     log << "SANE_Status " << status << std::endl;
   }
@@ -521,33 +1314,61 @@ enumerate_devices(bool localonly)
   std::vector<device_info> devices;
   const SANE_Device** p;
   sane_init_addref();
-  log << "sane_get_devices() ..." << std::endl;
-  SANE_Status status = ::sane_get_devices(&p, localonly);
-  log << "... sane_get_devices() -> SANE_Status " << status << std::endl;
-  if (status == SANE_STATUS_GOOD)
-    while (*p) {
-      device_info info;
-      info.name = (*p)->name;
-      info.vendor = (*p)->vendor;
-      info.model = (*p)->model;
-      info.type = (*p)->type;
-      devices.push_back(info);
-      ++p;
-    }
+  if (using_hosts()) {
+    SANE_Status status = host_get_devices(localonly, devices);
+    log << "host_get_devices() -> SANE_Status " << status << std::endl;
+    sane_init_release();
+    return devices;
+  }
+  {
+    enumeration_guard guard;
+    log << "sane_get_devices() ..." << std::endl;
+    SANE_Status status = ::sane_get_devices(&p, localonly);
+    log << "... sane_get_devices() -> SANE_Status " << status << std::endl;
+    // The list is only valid until the next call.
+    if (status == SANE_STATUS_GOOD)
+      while (*p) {
+        device_info info;
+        info.name = (*p)->name;
+        info.vendor = (*p)->vendor;
+        info.model = (*p)->model;
+        info.type = (*p)->type;
+        devices.push_back(info);
+        ++p;
+      }
+  }
   sane_init_release();
   return devices;
 }
 
 session::session(const std::string& devicename)
-  : m_status(SANE_STATUS_GOOD)
+  : m_options(std::make_shared<option_set>())
+  , m_status(SANE_STATUS_GOOD)
+  , m_block_fill(0)
+  , m_block_lines(0)
 {
   m_device = sanecpp::open(devicename, &m_status);
   init();
 }
 
-session::session(device_handle h)
+session::session(device_handle h, SANE_Status status)
   : m_device(h)
-  , m_status(h ? SANE_STATUS_GOOD : SANE_STATUS_DEVICE_BUSY)
+  , m_options(std::make_shared<option_set>())
+  , m_status(h ? SANE_STATUS_GOOD : status)
+  , m_block_fill(0)
+  , m_block_lines(0)
+{
+  init();
+}
+
+session::session(device_handle h,
+                 std::shared_ptr<option_set> options,
+                 SANE_Status status)
+  : m_device(h)
+  , m_options(options ? options : std::make_shared<option_set>())
+  , m_status(h ? SANE_STATUS_GOOD : status)
+  , m_block_fill(0)
+  , m_block_lines(0)
 {
   init();
 }
@@ -564,15 +1385,21 @@ session::~session()
 session&
 session::start()
 {
-  m_status = ::sane_start(m_device.get());
+  {
+    call_guard guard(m_device);
+    device_api* api = guard.api();
+    m_status = api->start(m_device.get());
+    if (m_status == SANE_STATUS_GOOD)
+      m_status = api->get_parameters(m_device.get(), &m_parameters);
+  }
   switch (m_status) {
     case SANE_STATUS_GOOD:
       break;
     default:
       log << "sane_start(" << m_device.get() << "): " << m_status << std::endl;
   }
-  if (m_status == SANE_STATUS_GOOD)
-    m_status = ::sane_get_parameters(m_device.get(), &m_parameters);
+  m_block_fill = 0;
+  m_block_lines = 0;
   return *this;
 }
 
@@ -581,11 +1408,20 @@ session::cancel()
 {
   if (m_device) {
     log << "sane_cancel(" << m_device.get() << ")" << std::endl;
-    ::sane_cancel(m_device.get());
+    api_of(m_device)->cancel(m_device.get());
   }
   return *this;
 }
 
+bool
+session::force_close()
+{
+  if (!m_device)
+    return false;
+  log << "force closing " << m_device.get() << std::endl;
+  return api_of(m_device)->terminate(m_device.get());
+}
+
 session&
 session::read(std::vector<char>& buffer)
 {
@@ -594,8 +1430,9 @@ session::read(std::vector<char>& buffer)
   SANE_Byte* p = reinterpret_cast<SANE_Byte*>(buffer.data());
   while (status == SANE_STATUS_GOOD && total < buffer.size()) {
     SANE_Int read;
+    call_guard guard(m_device);
     status =
-      ::sane_read(m_device.get(), p + total, buffer.size() - total, &read);
+      guard.api()->read(m_device.get(), p + total, buffer.size() - total, &read);
     total += read;
   }
   switch (status) {
@@ -608,10 +1445,82 @@ session::read(std::vector<char>& buffer)
   return *this;
 }
 
+session&
+session::read_lines(char*& data, int& lines)
+{
+  // Large blocks keep the number of sane_read() calls per page low.
+  const size_t block_size = 256 * 1024;
+  data = nullptr;
+  lines = 0;
+  size_t bpl = m_parameters.bytes_per_line;
+  if (bpl == 0) {
+    m_status = SANE_STATUS_INVAL;
+    return *this;
+  }
+  size_t consumed = m_block_lines * bpl;
+  if (consumed > 0)
+    ::memmove(m_block.data(), m_block.data() + consumed, m_block_fill - consumed);
+  m_block_fill -= consumed;
+  m_block_lines = 0;
+  size_t size = std::max<size_t>(1, block_size / bpl) * bpl;
+  if (m_block.size() != size)
+    m_block.resize(size);
+
+  SANE_Status status = SANE_STATUS_GOOD;
+  SANE_Byte* p = reinterpret_cast<SANE_Byte*>(m_block.data());
+  // Backends return what they have buffered, up to the size requested,
+  // so read until at least one line is complete.
+  while (status == SANE_STATUS_GOOD && m_block_fill < bpl) {
+    SANE_Int read = 0;
+    call_guard guard(m_device);
+    status = guard.api()->read(
+      m_device.get(), p + m_block_fill, size - m_block_fill, &read);
+    m_block_fill += read;
+    if (read == 0)
+      break;
+  }
+  switch (status) {
+    case SANE_STATUS_GOOD:
+      break;
+    case SANE_STATUS_EOF:
+      if (m_block_fill % bpl)
+        log << "sane_read(" << m_device.get() << "): discarding "
+            << m_block_fill % bpl << " bytes of incomplete line" << std::endl;
+      break;
+    default:
+      log << "sane_read(" << m_device.get() << "): " << status << std::endl;
+  }
+  m_block_lines = m_block_fill / bpl;
+  if (status != SANE_STATUS_GOOD)
+    m_block_fill = m_block_lines * bpl;
+  data = m_block.data();
+  lines = m_block_lines;
+  m_status = status;
+  return *this;
+}
+
+bool
+session::set_nonblocking(bool nonblocking)
+{
+  call_guard guard(m_device);
+  return guard.api()->set_io_mode(m_device.get(), nonblocking) ==
+         SANE_STATUS_GOOD;
+}
+
+int
+session::select_fd() const
+{
+  SANE_Int fd = -1;
+  call_guard guard(m_device);
+  if (guard.api()->get_select_fd(m_device.get(), &fd) != SANE_STATUS_GOOD)
+    return -1;
+  return fd;
+}
+
 const session&
 session::dump_options() const
 {
-  log << "session " << m_device.get() << " options:" << m_options
+  log << "session " << m_device.get() << " options:" << *m_options
       << std::endl;
   return *this;
 }
@@ -620,7 +1529,10 @@ void
 session::init()
 {
   ::memset(&m_parameters, 0, sizeof(m_parameters));
-  m_options.init(m_device);
+  if (m_device && m_options->device() == m_device)
+    m_options->reload();
+  else
+    m_options->init(m_device);
 }
 
 std::ostream&
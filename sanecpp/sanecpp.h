@@ -19,11 +19,13 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef SANE_CPP_H
 #define SANE_CPP_H
 
+#include <deque>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <sane/sane.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace sanecpp {
@@ -43,6 +45,73 @@ struct init
     init();
     ~init();
 };
+// Whether SANE is initialized, i.e. an init object or an open device
+// exists. A call that never returns may keep SANE initialized for good.
+bool
+initialized();
+// as reported by sane_init()
+SANE_Int
+version_code();
+
+// Restricts the backends loaded by the SANE dll backend to the ones given,
+// by generating a configuration directory and prepending it to
+// SANE_CONFIG_DIR. An empty list restores the system configuration.
+// Takes effect at the next call to sane_init().
+void
+set_backends(const std::vector<std::string>&);
+// Number of backends listed in the system's dll.conf and dll.d,
+// or -1 if unknown.
+int
+system_backend_count();
+
+// How calls for different devices served by the same backend are
+// serialized, including reads of scan data. A single device is never used
+// from two threads at once. sane_cancel() is never serialized, so it may
+// interrupt a read in progress.
+enum class concurrency
+{
+  parallel, // calls for different devices may overlap
+  backend,  // calls for all devices of the backend are serialized
+  global    // serialized with calls to all other backends of this class
+};
+// Sets the concurrency class of a backend, i.e. of devices whose names
+// start with the backend name and a colon. Applies to devices opened
+// afterwards. Backends default to concurrency::backend.
+void
+set_concurrency(const std::string& backend, concurrency);
+void
+clear_concurrency();
+concurrency
+get_concurrency(const std::string& backend);
+bool
+parse_concurrency(const std::string&, concurrency&);
+const char*
+concurrency_name(concurrency);
+
+// Number of SANE calls made from the calling thread, for profiling.
+struct call_counts
+{
+  unsigned long control_option = 0, option_reloads = 0;
+};
+call_counts&
+thread_call_counts();
+
+// While an instance exists, SANE calls from the calling thread fail with
+// SANE_STATUS_DEVICE_BUSY rather than wait for calls from other threads
+// to the same backend or host process, so background tasks are not held
+// up by a scan in progress.
+class try_calls
+{
+public:
+  try_calls();
+  ~try_calls();
+
+  try_calls(const try_calls&) = delete;
+  try_calls& operator=(const try_calls&) = delete;
+
+  // Whether a call has failed because the device was busy.
+  bool busy() const;
+};
 
 struct device_info
 {
@@ -65,6 +134,25 @@ print(std::ostream&, SANE_Unit);
 
 class option_set;
 
+// Options used for every scan, resolved to descriptor indices once
+// per option set rather than looked up by name on each access.
+enum class known_option
+{
+  source,
+  mode,
+  bit_depth,
+  resolution,
+  x_resolution,
+  y_resolution,
+  tl_x,
+  tl_y,
+  br_x,
+  br_y,
+  count
+};
+const char*
+known_option_name(known_option);
+
 class option
 {
 private:
@@ -73,6 +161,8 @@ private:
 public:
   option();
 
+  const std::string& name() const { return m_name; }
+
   option& operator=(const std::string&);
   option& operator=(double);
 
@@ -92,6 +182,11 @@ public:
   bool set_value(int index, double value);
   bool set_value(double d) { return set_value(0, d); }
   std::string value(int = 0) const;
+  // Whether setting the value would leave the option unchanged.
+  bool has_value(int index, const std::string& value) const;
+  bool has_value(const std::string& s) const { return has_value(0, s); }
+  bool has_value(int index, double value) const;
+  bool has_value(double d) const { return has_value(0, d); }
 
   bool set_string_value(int index, const std::string& value);
   bool set_string_value(const std::string& value)
@@ -103,6 +198,8 @@ public:
 
   bool set_numeric_value(int index, double);
   bool set_numeric_value(double value) { return set_numeric_value(0, value); }
+  // Sets all elements of an array option in a single call.
+  bool set_numeric_values(const std::vector<double>&);
   double numeric_value(int index = 0) const;
   std::vector<double> allowed_numeric_values() const;
 
@@ -116,6 +213,7 @@ private:
   option_set* m_set;
   const SANE_Option_Descriptor* m_desc;
   SANE_Int m_index;
+  std::string m_name;
 };
 
 class option_set
@@ -128,29 +226,43 @@ public:
   explicit option_set(device_handle);
 
   void init(device_handle);
+  // Refreshes descriptors after SANE_INFO_RELOAD_OPTIONS. The name index
+  // is only rebuilt if options have been added, removed, or renamed.
   void reload();
 
+  const device_handle& device() const { return m_device; }
+
   std::ostream& print(std::ostream&) const;
-  void clear() { m_options.clear(); }
+  void clear();
 
-  bool empty() const { return m_options.empty(); }
-  size_t size() const { return m_options.size(); }
+  bool empty() const { return m_index.empty(); }
+  size_t size() const { return m_index.size(); }
 
   option& operator[](const std::string&);
   const option& operator[](const std::string&) const;
+  option& operator[](known_option);
+  const option& operator[](known_option) const;
 
-  typedef std::map<std::string, option>::iterator iterator;
+  // Iterates over all descriptors in device order, including unnamed
+  // ones such as option groups.
+  typedef std::deque<option>::iterator iterator;
   iterator begin() { return m_options.begin(); }
   iterator end() { return m_options.end(); }
 
-  typedef std::map<std::string, option>::const_iterator const_iterator;
+  typedef std::deque<option>::const_iterator const_iterator;
   const_iterator begin() const { return m_options.begin(); }
   const_iterator end() const { return m_options.end(); }
 
 private:
+  void build_index();
+
   friend class option;
   device_handle m_device;
-  std::map<std::string, option> m_options;
+  // m_options[i] holds SANE option i + 1. A deque keeps references to
+  // options valid when a reload adds options.
+  std::deque<option> m_options;
+  std::unordered_map<std::string, size_t> m_index;
+  int m_known[static_cast<int>(known_option::count)];
   static option s_nulloption;
 };
 
@@ -158,27 +270,48 @@ class session
 {
 public:
   explicit session(const std::string& devicename);
-  explicit session(device_handle);
+  // If the handle is null, status() will be the status given.
+  explicit session(device_handle, SANE_Status = SANE_STATUS_DEVICE_BUSY);
+  // Uses the option set given, which may be kept along with the device
+  // handle between sessions. If it already belongs to the handle, it is
+  // reloaded rather than built again.
+  session(device_handle, std::shared_ptr<option_set>, SANE_Status);
   ~session();
 
-  option_set& options() { return m_options; }
-  const option_set& options() const { return m_options; }
+  option_set& options() { return *m_options; }
+  const option_set& options() const { return *m_options; }
 
   SANE_Status status() const { return m_status; }
   const SANE_Parameters* parameters() const { return &m_parameters; }
 
   session& start();
   session& cancel();
+  // Interrupts a call that does not return after cancel(), by terminating
+  // the host process serving the device. Returns false when the backend
+  // runs in this process, where this is not possible.
+  bool force_close();
   session& read(std::vector<char>&);
+  // Reads a block of scan data, and points data to the complete lines
+  // read. A partial line is kept until the next call. In non-blocking
+  // mode, lines may be 0 while status() is SANE_STATUS_GOOD.
+  session& read_lines(char*& data, int& lines);
   const session& dump_options() const;
 
+  // Non-blocking I/O, if supported by the backend, may be enabled after
+  // start(). select_fd() becomes readable when data is available,
+  // or is -1 if not supported.
+  bool set_nonblocking(bool);
+  int select_fd() const;
+
 private:
   void init();
 
   device_handle m_device;
-  option_set m_options;
+  std::shared_ptr<option_set> m_options;
   SANE_Status m_status;
   SANE_Parameters m_parameters;
+  std::vector<char> m_block;
+  size_t m_block_fill, m_block_lines;
 };
 
 } // namespace sanecpp
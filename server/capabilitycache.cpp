@@ -0,0 +1,120 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "capabilitycache.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include <sys/stat.h>
+
+namespace {
+// Creates the directories leading to a file, if they do not exist yet.
+// Only systemd creates the default cache directory for us.
+bool
+createParentDirectories(const std::string& path)
+{
+  size_t pos = 0;
+  while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+    std::string dir = path.substr(0, pos);
+    if (::mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+      return false;
+  }
+  return true;
+}
+} // namespace
+
+CapabilityCache::CapabilityCache(const std::string& path)
+  : mPath(path)
+{
+  load();
+}
+
+void
+CapabilityCache::load()
+{
+  std::ifstream file(mPath);
+  if (!file.is_open())
+    return;
+  std::string line;
+  Entry* pEntry = nullptr;
+  while (std::getline(file, line)) {
+    if (line.empty() || line.front() == '#')
+      continue;
+    if (line.front() == '[' && line.back() == ']') {
+      pEntry = &mEntries[line.substr(1, line.length() - 2)];
+    } else if (pEntry && line.rfind("key ", 0) == 0 && pEntry->key.empty()) {
+      pEntry->key = line.substr(4);
+    } else if (pEntry) {
+      pEntry->data += line + "\n";
+    }
+  }
+  std::clog << "read " << mEntries.size() << " entries from capability cache "
+            << mPath << std::endl;
+}
+
+bool
+CapabilityCache::save() const
+{
+  if (!createParentDirectories(mPath))
+    std::cerr << "could not create directory for capability cache " << mPath
+              << std::endl;
+  std::string tempPath = mPath + ".tmp";
+  std::ofstream file(tempPath);
+  file << "# AirSane capability cache, generated automatically\n";
+  for (const auto& entry : mEntries)
+    file << "[" << entry.first << "]\n"
+         << "key " << entry.second.key << "\n"
+         << entry.second.data;
+  file.close();
+  if (!file || ::rename(tempPath.c_str(), mPath.c_str()) != 0) {
+    std::cerr << "could not write capability cache " << mPath << std::endl;
+    std::remove(tempPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool
+CapabilityCache::lookup(const std::string& name,
+                        const std::string& key,
+                        std::string& data) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto i = mEntries.find(name);
+  if (i == mEntries.end() || i->second.key != key)
+    return false;
+  data = i->second.data;
+  return true;
+}
+
+void
+CapabilityCache::store(const std::string& name,
+                       const std::string& key,
+                       const std::string& data)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto& entry = mEntries[name];
+  if (entry.key == key && entry.data == data)
+    return;
+  entry.key = key;
+  entry.data = data;
+  save();
+}
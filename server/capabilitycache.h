@@ -0,0 +1,57 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPABILITY_CACHE_H
+#define CAPABILITY_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+
+// A text file holding scanner capabilities, to avoid probing devices at
+// each startup. Entries are stored by scanner name, and are only returned
+// if their key matches.
+class CapabilityCache
+{
+  CapabilityCache(const CapabilityCache&) = delete;
+  CapabilityCache& operator=(const CapabilityCache&) = delete;
+
+public:
+  explicit CapabilityCache(const std::string& path);
+  const std::string& path() const { return mPath; }
+
+  bool lookup(const std::string& name, const std::string& key,
+              std::string& data) const;
+  // Writes the cache file if data has changed.
+  void store(const std::string& name, const std::string& key,
+             const std::string& data);
+
+private:
+  void load();
+  bool save() const;
+
+  std::string mPath;
+  mutable std::mutex mMutex;
+  struct Entry
+  {
+    std::string key, data;
+  };
+  std::map<std::string, Entry> mEntries;
+};
+
+#endif // CAPABILITY_CACHE_H
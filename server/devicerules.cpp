@@ -0,0 +1,148 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "devicerules.h"
+
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+bool
+isSpecial(char c)
+{
+  return c != 0 && ::strchr("^$\\.*+?()[]{}|", c);
+}
+
+bool
+isQuantifier(char c)
+{
+  return c != 0 && ::strchr("*+?{", c);
+}
+
+} // namespace
+
+DeviceRule::DeviceRule(const std::string& pattern)
+  : mKind(regex)
+  , mPattern(pattern)
+{
+  std::string p = pattern;
+  // std::regex_match() is anchored at both ends anyway.
+  if (!p.empty() && p.front() == '^')
+    p = p.substr(1);
+  if (p.length() > 1 && p.back() == '$' && p[p.length() - 2] != '\\')
+    p.pop_back();
+
+  // Collect the literal prefix, resolving escaped punctuation.
+  size_t i = 0;
+  while (i < p.length()) {
+    char c = p[i];
+    size_t next = i + 1;
+    if (c == '\\' && i + 1 < p.length() && std::ispunct(static_cast<unsigned char>(p[i + 1]))) {
+      c = p[i + 1];
+      next = i + 2;
+    } else if (isSpecial(c)) {
+      break;
+    }
+    // A quantified character is not part of the prefix.
+    if (next < p.length() && isQuantifier(p[next]))
+      break;
+    mLiteral += c;
+    i = next;
+  }
+  if (i == p.length())
+    mKind = literal;
+  else if (p.substr(i) == ".*")
+    mKind = prefix;
+  else if (p.find('|') != std::string::npos)
+    mLiteral.clear(); // alternatives may not share the prefix
+
+  if (mKind == regex) {
+    try {
+      mpRegex = std::make_shared<std::regex>(mPattern, std::regex::optimize);
+    } catch (const std::regex_error& e) {
+      mKind = invalid;
+      mError = e.what();
+    }
+  }
+}
+
+const std::string&
+DeviceRule::pattern() const
+{
+  return mPattern;
+}
+
+const std::string&
+DeviceRule::error() const
+{
+  return mError;
+}
+
+bool
+DeviceRule::matches(const std::string& name) const
+{
+  switch (mKind) {
+    case literal:
+      return name == mLiteral;
+    case prefix:
+      return name.compare(0, mLiteral.length(), mLiteral) == 0;
+    case regex:
+      return name.compare(0, mLiteral.length(), mLiteral) == 0
+             && std::regex_match(name, *mpRegex);
+    case invalid:
+      break;
+  }
+  return false;
+}
+
+IgnoreList::IgnoreList(const std::string& path)
+  : mPath(path)
+{
+  std::ifstream file(path);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty())
+      continue;
+    if (line.find('#') == 0)
+      continue;
+    if (line.find("//") == 0)
+      continue;
+    if (line.find(' ') == 0)
+      continue;
+    mRules.push_back(DeviceRule(line));
+    if (!mRules.back().error().empty())
+      std::cerr << path << ": invalid regex '" << line
+                << "': " << mRules.back().error() << std::endl;
+  }
+}
+
+bool
+IgnoreList::matches(const std::string& saneName) const
+{
+  for (const auto& rule : mRules) {
+    if (rule.matches(saneName)) {
+      std::clog << mPath << ": regex '" << rule.pattern() << "'"
+                << " matches device name '" << saneName << "'" << std::endl;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,68 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEVICE_RULES_H
+#define DEVICE_RULES_H
+
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+// A regular expression matched against a complete device name, compiled
+// once. Patterns without special characters are compared as literals,
+// and patterns beginning with a literal prefix reject most names without
+// running the regex.
+class DeviceRule
+{
+public:
+  explicit DeviceRule(const std::string& pattern);
+
+  const std::string& pattern() const;
+  // Empty if the pattern is a valid regular expression.
+  const std::string& error() const;
+  bool matches(const std::string&) const;
+
+private:
+  enum Kind
+  {
+    invalid,
+    literal, // name equals mLiteral
+    prefix,  // name begins with mLiteral, pattern ends in .*
+    regex,   // name begins with mLiteral, and matches mpRegex
+  } mKind;
+  std::string mPattern, mLiteral, mError;
+  std::shared_ptr<std::regex> mpRegex;
+};
+
+// The ignore list, parsed once. Each line is a DeviceRule matched against
+// SANE device names.
+class IgnoreList
+{
+public:
+  IgnoreList() = default;
+  explicit IgnoreList(const std::string& path);
+
+  bool matches(const std::string& saneName) const;
+
+private:
+  std::string mPath;
+  std::vector<DeviceRule> mRules;
+};
+
+#endif // DEVICE_RULES_H
@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "server.h"
+#include "sanecpp/host.h"
 #include <csignal>
 #include <thread>
 
@@ -37,6 +38,11 @@ onSignal(int signal)
 int
 main(int argc, char** argv)
 {
+  // Backend host processes are started from the daemon's executable.
+  int exitCode = 0;
+  if (sanecpp::run_host_if_requested(argc, argv, &exitCode))
+    return exitCode;
+
   Server server(argc, argv);
   pServer = &server;
   bool ok = true;
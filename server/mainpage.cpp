@@ -27,20 +27,35 @@ MainPage::MainPage(const ScannerList& scanners, bool resetoption, bool disclosev
   : mScanners(scanners)
   , mResetoption(resetoption)
   , mDiscloseversion(discloseversion)
+  , mPendingCount(0)
+  , mEnumerating(false)
 {}
 
+MainPage&
+MainPage::setPendingCount(int count, bool enumerating)
+{
+  mPendingCount = count;
+  mEnumerating = enumerating;
+  return *this;
+}
+
 void
 MainPage::onRender()
 {
   out() << heading(1).addText(title()) << std::endl;
 
   out() << heading(2).addText("Scanners");
+  if (mEnumerating)
+    out() << paragraph().addText("Searching for scanners ...");
+  else if (mPendingCount > 0)
+    out() << paragraph().addText(std::to_string(mPendingCount) + " scanner(s) initializing ...");
   if (mScanners.empty()) {
-    out() << paragraph().addText("No scanners available");
+    if (!mEnumerating && mPendingCount == 0)
+      out() << paragraph().addText("No scanners available");
   } else {
     list scannersList;
     for (const auto& s : mScanners) {
-      auto name = s.pScanner->publishedName();
+      auto name = s.publishedName();
 
       std::string icondef;
       std::string iconUrl = HttpServer::toRelativeUrl(s.pScanner->iconUrl());
@@ -73,7 +88,8 @@ MainPage::onRender()
   if (mResetoption) {
     out() << heading(2).addText("Server Maintenance");
     list maintenance;
-    maintenance.addItem(anchor("/reset").addText("Reset"));
+    // relative to the main page, which is below the base path
+    maintenance.addItem(anchor("reset").addText("Reset"));
     maintenance.addContent("\n");
     out() << maintenance << std::endl;
   }
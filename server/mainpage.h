@@ -23,6 +23,9 @@ class MainPage : public WebPage
 {
 public:
   explicit MainPage(const ScannerList&, bool resetoption, bool discloseversion);
+  // Number of scanners that are not ready yet, and whether more scanners
+  // may still be found.
+  MainPage& setPendingCount(int, bool enumerating);
 
 protected:
   void onRender() override;
@@ -30,4 +33,6 @@ protected:
 private:
   const ScannerList& mScanners;
   bool mResetoption, mDiscloseversion;
+  int mPendingCount;
+  bool mEnumerating;
 };
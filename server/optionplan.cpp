@@ -0,0 +1,87 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "optionplan.h"
+
+OptionPlan&
+OptionPlan::add(const std::string& name, const std::string& value)
+{
+  mSteps.push_back(
+    { sanecpp::known_option::count, name, value, 0, false, false, 0 });
+  return *this;
+}
+
+OptionPlan&
+OptionPlan::add(sanecpp::known_option known, const std::string& value)
+{
+  mSteps.push_back({ known, "", value, 0, false, false, 0 });
+  return *this;
+}
+
+OptionPlan&
+OptionPlan::add(sanecpp::known_option known,
+                double value,
+                int fallbackCount,
+                bool required)
+{
+  mSteps.push_back({ known, "", "", value, true, required, fallbackCount });
+  return *this;
+}
+
+OptionPlan::Result
+OptionPlan::apply(sanecpp::option_set& opt, bool onlyChanged) const
+{
+  Result result;
+  // A failed step with fallbacks opens a group of alternatives,
+  // at least one of which must succeed if the step is required.
+  int groupRemaining = 0;
+  bool groupRequired = false, groupDone = false;
+  for (size_t i = 0; i < mSteps.size(); ++i) {
+    const Step& step = mSteps[i];
+    sanecpp::option& option = step.known == sanecpp::known_option::count
+                                ? opt[step.name]
+                                : opt[step.known];
+    bool done = false;
+    if (onlyChanged && option.is_active() && option.is_settable() &&
+        (step.numeric ? option.has_value(step.numericValue)
+                      : option.has_value(step.stringValue))) {
+      ++result.unchanged;
+      done = true;
+    } else if (step.numeric ? option.set_value(step.numericValue)
+                            : option.set_value(step.stringValue)) {
+      ++result.written;
+      done = true;
+    } else {
+      ++result.failed;
+    }
+    if (groupRemaining > 0) {
+      groupDone = groupDone || done;
+      if (--groupRemaining == 0 && groupRequired && !groupDone)
+        result.ok = false;
+    } else if (done) {
+      i += step.fallbackCount;
+    } else if (step.fallbackCount > 0) {
+      groupRemaining = step.fallbackCount;
+      groupRequired = step.required;
+      groupDone = false;
+    } else if (step.required) {
+      result.ok = false;
+    }
+  }
+  return result;
+}
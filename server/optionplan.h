@@ -0,0 +1,64 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OPTIONPLAN_H
+#define OPTIONPLAN_H
+
+#include "sanecpp/sanecpp.h"
+
+#include <string>
+#include <vector>
+
+// SANE option values for a scan, in the order in which they are set.
+// Built once per scanner and scan ticket, and applied to each session.
+class OptionPlan
+{
+public:
+  OptionPlan& add(const std::string& name, const std::string& value);
+  OptionPlan& add(sanecpp::known_option, const std::string& value);
+  // If the option cannot be set, the following fallbackCount options are
+  // set instead. Otherwise, they are skipped.
+  OptionPlan& add(sanecpp::known_option,
+                  double value,
+                  int fallbackCount = 0,
+                  bool required = false);
+
+  struct Result
+  {
+    int written = 0, unchanged = 0, failed = 0;
+    bool ok = true; // false if a required option could not be set
+  };
+  // With onlyChanged, current values are read first, and options already
+  // holding the planned value are not written.
+  Result apply(sanecpp::option_set&, bool onlyChanged) const;
+
+  size_t size() const { return mSteps.size(); }
+
+private:
+  struct Step
+  {
+    sanecpp::known_option known;
+    std::string name, stringValue;
+    double numericValue;
+    bool numeric, required;
+    int fallbackCount;
+  };
+  std::vector<Step> mSteps;
+};
+
+#endif // OPTIONPLAN_H
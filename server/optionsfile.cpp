@@ -19,9 +19,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "optionsfile.h"
 #include "scanner.h"
 #include <fstream>
-#include <regex>
 #include <sstream>
 
+namespace {
+
+// Options that configure the server rather than a device.
+bool
+isServerOption(const std::string& name)
+{
+  return name == "hotplug-allow" || name == "hotplug-deny"
+         || name == "sane-backends" || name == "sane-concurrency";
+}
+
+} // namespace
+
 OptionsFile::OptionsFile(const std::string& fileName)
   : mFileName(fileName)
 {
@@ -46,7 +57,10 @@ OptionsFile::OptionsFile(const std::string& fileName)
     while (!value.empty() && std::isspace(value.back()))
       value.resize(value.length() - 1);
     if (name == "device") {
-      mDeviceOptions.push_back(std::make_pair(value, RawOptions()));
+      mDeviceOptions.push_back(std::make_pair(DeviceRule(value), RawOptions()));
+      if (!mDeviceOptions.back().first.error().empty())
+        std::cerr << fileName << ": invalid regex '" << value
+                  << "': " << mDeviceOptions.back().first.error() << std::endl;
       pDeviceSection = &mDeviceOptions.back().second;
     } else if (pDeviceSection)
       pDeviceSection->push_back(std::make_pair(name, value));
@@ -57,6 +71,15 @@ OptionsFile::OptionsFile(const std::string& fileName)
 
 OptionsFile::~OptionsFile() {}
 
+bool
+OptionsFile::Options::operator==(const Options& other) const
+{
+  return icon == other.icon && note == other.note
+         && gray_gamma == other.gray_gamma && color_gamma == other.color_gamma
+         && synthesize_gray == other.synthesize_gray
+         && sane_options == other.sane_options;
+}
+
 std::string
 OptionsFile::path() const
 {
@@ -71,15 +94,15 @@ OptionsFile::scannerOptions(const Scanner* pScanner) const
 {
   auto rawOptions = mGlobalOptions;
   for (const auto& section : mDeviceOptions) {
-    std::regex r(section.first);
+    const DeviceRule& rule = section.first;
     bool match = false;
-    if (std::regex_match(pScanner->saneName(), r)) {
-      std::clog << mFileName << ": regex '" << section.first
+    if (rule.matches(pScanner->saneName())) {
+      std::clog << mFileName << ": regex '" << rule.pattern()
                 << "' matches device name '" << pScanner->saneName() << "'"
                 << std::endl;
       match = true;
-    } else if (std::regex_match(pScanner->makeAndModel(), r)) {
-      std::clog << mFileName << ": regex '" << section.first
+    } else if (rule.matches(pScanner->makeAndModel())) {
+      std::clog << mFileName << ": regex '" << rule.pattern()
                 << "' matches device make and model '"
                 << pScanner->makeAndModel() << "'" << std::endl;
       match = true;
@@ -103,8 +126,33 @@ OptionsFile::scannerOptions(const Scanner* pScanner) const
       processedOptions.color_gamma = ::atof(option.second.c_str());
     else if (option.first == "synthesize-gray")
       processedOptions.synthesize_gray = (option.second == "true" || option.second == "yes");
-    else
+    else if (!isServerOption(option.first))
       processedOptions.sane_options.push_back(option);
   }
   return processedOptions;
 }
+
+std::vector<std::string>
+OptionsFile::globalOptionList(const std::string& name) const
+{
+  std::vector<std::string> values;
+  for (const auto& option : mGlobalOptions) {
+    if (option.first == name) {
+      std::istringstream iss(option.second);
+      std::string value;
+      while (iss >> value)
+        values.push_back(value);
+    }
+  }
+  return values;
+}
+
+OptionsFile::RawOptions
+OptionsFile::serverOptions() const
+{
+  RawOptions options;
+  for (const auto& option : mGlobalOptions)
+    if (isServerOption(option.first))
+      options.push_back(option);
+  return options;
+}
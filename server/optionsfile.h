@@ -22,6 +22,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <string>
 #include <vector>
 
+#include "devicerules.h"
+
 class Scanner;
 
 class OptionsFile
@@ -41,13 +43,20 @@ public:
     double gray_gamma = 1.0, color_gamma = 1.0;
     bool synthesize_gray = false;
     RawOptions sane_options;
+    bool operator==(const Options&) const;
+    bool operator!=(const Options& other) const { return !(*this == other); }
   };
   Options scannerOptions(const Scanner*) const;
+  // All white-space separated values given for a global option
+  // in the order of appearance.
+  std::vector<std::string> globalOptionList(const std::string& name) const;
+  // Global options that configure the server rather than devices.
+  RawOptions serverOptions() const;
 
 private:
   std::string mFileName;
   RawOptions mGlobalOptions;
-  std::vector<std::pair<std::string, RawOptions>> mDeviceOptions;
+  std::vector<std::pair<DeviceRule, RawOptions>> mDeviceOptions;
 };
 
 #endif // OPTIONS_FILE_H
@@ -0,0 +1,358 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pagereader.h"
+#include "basic/ringbuffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <poll.h>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double
+secondsSince(Clock::time_point t)
+{
+  return std::chrono::duration<double>(Clock::now() - t).count();
+}
+
+int64_t
+nowMs()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+           Clock::now().time_since_epoch())
+    .count();
+}
+
+} // namespace
+
+struct PageReader::Private
+{
+  std::shared_ptr<sanecpp::session> mpSession;
+  RingBuffer<Block> mRing;
+  std::thread mThread;
+  std::atomic<bool> mStop, mDone, mInterrupted;
+  bool mAbandoned;
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+
+  // Progress, written by the reader thread.
+  std::atomic<uint64_t> mBytesRead;
+  std::atomic<int64_t> mReadMs, mLastProgressMs;
+  // Throughput window of the watchdog, used by the consumer thread.
+  int64_t mWindowStartMs, mWindowReadMs;
+  uint64_t mWindowBytes;
+
+  Clock::time_point mStarted, mBlockTaken;
+  // Written by the reader thread, read after it has been joined.
+  double mReadSeconds, mReaderWaitSeconds;
+  // Written by the consumer thread.
+  double mProcessSeconds, mConsumerWaitSeconds;
+  double mElapsedSeconds;
+
+  Private(std::shared_ptr<sanecpp::session>, size_t);
+  void threadFunc();
+  bool waitForData(int fd);
+  void notify();
+};
+
+PageReader::Private::Private(std::shared_ptr<sanecpp::session> pSession,
+                             size_t blocks)
+  : mpSession(pSession)
+  , mRing(blocks)
+  , mStop(false)
+  , mDone(false)
+  , mInterrupted(false)
+  , mAbandoned(false)
+  , mBytesRead(0)
+  , mReadMs(0)
+  , mLastProgressMs(nowMs())
+  , mWindowStartMs(0)
+  , mWindowReadMs(0)
+  , mWindowBytes(0)
+  , mStarted(Clock::now())
+  , mReadSeconds(0)
+  , mReaderWaitSeconds(0)
+  , mProcessSeconds(0)
+  , mConsumerWaitSeconds(0)
+  , mElapsedSeconds(0)
+{}
+
+void
+PageReader::Private::notify()
+{
+  { std::lock_guard<std::mutex> lock(mMutex); }
+  mCondition.notify_all();
+}
+
+void
+PageReader::Private::threadFunc()
+{
+  size_t bytesPerLine = mpSession->parameters()->bytes_per_line;
+  // Without non-blocking I/O, sane_read() blocks until data arrives.
+  int selectFd = -1;
+  if (mpSession->set_nonblocking(true)) {
+    selectFd = mpSession->select_fd();
+    if (selectFd < 0)
+      mpSession->set_nonblocking(false);
+  }
+  // Without a select fd, reads that return nothing are retried after a
+  // growing delay rather than in a busy loop.
+  const int minIdleMs = 1, maxIdleMs = 50;
+  int idleMs = minIdleMs;
+  SANE_Status status = SANE_STATUS_GOOD;
+  while (status == SANE_STATUS_GOOD && !mStop) {
+    Block* pBlock = mRing.beginWrite();
+    if (!pBlock) {
+      auto t = Clock::now();
+      std::unique_lock<std::mutex> lock(mMutex);
+      mCondition.wait_for(lock, std::chrono::milliseconds(100), [this] {
+        return mStop || mRing.beginWrite();
+      });
+      mReaderWaitSeconds += secondsSince(t);
+      // Waiting for the consumer is not the device's fault.
+      mLastProgressMs = nowMs();
+      continue;
+    }
+    auto t = Clock::now();
+    char* data = nullptr;
+    int lines = 0;
+    status = mpSession->read_lines(data, lines).status();
+    if (lines == 0 && status == SANE_STATUS_GOOD) {
+      if (selectFd >= 0 && !waitForData(selectFd)) {
+        mpSession->set_nonblocking(false);
+        selectFd = -1;
+      } else if (selectFd < 0) {
+        std::unique_lock<std::mutex> lock(mMutex);
+        mCondition.wait_for(lock, std::chrono::milliseconds(idleMs),
+                            [this] { return mStop.load(); });
+        idleMs = std::min(2 * idleMs, maxIdleMs);
+      }
+      mReadSeconds += secondsSince(t);
+      mReadMs += static_cast<int64_t>(secondsSince(t) * 1000);
+      continue;
+    }
+    idleMs = minIdleMs;
+    pBlock->data.assign(data, data + lines * bytesPerLine);
+    pBlock->lines = lines;
+    pBlock->status = status;
+    mReadSeconds += secondsSince(t);
+    mReadMs += static_cast<int64_t>(secondsSince(t) * 1000);
+    mBytesRead += lines * bytesPerLine;
+    mLastProgressMs = nowMs();
+    mRing.endWrite();
+    notify();
+  }
+  bool abandoned = false;
+  {
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDone = true;
+    abandoned = mAbandoned;
+  }
+  if (abandoned) {
+    std::clog << "abandoned page reader finished" << std::endl;
+    delete this;
+    return;
+  }
+  mCondition.notify_all();
+}
+
+// Waits until the backend has data, returning periodically so that
+// a stop request is noticed. Returns false if waiting is not possible.
+bool
+PageReader::Private::waitForData(int fd)
+{
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  int count = 0;
+  do {
+    count = ::poll(&pfd, 1, 1000);
+  } while (count < 0 && errno == EINTR);
+  if (count < 0) {
+    std::cerr << "poll() on SANE select fd failed: " << ::strerror(errno)
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+PageReader::PageReader(std::shared_ptr<sanecpp::session> pSession,
+                       size_t blocks)
+  : p(new Private(pSession, blocks))
+{
+  p->mThread = std::thread([this] { p->threadFunc(); });
+}
+
+PageReader::~PageReader()
+{
+  if (p) {
+    stop();
+    delete p;
+  }
+}
+
+PageReader::Block*
+PageReader::nextBlock(int timeoutMs)
+{
+  auto t = Clock::now();
+  Block* pBlock = p->mRing.beginRead();
+  if (!pBlock && !p->mDone && !p->mInterrupted) {
+    std::unique_lock<std::mutex> lock(p->mMutex);
+    p->mCondition.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] {
+      return p->mDone || p->mInterrupted || p->mRing.beginRead();
+    });
+    pBlock = p->mRing.beginRead();
+  }
+  p->mConsumerWaitSeconds += secondsSince(t);
+  p->mBlockTaken = Clock::now();
+  return pBlock;
+}
+
+void
+PageReader::releaseBlock()
+{
+  p->mProcessSeconds += secondsSince(p->mBlockTaken);
+  p->mRing.endRead();
+  p->notify();
+}
+
+void
+PageReader::interrupt()
+{
+  p->mInterrupted = true;
+  p->notify();
+}
+
+bool
+PageReader::isStalled(int stallSeconds,
+                      int firstDataSeconds,
+                      int minBytesPerSecond,
+                      std::string& reason)
+{
+  if (p->mDone)
+    return false;
+  uint64_t bytes = p->mBytesRead;
+  int64_t now = nowMs(), idleMs = now - p->mLastProgressMs;
+  int limitSeconds = bytes == 0 ? firstDataSeconds : stallSeconds;
+  if (limitSeconds > 0 && idleMs >= limitSeconds * 1000LL) {
+    reason = std::string(bytes == 0 ? "no data" : "no more data") +
+             " from device for " + std::to_string(idleMs / 1000) + " seconds";
+    return true;
+  }
+  // Warming up before the first data does not count against throughput.
+  if (minBytesPerSecond <= 0 || bytes == 0)
+    return false;
+  if (p->mWindowStartMs == 0) {
+    p->mWindowStartMs = now;
+    p->mWindowReadMs = p->mReadMs;
+    p->mWindowBytes = bytes;
+    return false;
+  }
+  int windowMs = (stallSeconds > 0 ? stallSeconds : 60) * 1000;
+  int64_t readMs = p->mReadMs - p->mWindowReadMs;
+  if (now - p->mWindowStartMs < windowMs || readMs < windowMs / 2)
+    return false;
+  uint64_t rate = (bytes - p->mWindowBytes) * 1000 / readMs;
+  p->mWindowStartMs = now;
+  p->mWindowReadMs = p->mReadMs;
+  p->mWindowBytes = bytes;
+  if (rate >= static_cast<uint64_t>(minBytesPerSecond))
+    return false;
+  reason = "device delivers " + std::to_string(rate) +
+           " bytes/s, less than " + std::to_string(minBytesPerSecond);
+  return true;
+}
+
+void
+PageReader::stop()
+{
+  if (p->mThread.joinable()) {
+    p->mStop = true;
+    p->notify();
+    p->mThread.join();
+    p->mElapsedSeconds = secondsSince(p->mStarted);
+  }
+}
+
+bool
+PageReader::stop(int timeoutMs)
+{
+  if (p->mThread.joinable()) {
+    p->mStop = true;
+    std::unique_lock<std::mutex> lock(p->mMutex);
+    p->mCondition.notify_all();
+    if (!p->mCondition.wait_for(lock,
+                                std::chrono::milliseconds(timeoutMs),
+                                [this] { return p->mDone.load(); }))
+      return false;
+  }
+  stop();
+  return true;
+}
+
+void
+PageReader::abandon()
+{
+  if (!p->mThread.joinable())
+    return;
+  bool abandoned = false;
+  {
+    std::lock_guard<std::mutex> lock(p->mMutex);
+    if (!p->mDone) {
+      // From now on, the reader thread owns its state.
+      p->mAbandoned = abandoned = true;
+      p->mThread.detach();
+    }
+  }
+  if (abandoned)
+    p = nullptr;
+  else
+    stop();
+}
+
+std::string
+PageReader::describeUtilisation() const
+{
+  if (!p)
+    return "reader abandoned";
+  double elapsed = p->mElapsedSeconds;
+  if (elapsed <= 0)
+    elapsed = secondsSince(p->mStarted);
+  auto percent = [elapsed](double seconds) {
+    return static_cast<int>(100 * seconds / elapsed + 0.5);
+  };
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(2) << elapsed << "s: "
+      << "reading " << percent(p->mReadSeconds) << "%, "
+      << "reader waiting for slot " << percent(p->mReaderWaitSeconds) << "%, "
+      << "processing " << percent(p->mProcessSeconds) << "%, "
+      << "processing waiting for data " << percent(p->mConsumerWaitSeconds)
+      << "%";
+  return oss.str();
+}
@@ -0,0 +1,88 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEREADER_H
+#define PAGEREADER_H
+
+#include "sanecpp/sanecpp.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// Reads the current page of a SANE session on a separate thread, so
+// transfer from the device overlaps with image processing and encoding.
+// Blocks of complete lines are passed through a bounded ring; when the
+// consumer falls behind, the reader waits for a free slot.
+class PageReader
+{
+  PageReader(const PageReader&) = delete;
+  PageReader& operator=(const PageReader&) = delete;
+
+public:
+  struct Block
+  {
+    std::vector<char> data;
+    int lines = 0;
+    // Status after reading the block. The last block of a page has a
+    // status other than SANE_STATUS_GOOD, and may hold no lines.
+    SANE_Status status = SANE_STATUS_GOOD;
+  };
+
+  explicit PageReader(std::shared_ptr<sanecpp::session>, size_t blocks = 4);
+  ~PageReader();
+
+  // Waits for the next block, and returns null if none arrived in time.
+  // The block remains valid until releaseBlock() is called.
+  Block* nextBlock(int timeoutMs);
+  void releaseBlock();
+  // Makes nextBlock() return immediately, from now on. May be called
+  // from any thread, e.g. when the job is cancelled.
+  void interrupt();
+
+  // Detects a device that delivers no data within firstDataSeconds, stops
+  // delivering data for stallSeconds, or delivers it more slowly than
+  // minBytesPerSecond, measured over stallSeconds of reading. Devices may
+  // take long to deliver their first data, e.g. while warming up a lamp.
+  // Time the reader spends waiting for a free slot does not count.
+  // Returns true, and a description in reason, when a limit is exceeded;
+  // 0 disables each check. To be called periodically by the consumer.
+  bool isStalled(int stallSeconds,
+                 int firstDataSeconds,
+                 int minBytesPerSecond,
+                 std::string& reason);
+
+  // Stops the reader thread. Called from the destructor.
+  void stop();
+  // Returns false if the reader thread did not stop in time, e.g. because
+  // it is blocked in sane_read().
+  bool stop(int timeoutMs);
+  // Leaves a reader thread that cannot be stopped to finish on its own.
+  // It releases the session once the backend returns.
+  void abandon();
+
+  // How the time spent on the page divides between the reader and
+  // the consumer, to show which one limits throughput.
+  std::string describeUtilisation() const;
+
+private:
+  struct Private;
+  Private* p;
+};
+
+#endif // PAGEREADER_H
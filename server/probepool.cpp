@@ -0,0 +1,294 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "probepool.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "sanecpp/host.h"
+#include "scanner.h"
+
+namespace {
+// Delay before a failed initialization is retried, multiplied by the
+// number of attempts so far.
+const std::chrono::seconds retryDelay(5);
+// Time for an initialization to return after its SANE host has been
+// terminated.
+const std::chrono::seconds terminationGrace(10);
+}
+
+struct ProbePool::Private : std::enable_shared_from_this<ProbePool::Private>
+{
+  struct Task
+  {
+    ScannerPtr pScanner;
+    int attempt;
+    Clock::time_point notBefore;
+  };
+  struct Running
+  {
+    ScannerPtr pScanner;
+    Clock::time_point deadline;
+    bool terminated;
+  };
+
+  std::shared_ptr<const OptionsFile> mpOptionsfile;
+  std::vector<ScannerPtr> mScanners;
+  int mThreads, mRetries;
+  std::chrono::seconds mTimeout;
+
+  std::mutex mMutex;
+  std::condition_variable mCondition;
+  std::deque<Task> mQueue;
+  // Running initializations by worker id. A worker that is missing here
+  // after its initialization returns has been abandoned.
+  std::map<int, Running> mRunning;
+  int mNextWorker, mActiveWorkers;
+  std::set<Scanner*> mDone, mTimedOut;
+  bool mDeadlinePassed, mStopped;
+  Callback mOnLateResult;
+  std::thread mWatchdog;
+
+  Private(const std::vector<ScannerPtr>& scanners,
+          const std::shared_ptr<const OptionsFile>& pOptionsfile,
+          int threads,
+          int timeoutSeconds,
+          int retries)
+    : mpOptionsfile(pOptionsfile)
+    , mScanners(scanners)
+    , mThreads(std::max(threads, 1))
+    , mRetries(std::max(retries, 0))
+    , mTimeout(timeoutSeconds)
+    , mNextWorker(0)
+    , mActiveWorkers(0)
+    , mDeadlinePassed(false)
+    , mStopped(false)
+  {
+    for (const auto& pScanner : mScanners)
+      mQueue.push_back(Task{ pScanner, 0, Clock::now() });
+  }
+
+  bool finished() const
+  {
+    return mDone.size() + mTimedOut.size() == mScanners.size();
+  }
+  void startWorkers();
+  void workerFunc(int id);
+  void watchdogFunc();
+  void onResult(const Task&, bool ok, bool abandoned);
+};
+
+// Called with the mutex locked.
+void
+ProbePool::Private::startWorkers()
+{
+  auto self = shared_from_this();
+  while (!mStopped && mActiveWorkers < mThreads
+         && mActiveWorkers < int(mQueue.size())) {
+    ++mActiveWorkers;
+    int id = mNextWorker++;
+    std::thread([self, id]() { self->workerFunc(id); }).detach();
+  }
+}
+
+void
+ProbePool::Private::workerFunc(int id)
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (!mStopped && !mQueue.empty()) {
+    auto i = std::min_element(mQueue.begin(), mQueue.end(),
+      [](const Task& a, const Task& b) { return a.notBefore < b.notBefore; });
+    if (i->notBefore > Clock::now()) {
+      mCondition.wait_until(lock, i->notBefore);
+      continue;
+    }
+    Task task = *i;
+    mQueue.erase(i);
+    mRunning[id] = Running{ task.pScanner, Clock::now() + mTimeout, false };
+    mCondition.notify_all(); // wake up the watchdog
+    lock.unlock();
+    bool ok = false;
+    {
+      // Keeps SANE initialized while an abandoned call may still return.
+      sanecpp::init saneinit;
+      ok = task.pScanner->initWithOptions(*mpOptionsfile);
+    }
+    lock.lock();
+    bool abandoned = mRunning.erase(id) == 0;
+    onResult(task, ok, abandoned);
+    if (abandoned) // another worker has taken over
+      return;
+  }
+  --mActiveWorkers;
+}
+
+// Called with the mutex locked.
+void
+ProbePool::Private::onResult(const Task& task, bool ok, bool abandoned)
+{
+  Scanner* pScanner = task.pScanner.get();
+  mTimedOut.erase(pScanner);
+  if (!ok)
+    std::clog << pScanner->saneName() << ": error: " << pScanner->error()
+              << std::endl;
+  if (!ok && task.attempt < mRetries && !mStopped) {
+    std::clog << pScanner->saneName() << ": retrying initialization"
+              << std::endl;
+    auto delay = retryDelay * (task.attempt + 1);
+    mQueue.push_back(Task{ task.pScanner, task.attempt + 1, Clock::now() + delay });
+    startWorkers();
+    mCondition.notify_all();
+    return;
+  }
+  mDone.insert(pScanner);
+  if (abandoned)
+    std::clog << pScanner->saneName() << ": abandoned initialization returned"
+              << std::endl;
+  if (mDeadlinePassed) {
+    std::clog << pScanner->saneName() << ": initialized after deadline"
+              << std::endl;
+    if (mOnLateResult)
+      mOnLateResult(task.pScanner);
+  }
+  mCondition.notify_all();
+}
+
+void
+ProbePool::Private::watchdogFunc()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (!mStopped) {
+    auto next = Clock::time_point::max();
+    for (const auto& entry : mRunning)
+      next = std::min(next, entry.second.deadline);
+    if (next == Clock::time_point::max())
+      mCondition.wait(lock);
+    else
+      mCondition.wait_until(lock, next);
+    auto now = Clock::now();
+    for (auto i = mRunning.begin(); !mStopped && i != mRunning.end();) {
+      if (i->second.deadline > now) {
+        ++i;
+        continue;
+      }
+      Scanner* pScanner = i->second.pScanner.get();
+      // A call blocked in a SANE host is interrupted by terminating the
+      // host. Otherwise, the thread is abandoned, and keeps SANE
+      // initialized until the call returns.
+      if (!i->second.terminated &&
+          sanecpp::terminate_device_host(pScanner->saneName())) {
+        std::cerr << pScanner->saneName() << ": initialization did not finish within "
+                  << mTimeout.count() << " seconds, terminated its SANE host"
+                  << std::endl;
+        i->second.terminated = true;
+        i->second.deadline = now + terminationGrace;
+        ++i;
+        continue;
+      }
+      std::cerr << pScanner->saneName() << ": initialization did not finish within "
+                << mTimeout.count() << " seconds, abandoning it" << std::endl;
+      mTimedOut.insert(pScanner);
+      i = mRunning.erase(i);
+      --mActiveWorkers;
+      startWorkers();
+      mCondition.notify_all();
+    }
+  }
+}
+
+ProbePool::ProbePool(const std::vector<ScannerPtr>& scanners,
+                     const std::shared_ptr<const OptionsFile>& pOptionsfile,
+                     int threads,
+                     int timeoutSeconds,
+                     int retries)
+  : p(std::make_shared<Private>(scanners, pOptionsfile, threads,
+                                timeoutSeconds, retries))
+{
+  std::lock_guard<std::mutex> lock(p->mMutex);
+  p->startWorkers();
+  p->mWatchdog = std::thread([this]() { p->watchdogFunc(); });
+}
+
+ProbePool::~ProbePool()
+{
+  std::unique_lock<std::mutex> lock(p->mMutex);
+  p->mStopped = true;
+  p->mOnLateResult = nullptr;
+  // Initializations blocked in SANE hosts are interrupted, so they do not
+  // keep SANE from being re-initialized.
+  std::set<int> terminated;
+  for (const auto& entry : p->mRunning)
+    if (sanecpp::terminate_device_host(entry.second.pScanner->saneName()))
+      terminated.insert(entry.first);
+  p->mCondition.notify_all();
+  p->mCondition.wait_for(lock, terminationGrace, [this, &terminated]() {
+    for (int id : terminated)
+      if (p->mRunning.count(id))
+        return false;
+    return true;
+  });
+  size_t pending = p->mRunning.size() + p->mTimedOut.size();
+  lock.unlock();
+  p->mWatchdog.join();
+  if (pending > 0)
+    std::clog << "abandoning " << pending << " scanner initialization(s)"
+              << std::endl;
+}
+
+std::vector<ProbePool::ScannerPtr>
+ProbePool::waitForResults(Clock::time_point deadline, Callback onLateResult)
+{
+  std::unique_lock<std::mutex> lock(p->mMutex);
+  p->mCondition.wait_until(lock, deadline, [this]() { return p->finished(); });
+  std::vector<ScannerPtr> results;
+  for (const auto& pScanner : p->mScanners) {
+    if (p->mDone.find(pScanner.get()) == p->mDone.end())
+      std::clog << pScanner->saneName()
+                << ": initialization not finished, continuing in background"
+                << std::endl;
+    else
+      results.push_back(pScanner);
+  }
+  p->mDeadlinePassed = true;
+  p->mOnLateResult = onLateResult;
+  return results;
+}
+
+void
+ProbePool::discardLateResults()
+{
+  std::lock_guard<std::mutex> lock(p->mMutex);
+  p->mOnLateResult = nullptr;
+}
+
+void
+ProbePool::add(const ScannerPtr& pScanner)
+{
+  std::lock_guard<std::mutex> lock(p->mMutex);
+  p->mScanners.push_back(pScanner);
+  p->mQueue.push_back(Private::Task{ pScanner, 0, Clock::now() });
+  p->startWorkers();
+  p->mCondition.notify_all();
+}
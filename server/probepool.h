@@ -0,0 +1,77 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PROBEPOOL_H
+#define PROBEPOOL_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <vector>
+
+class Scanner;
+class OptionsFile;
+
+// Initializes scanners on a bounded number of threads.
+// Each initialization has a deadline of its own. When it is missed, the
+// SANE host serving the device, if any, is terminated, so the call returns.
+// Without a host, the thread is abandoned, and a new thread takes over the
+// remaining scanners; the abandoned call keeps SANE initialized until it
+// returns, so SANE is not re-initialized on reload meanwhile. Scanners
+// that fail to initialize, or that time out and fail later, are retried a
+// bounded number of times. Backends that do not support concurrent use are
+// serialized by sanecpp, see the sane-concurrency server option.
+class ProbePool
+{
+  ProbePool(const ProbePool&) = delete;
+  ProbePool& operator=(const ProbePool&) = delete;
+
+public:
+  typedef std::shared_ptr<Scanner> ScannerPtr;
+  typedef std::function<void(const ScannerPtr&)> Callback;
+  typedef std::chrono::steady_clock Clock;
+
+  ProbePool(const std::vector<ScannerPtr>&,
+            const std::shared_ptr<const OptionsFile>&,
+            int threads,
+            int timeoutSeconds,
+            int retries);
+  // Terminates the SANE hosts of running initializations, and waits for
+  // them to return. Other running initializations are abandoned, and
+  // finish on their own if the backend ever returns.
+  ~ProbePool();
+
+  // Waits until all scanners are initialized, have failed, or have timed
+  // out, or until the deadline has passed, and returns the scanners whose
+  // initialization has finished, in their original order. Check
+  // Scanner::error() for the result. Scanners that finish later, or are
+  // retried later, are passed to the callback, from a pool thread.
+  std::vector<ScannerPtr> waitForResults(Clock::time_point deadline,
+                                         Callback onLateResult);
+  // Afterwards, the callback will not be called any more.
+  void discardLateResults();
+  // Initializes another scanner. Once waitForResults() has returned, its
+  // result is passed to the callback.
+  void add(const ScannerPtr&);
+
+private:
+  struct Private;
+  std::shared_ptr<Private> p;
+};
+
+#endif // PROBEPOOL_H
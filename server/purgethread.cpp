@@ -24,7 +24,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 struct PurgeThread::Private
 {
-  const ScannerList* mpScanners;
+  ScannerListFunction mScanners;
+  std::function<void()> mPurge;
   std::thread* mpThread;
   int mWriteFd, mReadFd;
   int mSleepDuration, mMaxTime;
@@ -58,11 +59,19 @@ void PurgeThread::Private::terminate()
 void PurgeThread::Private::threadFunc()
 {
   while (interruptibleSleep(mSleepDuration)) {
-    for (const auto& entry : *mpScanners) {
+    for (const auto& entry : mScanners()) {
       int count = entry.pScanner->purgeJobs(mMaxTime);
       if (count > 0)
         std::clog << "purged " << count << " jobs" << std::endl;
+      entry.pScanner->closeIfIdle();
+      entry.pScanner->pollAdfSensors();
+      if (entry.pScanner->beginCacheRevalidation()) {
+        auto pScanner = entry.pScanner;
+        std::thread([pScanner]() { pScanner->revalidateCache(); }).detach();
+      }
     }
+    if (mPurge)
+      mPurge();
   }
 }
 
@@ -79,10 +88,12 @@ bool PurgeThread::Private::interruptibleSleep(int seconds)
   return count == 0;
 }
 
-PurgeThread::PurgeThread(const ScannerList& scanners, int sleepDuration, int maxTime)
+PurgeThread::PurgeThread(const ScannerListFunction& scanners, int sleepDuration, int maxTime,
+                         const std::function<void()>& purge)
 : p(new Private)
 {
-  p->mpScanners = &scanners;
+  p->mScanners = scanners;
+  p->mPurge = purge;
   p->mSleepDuration = sleepDuration;
   p->mMaxTime = maxTime;
   p->start();
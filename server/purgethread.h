@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define PURGETHREAD_H
 
 #include "server.h"
+#include <functional>
 
 class PurgeThread
 {
@@ -27,7 +28,10 @@ class PurgeThread
   PurgeThread& operator=(const PurgeThread&) = delete;
 
 public:
-  PurgeThread(const ScannerList&, int sleepDuration, int maxTime);
+  typedef std::function<ScannerList()> ScannerListFunction;
+  // The purge function, if given, is called after each pass over the scanners.
+  PurgeThread(const ScannerListFunction&, int sleepDuration, int maxTime,
+              const std::function<void()>& purge = nullptr);
   ~PurgeThread();
 
 private:
@@ -20,17 +20,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "imageformats/jpegencoder.h"
 #include "imageformats/pdfencoder.h"
 #include "imageformats/pngencoder.h"
+#include "optionplan.h"
+#include "pagereader.h"
 #include "scanner.h"
 #include "web/httpserver.h"
 #include "basic/workerthread.h"
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <cmath>
 #include <cstdint>
+#include <ctime>
 #include <regex>
+#include <sstream>
 #include <stdexcept>
 #include <limits>
+#include <mutex>
 
 #include <sane/saneopts.h>
 
@@ -49,6 +55,7 @@ static const char* PWG_UNSUPPORTED_DOCUMENT_FORMAT =
   "UnsupportedDocumentFormat";
 static const char* PWG_DOCUMENT_PERMISSION_ERROR = "DocumentPermissionError";
 static const char* PWG_ERRORS_DETECTED = "ErrorsDetected";
+static const char* PWG_ABORTED_BY_SYSTEM = "AbortedBySystem";
 
 namespace {
 
@@ -92,6 +99,92 @@ template<class T> std::string describeStreamState(T& stream)
   return "(" + state + ")";
 }
 
+double
+threadCpuSeconds()
+{
+  struct timespec ts = { 0, 0 };
+  ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// A gamma table for an option with a range constraint, or an empty
+// vector if the option has none.
+std::vector<double>
+gammaCurve(const sanecpp::option& table, double gamma)
+{
+  std::vector<double> values;
+  double lo = table.min(), hi = table.max();
+  int size = table.array_size();
+  if (std::isnan(lo) || std::isnan(hi) || size < 2)
+    return values;
+  values.resize(size);
+  for (int i = 0; i < size; ++i)
+    values[i] = lo + ::floor((hi - lo) * ::pow(double(i) / (size - 1), gamma) + 0.5);
+  return values;
+}
+
+// Sets gamma correction through the device's gamma options, preferring
+// gamma tables over analog gamma. Returns the name of the option used,
+// or null if the device has no usable option. Sets touched if options
+// may have been changed nevertheless.
+const char*
+setDeviceGamma(sanecpp::option_set& opt, double gamma, bool color, bool& touched)
+{
+  touched = false;
+  auto& custom = opt[SANE_NAME_CUSTOM_GAMMA];
+  if (custom.is_settable()) {
+    touched = true;
+    if (!custom.set_value(gamma != 1.0 ? 1.0 : 0.0))
+      return nullptr;
+    // Without custom gamma, the device is back to its defaults.
+    if (gamma == 1.0)
+      return SANE_NAME_CUSTOM_GAMMA;
+  }
+  auto usable = [](const sanecpp::option& o) {
+    return o.is_active() && o.is_settable() && o.is_numeric();
+  };
+  std::vector<sanecpp::option*> tables;
+  if (color)
+    for (auto name : { SANE_NAME_GAMMA_VECTOR_R, SANE_NAME_GAMMA_VECTOR_G,
+                       SANE_NAME_GAMMA_VECTOR_B })
+      if (usable(opt[name]))
+        tables.push_back(&opt[name]);
+  if (tables.size() != 3) {
+    tables.clear();
+    if (usable(opt[SANE_NAME_GAMMA_VECTOR]))
+      tables.push_back(&opt[SANE_NAME_GAMMA_VECTOR]);
+  }
+  bool ok = !tables.empty();
+  for (auto pTable : tables) {
+    auto values = gammaCurve(*pTable, gamma);
+    touched = true;
+    ok = ok && !values.empty() && pTable->set_numeric_values(values);
+  }
+  if (ok)
+    return SANE_NAME_GAMMA_VECTOR;
+
+  // Analog gamma is a correction exponent, i.e. the inverse of ours.
+  double value = 1.0 / gamma;
+  std::vector<sanecpp::option*> analog;
+  if (usable(opt[SANE_NAME_ANALOG_GAMMA]))
+    analog.push_back(&opt[SANE_NAME_ANALOG_GAMMA]);
+  else if (color)
+    for (auto name : { SANE_NAME_ANALOG_GAMMA_R, SANE_NAME_ANALOG_GAMMA_G,
+                       SANE_NAME_ANALOG_GAMMA_B })
+      if (usable(opt[name]))
+        analog.push_back(&opt[name]);
+  if (analog.size() != 1 && analog.size() != 3)
+    return nullptr;
+  for (auto pAnalog : analog)
+    if (value < pAnalog->min() || value > pAnalog->max())
+      return nullptr;
+  touched = true;
+  for (auto pAnalog : analog)
+    if (!pAnalog->set_numeric_value(value))
+      return nullptr;
+  return SANE_NAME_ANALOG_GAMMA;
+}
+
 }
 
 struct ScanJob::Private
@@ -100,18 +193,25 @@ struct ScanJob::Private
   const char* kindString() const;
   void applyDeviceOptions(const OptionsFile::Options&);
   void initGammaTable(float gamma);
-  void applyGamma(std::vector<char>&);
-  void synthesizeGray(std::vector<char>&);
+  void applyDeviceGamma(sanecpp::option_set&, bool reused);
+  void applyGamma(char*, size_t);
+  void synthesizeGray(char*, size_t);
   const char* statusString() const;
   bool atomicTransition(State from, State to);
   void updateStatus(SANE_Status);
 
   SANE_Status openSession();
+  std::string optionPlanKey() const;
+  std::shared_ptr<const OptionPlan> buildOptionPlan(const sanecpp::option_set&) const;
+  int deviceResolutionDpi() const;
   void startSession();
   void closeSession();
 
   bool beginTransfer();
   void finishTransfer(std::ostream&);
+  bool stopReader(PageReader&, bool& forcedClose);
+  void recoverFromStall(PageReader&, const std::string& reason);
+  void interruptTransfer();
 
   bool isPending() const;
   bool isProcessing() const;
@@ -129,11 +229,16 @@ struct ScanJob::Private
   std::string mScanSource, mIntent, mDocumentFormat, mColorMode;
   int mBitDepth, mRes_dpi;
   bool mColorScan;
+  bool mPreview;
   bool mDuplex;
   double mLeft_px, mTop_px, mWidth_px, mHeight_px;
 
   std::atomic<int> mKind, mImagesCompleted;
   std::shared_ptr<sanecpp::session> mpSession;
+  // Written on the worker thread only. The mutex guards access to
+  // mpSession and mpReader from connection threads.
+  PageReader* mpReader = nullptr;
+  std::mutex mTransferMutex;
 
   OptionsFile::Options mDeviceOptions;
   std::vector<uint16_t> mGammaTable;
@@ -221,6 +326,7 @@ ScanJob::Private::init(const ScanSettingsXml& settings, bool autoselectFormat, c
   mIntent = settings.getString("Intent");
   if (mIntent.empty())
     mIntent = "Photo";
+  mPreview = (mIntent == "Preview");
 
   double res_dpi = settings.getNumber("XResolution");
   if (!std::isnan(res_dpi) && res_dpi != settings.getNumber("YResolution"))
@@ -274,12 +380,22 @@ ScanJob::Private::init(const ScanSettingsXml& settings, bool autoselectFormat, c
     }
   }
   if (mColorMode.empty()) {
-    if (mIntent == "Photo")
+    // Without a requested mode, only photos are scanned in color, so
+    // previews use grayscale, which is cheapest to scan and transfer.
+    mColorScan = (mIntent == "Photo");
+    if (mColorScan)
       mColorMode = mpScanner->colorScanModeName();
     else
       mColorMode = mpScanner->grayScanModeName();
     mBitDepth = 8;
   }
+  // Previews are scanned at the lowest depth the encoders support. A color
+  // mode the client asked for is kept: eSCL scan settings name a single
+  // mode, so a client asking for an RGB preview expects a color image.
+  if (mPreview && mBitDepth > 8) {
+    std::clog << "preview: using bit depth 8 instead of " << mBitDepth << std::endl;
+    mBitDepth = 8;
+  }
 
   mDocumentFormat = settings.getString("DocumentFormat");
   if (mDocumentFormat.empty())
@@ -288,7 +404,7 @@ ScanJob::Private::init(const ScanSettingsXml& settings, bool autoselectFormat, c
      std::clog << "document format requested: " << mDocumentFormat << "\n";
   else if (mIntent == "Document" || mIntent == "Text")
      mDocumentFormat = HttpServer::MIME_TYPE_PDF;
-  else if (mIntent == "Photo")
+  else if (mIntent == "Photo" || mPreview)
      mDocumentFormat = HttpServer::MIME_TYPE_JPEG;
 
   // If Apple Airscan requests JPEG, we send PNG instead because it is
@@ -397,26 +513,55 @@ ScanJob::Private::initGammaTable(float gammaVal)
   }
 }
 
+// Devices with gamma options apply gamma correction in hardware, at no
+// cost; otherwise, the gamma table is applied to the scan data.
+void
+ScanJob::Private::applyDeviceGamma(sanecpp::option_set& opt, bool reused)
+{
+  double gamma = mColorScan ? mDeviceOptions.color_gamma
+                            : mDeviceOptions.gray_gamma;
+  double current = reused ? mpScanner->deviceGamma() : 1.0;
+  if (gamma == 1.0 && current == 1.0)
+    return;
+  bool touched = false;
+  double cpu = threadCpuSeconds();
+  const char* option = setDeviceGamma(opt, gamma, mColorScan, touched);
+  cpu = threadCpuSeconds() - cpu;
+  if (option) {
+    mpScanner->setDeviceGamma(gamma);
+    mGammaTable.clear();
+    std::clog << "gamma of " << gamma << " applied by device through ["
+              << option << "], " << cpu * 1000 << " ms CPU" << std::endl;
+  } else {
+    if (touched)
+      mpScanner->setDeviceGamma(std::numeric_limits<double>::quiet_NaN());
+    if (gamma != 1.0)
+      std::clog << "gamma of " << gamma << " applied in software" << std::endl;
+  }
+}
+
 void
-ScanJob::Private::applyGamma(std::vector<char>& ioData)
+ScanJob::Private::applyGamma(char* ioData, size_t size)
 {
   union
   {
     char* c;
     uint8_t* b;
     uint16_t* s;
-  } data = { ioData.data() };
+  } data = { ioData };
   if (mGammaTable.size() == 1 << 8) {
-    for (size_t i = 0; i < ioData.size(); ++i)
+    for (size_t i = 0; i < size; ++i)
       data.b[i] = mGammaTable[data.b[i]];
   } else if (mGammaTable.size() == 1 << 16) {
-    for (size_t i = 0; i < ioData.size() / 2; ++i)
+    for (size_t i = 0; i < size / 2; ++i)
       data.s[i] = mGammaTable[data.s[i]];
   }
 }
 
+// Converts RGB to gray in place, so the gray lines end up packed at the
+// beginning of the buffer.
 void
-ScanJob::Private::synthesizeGray(std::vector<char>& ioData)
+ScanJob::Private::synthesizeGray(char* ioData, size_t size)
 {
   // sRGB spectral weightings
   static const float rweight = 0.2126f, gweight = 0.7152f, bweight = 0.0722f;
@@ -425,9 +570,9 @@ ScanJob::Private::synthesizeGray(std::vector<char>& ioData)
     char* c;
     uint8_t* b;
     uint16_t* s;
-  } in = { ioData.data() }, out = in;
+  } in = { ioData }, out = in;
   if (mBitDepth == 8) {
-    while (in.c < ioData.data() + ioData.size()) {
+    while (in.c < ioData + size) {
       float f = rweight * in.b[0] + gweight * in.b[1] + bweight * in.b[2];
       f += 0.5f;
       f = std::min(255.0f, f);
@@ -436,7 +581,7 @@ ScanJob::Private::synthesizeGray(std::vector<char>& ioData)
       out.b += 1;
     }
   } else if (mBitDepth == 16) {
-    while (in.c < ioData.data() + ioData.size()) {
+    while (in.c < ioData + size) {
       float f = rweight * in.s[0] + gweight * in.s[1] + bweight * in.s[2];
       f += 0.5f;
       f = std::min(65535.0f, f);
@@ -598,6 +743,19 @@ ScanJob::Private::beginTransfer()
     ok = (openSession() == SANE_STATUS_GOOD);
     if (ok)
       mpSession->dump_options();
+    // An empty or open feeder fails the job without starting the device.
+    // The sensors are read now, as paper is often loaded just before
+    // a scan is requested.
+    if (ok && mKind != single && mImagesCompleted == 0) {
+      SANE_Status adfStatus = mpScanner->checkAdfSensors(mpSession->options());
+      if (adfStatus != SANE_STATUS_GOOD) {
+        std::clog << "ADF sensor status " << adfStatus << ", rejecting job"
+                  << std::endl;
+        updateStatus(adfStatus);
+        closeSession();
+        return false;
+      }
+    }
   }
   startSession();
   ok = isProcessing();
@@ -611,50 +769,125 @@ ScanJob::Private::openSession()
 {
   SANE_Status status = SANE_STATUS_GOOD;
   assert(!mpSession);
-  mpSession = mpScanner->open();
+  bool reused = false;
+  {
+    auto pSession = mpScanner->open(&reused);
+    std::lock_guard<std::mutex> lock(mTransferMutex);
+    mpSession = pSession;
+  }
   status = mpSession->status();
   if (status == SANE_STATUS_GOOD) {
-
     auto& opt = mpSession->options();
-
-    for (const auto& option : mDeviceOptions.sane_options)
-      opt[option.first] = option.second;
-
-    // The order in which options are set matters for some backends.
-    opt[SANE_NAME_SCAN_SOURCE] = mScanSource;
-    opt[SANE_NAME_SCAN_MODE] = mColorMode;
-    opt[SANE_NAME_BIT_DEPTH] = mBitDepth;
-    bool ok = opt[SANE_NAME_SCAN_RESOLUTION].set_numeric_value(mRes_dpi);
-    if (!ok)
-      ok = opt[SANE_NAME_SCAN_X_RESOLUTION].set_numeric_value(mRes_dpi) ||
-           opt[SANE_NAME_SCAN_Y_RESOLUTION].set_numeric_value(mRes_dpi);
-
-    double left = mLeft_px, top = mTop_px, right = mLeft_px + mWidth_px,
-           bottom = mTop_px + mHeight_px;
-
-    switch (opt[SANE_NAME_SCAN_TL_X].unit()) {
-      case SANE_UNIT_PIXEL:
-        break;
-      case SANE_UNIT_MM:
-        for (auto p : { &left, &right, &top, &bottom })
-          *p *= 25.4 / mRes_dpi;
-        break;
-      default:
-        ok = false;
+    std::string key = optionPlanKey();
+    auto pPlan = mpScanner->optionPlan(key);
+    if (!pPlan) {
+      pPlan = buildOptionPlan(opt);
+      if (pPlan)
+        mpScanner->cacheOptionPlan(key, pPlan);
     }
-    for (auto p : { &left, &right, &top, &bottom })
-      *p = ::floor(*p + 0.5);
-    opt[SANE_NAME_SCAN_TL_X] = left;
-    opt[SANE_NAME_SCAN_TL_Y] = top;
-    opt[SANE_NAME_SCAN_BR_X] = right;
-    opt[SANE_NAME_SCAN_BR_Y] = bottom;
-
-    if (!ok)
+    if (!pPlan)
+      return SANE_STATUS_INVAL;
+    // A device kept open from a previous job will mostly be set up
+    // already, so only options that differ are written.
+    auto result = pPlan->apply(opt, reused);
+    std::clog << "SANE options: " << result.written << " written, "
+              << result.unchanged << " unchanged, " << result.failed
+              << " not set" << std::endl;
+    if (!result.ok)
       status = SANE_STATUS_INVAL;
+    else
+      applyDeviceGamma(opt, reused);
   }
   return status;
 }
 
+std::string
+ScanJob::Private::optionPlanKey() const
+{
+  std::ostringstream oss;
+  oss << mScanSource << '\n'
+      << mPreview << '\n'
+      << mColorMode << '\n'
+      << mBitDepth << '\n'
+      << mRes_dpi << '\n'
+      << mLeft_px << ' ' << mTop_px << ' ' << mWidth_px << ' ' << mHeight_px;
+  for (const auto& option : mDeviceOptions.sane_options)
+    oss << '\n' << option.first << '=' << option.second;
+  return oss.str();
+}
+
+std::shared_ptr<const OptionPlan>
+ScanJob::Private::buildOptionPlan(const sanecpp::option_set& opt) const
+{
+  double left = mLeft_px, top = mTop_px, right = mLeft_px + mWidth_px,
+         bottom = mTop_px + mHeight_px;
+
+  switch (opt[sanecpp::known_option::tl_x].unit()) {
+    case SANE_UNIT_PIXEL:
+      break;
+    case SANE_UNIT_MM:
+      for (auto p : { &left, &right, &top, &bottom })
+        *p *= 25.4 / mRes_dpi;
+      break;
+    default:
+      return nullptr;
+  }
+  for (auto p : { &left, &right, &top, &bottom })
+    *p = ::floor(*p + 0.5);
+
+  auto pPlan = std::make_shared<OptionPlan>();
+  for (const auto& option : mDeviceOptions.sane_options)
+    pPlan->add(option.first, option.second);
+
+  // Backends with a preview option scan faster, e.g. by skipping
+  // calibration. It is part of every plan, even when off, as it persists
+  // on devices kept open between jobs; like other options, it is only
+  // written when its value differs.
+  if (!opt[SANE_NAME_PREVIEW].is_null())
+    pPlan->add(SANE_NAME_PREVIEW, mPreview ? "1" : "0");
+
+  // The order in which options are set matters for some backends.
+  pPlan->add(sanecpp::known_option::source, mScanSource)
+    .add(sanecpp::known_option::mode, mColorMode)
+    .add(sanecpp::known_option::bit_depth, mBitDepth)
+    .add(sanecpp::known_option::resolution, mRes_dpi, 2, true)
+    .add(sanecpp::known_option::x_resolution, mRes_dpi)
+    .add(sanecpp::known_option::y_resolution, mRes_dpi)
+    .add(sanecpp::known_option::tl_x, left)
+    .add(sanecpp::known_option::tl_y, top)
+    .add(sanecpp::known_option::br_x, right)
+    .add(sanecpp::known_option::br_y, bottom);
+  return pPlan;
+}
+
+// Backends may scan at another resolution than requested, especially in
+// preview mode. Some report it through the resolution option, others only
+// through the image width.
+int
+ScanJob::Private::deviceResolutionDpi() const
+{
+  const auto& opt = mpSession->options();
+  const auto* pRes = &opt[sanecpp::known_option::resolution];
+  if (pRes->is_null())
+    pRes = &opt[sanecpp::known_option::x_resolution];
+  double res = std::numeric_limits<double>::quiet_NaN();
+  if (pRes->is_active())
+    res = pRes->numeric_value();
+  if (!std::isnan(res) && res >= 1 && ::floor(res + 0.5) != mRes_dpi)
+    return ::floor(res + 0.5);
+  // The scan area as set on the device, which may have clipped it.
+  const auto &tl_x = opt[sanecpp::known_option::tl_x],
+             &br_x = opt[sanecpp::known_option::br_x];
+  double width = br_x.numeric_value() - tl_x.numeric_value();
+  if (tl_x.unit() != SANE_UNIT_MM || std::isnan(width) || width <= 0)
+    return mRes_dpi;
+  double inches = width / 25.4,
+         pixels = mpSession->parameters()->pixels_per_line;
+  if (std::fabs(pixels / (inches * mRes_dpi) - 1) > 0.1)
+    return ::floor(pixels / inches + 0.5);
+  return mRes_dpi;
+}
+
 void
 ScanJob::Private::startSession()
 {
@@ -665,9 +898,25 @@ ScanJob::Private::startSession()
 void
 ScanJob::Private::closeSession()
 {
+  std::shared_ptr<sanecpp::session> pSession;
+  {
+    std::lock_guard<std::mutex> lock(mTransferMutex);
+    pSession.swap(mpSession);
+  }
+  if (pSession)
+    pSession->cancel();
+}
+
+// Called on a connection thread. Interrupts a sane_read() in progress,
+// and wakes the worker thread if it is waiting for data.
+void
+ScanJob::Private::interruptTransfer()
+{
+  std::lock_guard<std::mutex> lock(mTransferMutex);
   if (mpSession)
     mpSession->cancel();
-  mpSession.reset();
+  if (mpReader)
+    mpReader->interrupt();
 }
 
 ScanJob&
@@ -697,7 +946,8 @@ ScanJob::Private::finishTransfer(std::ostream& os)
     if (mDocumentFormat == HttpServer::MIME_TYPE_JPEG) {
       auto jpegEncoder = new JpegEncoder;
       jpegEncoder->setGamma(1.0);
-      jpegEncoder->setQualityPercent(90);
+      jpegEncoder->setQualityPercent(mPreview ? 50 : 90);
+      jpegEncoder->setFast(mPreview);
       pEncoder.reset(jpegEncoder);
     } else if (mDocumentFormat == HttpServer::MIME_TYPE_PDF) {
       auto pdfEncoder = new PdfEncoder;
@@ -711,6 +961,8 @@ ScanJob::Private::finishTransfer(std::ostream& os)
       pEncoder.reset(pdfEncoder);
     } else if (mDocumentFormat == HttpServer::MIME_TYPE_PNG) {
       auto pngEncoder = new PngEncoder;
+      if (mPreview)
+        pngEncoder->setCompressionLevel(1);
       pEncoder.reset(pngEncoder);
     } else {
       mState = aborted;
@@ -718,7 +970,11 @@ ScanJob::Private::finishTransfer(std::ostream& os)
     }
   }
   if (isProcessing()) {
-    pEncoder->setResolutionDpi(mRes_dpi);
+    int res_dpi = deviceResolutionDpi();
+    if (res_dpi != mRes_dpi)
+      std::clog << "device scans at " << res_dpi << " dpi rather than "
+                << mRes_dpi << " dpi" << std::endl;
+    pEncoder->setResolutionDpi(res_dpi);
     if (mColorScan)
       pEncoder->setColorspace(ImageEncoder::RGB);
     else
@@ -749,29 +1005,75 @@ ScanJob::Private::finishTransfer(std::ostream& os)
   while (isProcessing()) {
     int linesWritten = 0;
     mLastActive = ::time(nullptr);
-    std::vector<char> buffer(mpSession->parameters()->bytes_per_line);
+    size_t bytesPerLine = mpSession->parameters()->bytes_per_line,
+           bytesPerEncodedLine = pEncoder->bytesPerLine();
+    // The device is read on a separate thread, while this thread
+    // processes, encodes and sends what has been read.
+    PageReader reader(mpSession);
+    {
+      std::lock_guard<std::mutex> lock(mTransferMutex);
+      mpReader = &reader;
+    }
+    auto watchdog = mpScanner->readWatchdog();
+    bool sendFailed = false, stalled = false;
+    double gammaCpuSeconds = 0;
     SANE_Status status = SANE_STATUS_GOOD;
     while (status == SANE_STATUS_GOOD && os && isProcessing()) {
-      status = mpSession->read(buffer).status();
+      auto pBlock = reader.nextBlock(1000);
       mLastActive = ::time(nullptr);
-      if (status == SANE_STATUS_GOOD) {
-        applyGamma(buffer);
-        if (!mColorScan && mDeviceOptions.synthesize_gray)
-          synthesizeGray(buffer);
-        try {
-          pEncoder->writeLine(buffer.data());
+      std::string reason;
+      if (reader.isStalled(watchdog.stallSeconds,
+                           watchdog.firstDataSeconds,
+                           watchdog.minBytesPerSecond,
+                           reason)) {
+        if (pBlock)
+          reader.releaseBlock();
+        recoverFromStall(reader, reason);
+        stalled = true;
+        break;
+      }
+      if (!pBlock)
+        continue;
+      char* block = pBlock->data.data();
+      if (!mGammaTable.empty()) {
+        double cpu = threadCpuSeconds();
+        applyGamma(block, pBlock->lines * bytesPerLine);
+        gammaCpuSeconds += threadCpuSeconds() - cpu;
+      }
+      if (!mColorScan && mDeviceOptions.synthesize_gray)
+        synthesizeGray(block, pBlock->lines * bytesPerLine);
+      try {
+        for (int i = 0; i < pBlock->lines; ++i) {
+          pEncoder->writeLine(block + i * bytesPerEncodedLine);
           ++linesWritten;
-          if (!os.flush())
-            throw std::runtime_error("Could not send data, state: " + describeStreamState(os));
-        } catch (const std::runtime_error& e) {
-          std::cerr << e.what() << ", aborting" << std::endl;
-          mState = aborted;
-          mStateReason = PWG_ERRORS_DETECTED;
-          closeSession();
         }
+        if (!os.flush())
+          throw std::runtime_error("Could not send data, state: " + describeStreamState(os));
+      } catch (const std::runtime_error& e) {
+        std::cerr << e.what() << ", aborting" << std::endl;
+        mState = aborted;
+        mStateReason = PWG_ERRORS_DETECTED;
+        sendFailed = true;
       }
+      status = pBlock->status;
+      reader.releaseBlock();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mTransferMutex);
+      mpReader = nullptr;
     }
-    std::clog << "lines written: " << linesWritten << std::endl;
+    bool forcedClose = false;
+    if (mState == canceled)
+      stopReader(reader, forcedClose);
+    else if (!stalled)
+      reader.stop();
+    if (sendFailed)
+      closeSession();
+    std::clog << "lines written: " << linesWritten << ", "
+              << reader.describeUtilisation() << std::endl;
+    if (!mGammaTable.empty())
+      std::clog << "software gamma: " << gammaCpuSeconds * 1000 << " ms CPU"
+                << std::endl;
     if (isProcessing()) {
       ++mImagesCompleted;
       std::clog << "images completed: " << mImagesCompleted << std::endl;
@@ -788,12 +1090,64 @@ ScanJob::Private::finishTransfer(std::ostream& os)
   mLastActive = ::time(nullptr);
 }
 
+// Stops the page reader after sane_cancel(). If the backend does not
+// return, the device is force closed when configured; otherwise, the
+// reader thread is left to finish on its own. Returns false in that case.
+bool
+ScanJob::Private::stopReader(PageReader& reader, bool& forcedClose)
+{
+  const int stopTimeoutMs = 10000;
+  forcedClose = false;
+  bool stopped = reader.stop(stopTimeoutMs);
+  if (!stopped && mpScanner->readWatchdog().forceClose) {
+    forcedClose = mpSession->force_close();
+    if (forcedClose)
+      stopped = reader.stop(stopTimeoutMs);
+  }
+  if (!stopped) {
+    std::cerr << mpScanner->saneName()
+              << ": backend does not return, device remains busy" << std::endl;
+    reader.abandon();
+  }
+  return stopped;
+}
+
+// Called on the job's worker thread while the page reader may be blocked
+// in sane_read(), which sane_cancel() is meant to interrupt.
+void
+ScanJob::Private::recoverFromStall(PageReader& reader, const std::string& reason)
+{
+  std::cerr << mpScanner->saneName() << ": " << reason << ", aborting job"
+            << std::endl;
+  mState = aborted;
+  mStateReason = PWG_ABORTED_BY_SYSTEM;
+  mpSession->cancel();
+  bool forcedClose = false;
+  bool stopped = stopReader(reader, forcedClose);
+  mpScanner->recordStall(reason, forcedClose, !stopped);
+  closeSession();
+}
+
 ScanJob&
 ScanJob::cancel()
 {
+  auto t0 = std::chrono::steady_clock::now();
   p->mState = canceled;
   p->mStateReason = PWG_JOB_CANCELED_BY_USER;
-  p->closeSession();
+  p->interruptTransfer();
+  // The session is in use by the worker thread during a transfer, so it
+  // is closed there, once the transfer has ended.
+  struct : WorkerThread::Callable
+  {
+    void onCall() override { p->closeSession(); }
+    Private* p = nullptr;
+  } functionCall;
+  functionCall.p = p;
+  p->mWorkerThread.executeSynchronously(functionCall);
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - t0);
+  std::clog << "job " << p->mUuid << " cancelled, device released after "
+            << ms.count() << " ms" << std::endl;
   return *this;
 }
 
@@ -21,17 +21,39 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <sane/saneopts.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
 #include <cstring>
+#include <iomanip>
+#include <map>
 #include <mutex>
 #include <set>
 #include <sstream>
 
 #include "basic/uuid.h"
+#include "capabilitycache.h"
 #include "scanjob.h"
+#include "startupprofile.h"
 #include "web/httpserver.h"
 
 namespace {
+
+// A device handle kept open between jobs. Shared with the deleters of
+// sessions, which may outlive the scanner.
+struct WarmHandle
+{
+  typedef std::chrono::steady_clock Clock;
+
+  std::mutex mMutex;
+  sanecpp::device_handle mHandle;
+  // The handle's option table, reloaded rather than rebuilt on reuse.
+  // It refers to the handle, so both are released together.
+  std::shared_ptr<sanecpp::option_set> mpOptions;
+  Clock::time_point mIdleSince;
+  int mIdleTimeoutSeconds = 0;
+  Scanner::OpenStats mStats;
+};
 std::string
 xmlEscape(const std::string& in)
 {
@@ -175,11 +197,73 @@ discretizeResolutions(double min, double max, double step)
   return resolutions;
 }
 
+uint64_t
+fnv1aHash(const std::string& s, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+  for (unsigned char c : s) {
+    hash ^= c;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+std::string
+joinList(const std::vector<std::string>& list, char separator)
+{
+  std::string s;
+  for (const auto& item : list)
+    s += separator + item;
+  return s.empty() ? s : s.substr(1);
+}
+
+std::vector<std::string>
+splitList(const std::string& s, char separator)
+{
+  std::vector<std::string> list;
+  std::istringstream iss(s);
+  std::string item;
+  while (std::getline(iss, item, separator))
+    if (!item.empty())
+      list.push_back(item);
+  return list;
+}
+
+// Returns the rest of a line, which may be empty without failing.
+std::string
+restOfLine(std::istream& is)
+{
+  std::string s;
+  std::getline(is >> std::ws, s);
+  is.clear();
+  return s;
+}
+
+// SANE_STATUS_COVER_OPEN or SANE_STATUS_NO_DOCS as reported by the
+// cover-open and page-loaded options, or SANE_STATUS_GOOD, also if the
+// device has no such sensors.
+SANE_Status
+readAdfSensors(const sanecpp::option_set& opt)
+{
+  auto sensor = [&opt](const char* name) {
+    const auto& option = opt[name];
+    if (!option.is_active() || !option.is_numeric())
+      return -1;
+    double value = option.numeric_value();
+    return std::isnan(value) ? -1 : int(value != 0);
+  };
+  if (sensor(SANE_NAME_COVER_OPEN) == 1)
+    return SANE_STATUS_COVER_OPEN;
+  if (sensor(SANE_NAME_PAGE_LOADED) == 0)
+    return SANE_STATUS_NO_DOCS;
+  return SANE_STATUS_GOOD;
+}
+
 } // namespace
 
 struct Scanner::Private
 {
   static std::set<Scanner::Private*> sInstances;
+  static std::mutex sInstancesMutex;
 
   Scanner* p;
   
@@ -210,6 +294,9 @@ struct Scanner::Private
   std::string mGrayScanModeName, mColorScanModeName;
   mutable int mCurrentProfile;
   OptionsFile::Options mDeviceOptions;
+  // Device options, and the icon url depending on them, may be updated
+  // while the scanner is in use.
+  mutable std::mutex mDeviceOptionsMutex;
 
   std::map<std::string, std::shared_ptr<ScanJob>> mJobs;
   std::mutex mJobsMutex;
@@ -217,23 +304,50 @@ struct Scanner::Private
   std::weak_ptr<sanecpp::session> mpSession;
 
   SANE_Status mTemporaryAdfStatus;
+  // Serializes polling and cache checks with taking the device for a job.
+  std::mutex mPollMutex;
+  std::atomic<bool> mPollAdfSensors;
+  std::atomic<SANE_Status> mAdfSensorStatus;
 
   const char* mError;
 
+  std::shared_ptr<CapabilityCache> mpCapabilityCache;
+  std::shared_ptr<StartupProfile> mpStartupProfile;
+  std::string mCacheKey;
+  std::atomic<bool> mRevalidateCache;
+
+  std::shared_ptr<WarmHandle> mpWarmHandle;
+  std::atomic<double> mDeviceGamma;
+
+  std::map<std::string, std::shared_ptr<const OptionPlan>> mOptionPlans;
+  mutable std::mutex mOptionPlansMutex;
+
+  Scanner::ReadWatchdog mReadWatchdog;
+  Scanner::StallStats mStallStats;
+  mutable std::mutex mWatchdogMutex;
+
   Private(Scanner*);
   ~Private();
   void init(const sanecpp::device_info&);
   const char* init2(const OptionsFile&);
+  void applyDeviceOptions(sanecpp::option_set&) const;
+  const char* probeCapabilities(sanecpp::option_set&);
+  std::string serializeCapabilities() const;
+  bool deserializeCapabilities(const std::string&);
+  void clearCapabilities();
+  std::string cacheKey() const;
+  void revalidateCache(sanecpp::option_set&);
   void generateStableUniqueName();
   void writeScannerCapabilitiesXml(std::ostream&) const;
   void writeSettingProfile(int bits, std::ostream&) const;
   std::shared_ptr<ScanJob> createJob();
   bool isOpen() const;
   const char* statusString() const;
-  const char* temporaryAdfStatusString();
+  const char* adfStatusString();
 };
 
 std::set<Scanner::Private*> Scanner::Private::sInstances;
+std::mutex Scanner::Private::sInstancesMutex;
 
 Scanner::Private::Private(Scanner* p)
   : p(p)
@@ -241,8 +355,14 @@ Scanner::Private::Private(Scanner* p)
   , mpAdfSimplex(nullptr)
   , mpAdfDuplex(nullptr)
   , mTemporaryAdfStatus(SANE_STATUS_GOOD)
+  , mPollAdfSensors(false)
+  , mAdfSensorStatus(SANE_STATUS_GOOD)
   , mError(nullptr)
+  , mRevalidateCache(false)
+  , mpWarmHandle(std::make_shared<WarmHandle>())
+  , mDeviceGamma(1.0)
 {
+  std::lock_guard<std::mutex> lock(sInstancesMutex);
   sInstances.insert(this);
 }
 
@@ -251,6 +371,7 @@ Scanner::Private::~Private()
   delete mpPlaten;
   delete mpAdfSimplex;
   delete mpAdfDuplex;
+  std::lock_guard<std::mutex> lock(sInstancesMutex);
   sInstances.erase(this);
 }
 
@@ -271,8 +392,9 @@ Scanner::Private::writeScannerCapabilitiesXml(std::ostream& os) const
      << mUuid << "</scan:UUID>\r\n";
   if (!mAdminUrl.empty())
     os << "<scan:AdminURI>" << mAdminUrl << "</scan:AdminURI>\r\n";
-  if (!mIconUrl.empty())
-    os << "<scan:IconURI>" << mIconUrl << "</scan:IconURI>\r\n";
+  std::string iconUrl = p->iconUrl();
+  if (!iconUrl.empty())
+    os << "<scan:IconURI>" << iconUrl << "</scan:IconURI>\r\n";
   if (mpPlaten) {
     os << "<scan:Platen>\r\n<scan:PlatenInputCaps>\r\n";
     mpPlaten->writeCapabilitiesXml(os);
@@ -384,11 +506,15 @@ Scanner::Private::statusString() const
   return isOpen() ? "Processing" : "Idle";
 }
 
+// The status of a failed job is reported once, and takes precedence over
+// the polled sensor state.
 const char*
-Scanner::Private::temporaryAdfStatusString()
+Scanner::Private::adfStatusString()
 {
   SANE_Status adfStatus = mTemporaryAdfStatus;
   mTemporaryAdfStatus = SANE_STATUS_GOOD;
+  if (adfStatus == SANE_STATUS_GOOD)
+    adfStatus = mAdfSensorStatus;
   switch (adfStatus) {
     case SANE_STATUS_GOOD:
       return "ScannerAdfLoaded";
@@ -452,6 +578,7 @@ Scanner::Private::generateStableUniqueName()
   int i = 0;
   std::ostringstream oss;
   bool found = false;
+  std::lock_guard<std::mutex> lock(sInstancesMutex);
   do {
     oss.str("");
     oss << s << ++i;
@@ -476,14 +603,46 @@ Scanner::Private::init(const sanecpp::device_info& info)
 const char*
 Scanner::Private::init2(const OptionsFile& optionsfile)
 {
-  auto device = sanecpp::open(mDeviceInfo);
+  {
+    std::lock_guard<std::mutex> lock(mDeviceOptionsMutex);
+    mDeviceOptions = optionsfile.scannerOptions(p);
+  }
+  clearCapabilities(); // from a previous, failed attempt
+  mCacheKey = cacheKey();
+  StartupProfile* pProfile = mpStartupProfile.get();
+  sanecpp::device_handle device;
+  {
+    StartupProfile::Phase phase(pProfile, "sane_open", mDeviceInfo.name);
+    device = sanecpp::open(mDeviceInfo);
+  }
   if (!device)
     return "failed to open device";
 
-  sanecpp::option_set opt(device);
-  // Apply device options first so any changes to dependent parameters
-  // are detected during initialization.
-  mDeviceOptions = optionsfile.scannerOptions(p);
+  auto counts = sanecpp::thread_call_counts();
+  const char* err = nullptr;
+  {
+    StartupProfile::Phase phase(pProfile, "probe_options", mDeviceInfo.name);
+    sanecpp::option_set opt(device);
+    // Apply device options first so any changes to dependent parameters
+    // are detected during initialization.
+    applyDeviceOptions(opt);
+    err = probeCapabilities(opt);
+  }
+  if (pProfile) {
+    const auto& now = sanecpp::thread_call_counts();
+    pProfile->addCount(mDeviceInfo.name, "sane_control_option",
+                       now.control_option - counts.control_option);
+    pProfile->addCount(mDeviceInfo.name, "option_reloads",
+                       now.option_reloads - counts.option_reloads);
+  }
+  if (!err && mpCapabilityCache)
+    mpCapabilityCache->store(mStableUniqueName, mCacheKey, serializeCapabilities());
+  return err;
+}
+
+void
+Scanner::Private::applyDeviceOptions(sanecpp::option_set& opt) const
+{
   for (const auto &option : mDeviceOptions.sane_options) {
     if (opt[option.first].is_null()) {
       std::clog << "SANE option specified in options file: " << option.first << ", does not exist" << std::endl;
@@ -493,8 +652,12 @@ Scanner::Private::init2(const OptionsFile& optionsfile)
       opt[option.first] = option.second;
     }
   }
+}
 
-  const auto& resolution = opt[SANE_NAME_SCAN_RESOLUTION];
+const char*
+Scanner::Private::probeCapabilities(sanecpp::option_set& opt)
+{
+  const auto& resolution = opt[sanecpp::known_option::resolution];
   if (resolution.is_null())
     return "missing SANE parameter: " SANE_NAME_SCAN_RESOLUTION;
   mMinResDpi = resolution.min();
@@ -512,7 +675,7 @@ Scanner::Private::init2(const OptionsFile& optionsfile)
     HttpServer::MIME_TYPE_PNG,
   });
 
-  auto modes = opt[SANE_NAME_SCAN_MODE].allowed_string_values();
+  auto modes = opt[sanecpp::known_option::mode].allowed_string_values();
   if (modes.empty()) {
     modes.push_back("Gray");
     modes.push_back("Color");
@@ -536,7 +699,7 @@ Scanner::Private::init2(const OptionsFile& optionsfile)
   mMaxWidthPx300dpi = 0;
   mMaxHeightPx300dpi = 0;
 
-  auto sources = opt[SANE_NAME_SCAN_SOURCE].allowed_string_values();
+  auto sources = opt[sanecpp::known_option::source].allowed_string_values();
   auto flatbedName = findFlatbedName(sources),
        adfSimplexName = findAdfSimplexName(sources),
        adfDuplexName = findAdfDuplexName(sources), adfName = std::string();
@@ -550,7 +713,7 @@ Scanner::Private::init2(const OptionsFile& optionsfile)
   if (!flatbedName.empty()) {
     mInputSources.push_back("Platen");
     if (flatbedName != "-")
-      opt[SANE_NAME_SCAN_SOURCE].set_string_value(flatbedName);
+      opt[sanecpp::known_option::source].set_string_value(flatbedName);
     mpPlaten = new Private::InputSource(this);
     err = mpPlaten->init(opt);
     if (!err) {
@@ -568,7 +731,7 @@ Scanner::Private::init2(const OptionsFile& optionsfile)
       mInputSources.push_back("Feeder");
   }
   if (!adfSimplexName.empty()) {
-    opt[SANE_NAME_SCAN_SOURCE].set_string_value(adfSimplexName);
+    opt[sanecpp::known_option::source].set_string_value(adfSimplexName);
     mpAdfSimplex = new Private::InputSource(this);
     err = mpAdfSimplex->init(opt);
     if (!err) {
@@ -582,7 +745,7 @@ Scanner::Private::init2(const OptionsFile& optionsfile)
     }
   }
   if (!adfDuplexName.empty()) {
-    opt[SANE_NAME_SCAN_SOURCE].set_string_value(adfDuplexName);
+    opt[sanecpp::known_option::source].set_string_value(adfDuplexName);
     mpAdfDuplex = new Private::InputSource(this);
     err = mpAdfDuplex->init(opt);
     if (!err) {
@@ -609,11 +772,11 @@ Scanner::Private::init2(const OptionsFile& optionsfile)
 const char*
 Scanner::Private::InputSource::init(const sanecpp::option_set& opt)
 {
-  mSourceName = opt[SANE_NAME_SCAN_SOURCE].string_value();
+  mSourceName = opt[sanecpp::known_option::source].string_value();
 
   mMaxBits = 8;
-  if (!opt[SANE_NAME_BIT_DEPTH].is_null())
-    mMaxBits = opt[SANE_NAME_BIT_DEPTH].max();
+  if (!opt[sanecpp::known_option::bit_depth].is_null())
+    mMaxBits = opt[sanecpp::known_option::bit_depth].max();
 
   // Defaults in case TL_X etc are not defined.
   // SANE requests that backends must work in the absence of those options.
@@ -626,8 +789,10 @@ Scanner::Private::InputSource::init(const sanecpp::option_set& opt)
   mMaxPhysicalHeight = mMaxHeight;
   SANE_Unit unit = SANE_UNIT_MM;
 
-  const auto &tl_x = opt[SANE_NAME_SCAN_TL_X], &tl_y = opt[SANE_NAME_SCAN_TL_Y],
-             &br_x = opt[SANE_NAME_SCAN_BR_X], &br_y = opt[SANE_NAME_SCAN_BR_Y];
+  const auto &tl_x = opt[sanecpp::known_option::tl_x],
+             &tl_y = opt[sanecpp::known_option::tl_y],
+             &br_x = opt[sanecpp::known_option::br_x],
+             &br_y = opt[sanecpp::known_option::br_y];
 
   if (!tl_x.is_null() && !tl_y.is_null() && !br_x.is_null() && !br_y.is_null())
   {
@@ -650,7 +815,7 @@ Scanner::Private::InputSource::init(const sanecpp::option_set& opt)
       f /= 25.4;
       break;
     case SANE_UNIT_PIXEL:
-      f /= opt[SANE_NAME_SCAN_RESOLUTION].numeric_value();
+      f /= opt[sanecpp::known_option::resolution].numeric_value();
       break;
     default:
       return "unexpected unit in scan area parameters";
@@ -666,6 +831,163 @@ Scanner::Private::InputSource::init(const sanecpp::option_set& opt)
   return nullptr;
 }
 
+std::string
+Scanner::Private::cacheKey() const
+{
+  // Capabilities depend on the SANE version, and on the SANE options
+  // applied from the options file.
+  uint64_t hash = fnv1aHash("");
+  for (const auto& option : mDeviceOptions.sane_options)
+    hash = fnv1aHash(option.second + '\n', fnv1aHash(option.first + '\n', hash));
+  std::ostringstream oss;
+  oss << std::hex << "1:" << sanecpp::version_code() << ":" << hash;
+  return oss.str();
+}
+
+std::string
+Scanner::Private::serializeCapabilities() const
+{
+  std::ostringstream oss;
+  oss.imbue(std::locale("C"));
+  oss << std::setprecision(10);
+  oss << "resolution " << mMinResDpi << " " << mMaxResDpi << " " << mResStepDpi << "\n";
+  oss << "discrete-resolutions";
+  for (auto res : mDiscreteResolutions)
+    oss << " " << res;
+  oss << "\n";
+  oss << "color-spaces " << joinList(mTxtColorSpaces, ' ') << "\n";
+  oss << "color-modes " << joinList(mColorModes, ' ') << "\n";
+  oss << "input-sources " << joinList(mInputSources, ' ') << "\n";
+  oss << "gray-mode " << mGrayScanModeName << "\n";
+  oss << "color-mode " << mColorScanModeName << "\n";
+  oss << "max-size " << mMaxWidthPx300dpi << " " << mMaxHeightPx300dpi << "\n";
+  struct { const char* name; const InputSource* pSource; } sources[] = {
+    { "platen", mpPlaten },
+    { "adf-simplex", mpAdfSimplex },
+    { "adf-duplex", mpAdfDuplex },
+  };
+  for (const auto& source : sources) {
+    const InputSource* s = source.pSource;
+    if (s) {
+      std::string intents = joinList(s->mSupportedIntents, ',');
+      oss << "source " << source.name << " " << s->mMaxBits << " "
+          << s->mMinWidth << " " << s->mMaxWidth << " "
+          << s->mMinHeight << " " << s->mMaxHeight << " "
+          << s->mMaxPhysicalWidth << " " << s->mMaxPhysicalHeight << " "
+          << (intents.empty() ? "-" : intents) << " " << s->mSourceName << "\n";
+    }
+  }
+  return oss.str();
+}
+
+bool
+Scanner::Private::deserializeCapabilities(const std::string& data)
+{
+  std::istringstream lines(data);
+  std::string line;
+  while (std::getline(lines, line)) {
+    std::istringstream iss(line);
+    iss.imbue(std::locale("C"));
+    std::string keyword;
+    iss >> keyword;
+    if (keyword == "resolution") {
+      iss >> mMinResDpi >> mMaxResDpi >> mResStepDpi;
+    } else if (keyword == "discrete-resolutions") {
+      double res;
+      while (iss >> res)
+        mDiscreteResolutions.push_back(res);
+      iss.clear();
+    } else if (keyword == "color-spaces") {
+      mTxtColorSpaces = splitList(restOfLine(iss), ' ');
+    } else if (keyword == "color-modes") {
+      mColorModes = splitList(restOfLine(iss), ' ');
+    } else if (keyword == "input-sources") {
+      mInputSources = splitList(restOfLine(iss), ' ');
+    } else if (keyword == "gray-mode") {
+      mGrayScanModeName = restOfLine(iss);
+    } else if (keyword == "color-mode") {
+      mColorScanModeName = restOfLine(iss);
+    } else if (keyword == "max-size") {
+      iss >> mMaxWidthPx300dpi >> mMaxHeightPx300dpi;
+    } else if (keyword == "source") {
+      std::string name, intents;
+      auto s = new InputSource(this);
+      iss >> name >> s->mMaxBits >> s->mMinWidth >> s->mMaxWidth
+          >> s->mMinHeight >> s->mMaxHeight >> s->mMaxPhysicalWidth
+          >> s->mMaxPhysicalHeight >> intents;
+      if (iss.fail()) {
+        delete s;
+        return false;
+      }
+      s->mSourceName = restOfLine(iss);
+      if (intents != "-")
+        s->mSupportedIntents = splitList(intents, ',');
+      InputSource** ppSource = nullptr;
+      if (name == "platen")
+        ppSource = &mpPlaten;
+      else if (name == "adf-simplex")
+        ppSource = &mpAdfSimplex;
+      else if (name == "adf-duplex")
+        ppSource = &mpAdfDuplex;
+      if (!ppSource || *ppSource) {
+        delete s;
+        return false;
+      }
+      *ppSource = s;
+    } else {
+      return false;
+    }
+    // Only numeric fields can fail, string fields may be empty.
+    if (iss.fail())
+      return false;
+  }
+  mDocumentFormats = std::vector<std::string>({
+    HttpServer::MIME_TYPE_PDF,
+    HttpServer::MIME_TYPE_JPEG,
+    HttpServer::MIME_TYPE_PNG,
+  });
+  return !mInputSources.empty();
+}
+
+void
+Scanner::Private::clearCapabilities()
+{
+  delete mpPlaten;
+  mpPlaten = nullptr;
+  delete mpAdfSimplex;
+  mpAdfSimplex = nullptr;
+  delete mpAdfDuplex;
+  mpAdfDuplex = nullptr;
+  mDiscreteResolutions.clear();
+  mTxtColorSpaces.clear();
+  mColorModes.clear();
+  mInputSources.clear();
+}
+
+void
+Scanner::Private::revalidateCache(sanecpp::option_set& opt)
+{
+  Private probed(p);
+  probed.mDeviceInfo = mDeviceInfo;
+  {
+    std::lock_guard<std::mutex> lock(mDeviceOptionsMutex);
+    probed.mDeviceOptions = mDeviceOptions;
+  }
+  probed.applyDeviceOptions(opt);
+  if (probed.probeCapabilities(opt))
+    return;
+  std::string data = probed.serializeCapabilities();
+  if (data == serializeCapabilities()) {
+    std::clog << mStableUniqueName << ": cached capabilities are up to date"
+              << std::endl;
+  } else {
+    std::clog << mStableUniqueName << ": cached capabilities are outdated, "
+              << "updating cache, changes will be published after reload"
+              << std::endl;
+    mpCapabilityCache->store(mStableUniqueName, mCacheKey, data);
+  }
+}
+
 Scanner::Scanner(const sanecpp::device_info& info)
   : p(new Private(this))
 {
@@ -679,6 +1001,65 @@ Scanner::initWithOptions(const OptionsFile& optionsfile)
   return p->mError == nullptr;
 }
 
+void
+Scanner::setCapabilityCache(const std::shared_ptr<CapabilityCache>& pCache)
+{
+  p->mpCapabilityCache = pCache;
+}
+
+void
+Scanner::setStartupProfile(const std::shared_ptr<StartupProfile>& pProfile)
+{
+  p->mpStartupProfile = pProfile;
+}
+
+bool
+Scanner::initFromCache(const OptionsFile& optionsfile)
+{
+  if (!p->mpCapabilityCache)
+    return false;
+  {
+    std::lock_guard<std::mutex> lock(p->mDeviceOptionsMutex);
+    p->mDeviceOptions = optionsfile.scannerOptions(this);
+  }
+  p->mCacheKey = p->cacheKey();
+  std::string data;
+  if (!p->mpCapabilityCache->lookup(p->mStableUniqueName, p->mCacheKey, data))
+    return false;
+  if (!p->deserializeCapabilities(data)) {
+    std::clog << p->mStableUniqueName << ": invalid cache entry" << std::endl;
+    p->clearCapabilities();
+    return false;
+  }
+  p->mRevalidateCache = true;
+  return true;
+}
+
+bool
+Scanner::updateOptions(const OptionsFile& optionsfile)
+{
+  auto options = optionsfile.scannerOptions(this);
+  std::unique_lock<std::mutex> lock(p->mDeviceOptionsMutex);
+  if (options == p->mDeviceOptions)
+    return false;
+  bool saneOptionsChanged = options.sane_options != p->mDeviceOptions.sane_options;
+  p->mDeviceOptions = options;
+  lock.unlock();
+  if (saneOptionsChanged) {
+    {
+      std::lock_guard<std::mutex> lock(p->mOptionPlansMutex);
+      p->mOptionPlans.clear();
+    }
+    std::clog << p->mStableUniqueName << ": SANE options changed, "
+              << "published capabilities are updated after reload"
+              << std::endl;
+    // Options removed from the options file must not stick to a device
+    // that is kept open.
+    closeIdleDevice();
+  }
+  return true;
+}
+
 Scanner::~Scanner()
 {
   delete p;
@@ -702,6 +1083,97 @@ Scanner::setTemporaryAdfStatus(SANE_Status status)
   p->mTemporaryAdfStatus = status;
 }
 
+void
+Scanner::setPollAdfSensors(bool poll)
+{
+  p->mPollAdfSensors = poll;
+}
+
+bool
+Scanner::pollAdfSensors()
+{
+  std::unique_lock<std::mutex> pollLock(p->mPollMutex, std::try_to_lock);
+  if (!pollLock.owns_lock())
+    return false;
+  if (!p->mPollAdfSensors || !hasAdf() || isOpen()) {
+    p->mAdfSensorStatus = SANE_STATUS_GOOD;
+    return false;
+  }
+  // Opening the device only for polling would keep other SANE frontends
+  // from using it, so only a device kept open is polled.
+  sanecpp::device_handle handle;
+  {
+    std::lock_guard<std::mutex> lock(p->mpWarmHandle->mMutex);
+    handle = p->mpWarmHandle->mHandle;
+  }
+  if (!handle) {
+    p->mAdfSensorStatus = SANE_STATUS_GOOD;
+    return false;
+  }
+  // While another device of the backend is scanning, polling would wait
+  // for it, holding up the purge thread; the poll is skipped instead.
+  sanecpp::try_calls tryCalls;
+  sanecpp::option_set opt(handle);
+  SANE_Status status = readAdfSensors(opt);
+  if (tryCalls.busy())
+    return false;
+  if (p->mAdfSensorStatus.exchange(status) != status)
+    std::clog << p->mStableUniqueName << ": ADF sensor status " << status
+              << std::endl;
+  return true;
+}
+
+bool
+Scanner::beginCacheRevalidation()
+{
+  return !isOpen() && p->mRevalidateCache.exchange(false);
+}
+
+void
+Scanner::revalidateCache()
+{
+  // Keeps SANE initialized while the thread may outlive the server loop.
+  sanecpp::init saneinit;
+  // Excludes jobs, which wait for the check to finish.
+  std::lock_guard<std::mutex> pollLock(p->mPollMutex);
+  if (isOpen()) {
+    p->mRevalidateCache = true; // try again when idle
+    return;
+  }
+  // Probing switches sources, so a device kept open is closed afterwards,
+  // and the next job starts from a freshly opened device.
+  sanecpp::device_handle handle;
+  {
+    std::lock_guard<std::mutex> lock(p->mpWarmHandle->mMutex);
+    handle.swap(p->mpWarmHandle->mHandle);
+    p->mpWarmHandle->mpOptions.reset();
+  }
+  if (!handle)
+    handle = sanecpp::open(p->mDeviceInfo);
+  if (!handle) {
+    std::clog << p->mStableUniqueName
+              << ": could not open device to check cached capabilities"
+              << std::endl;
+    return;
+  }
+  sanecpp::option_set opt(handle);
+  p->revalidateCache(opt);
+}
+
+SANE_Status
+Scanner::adfSensorStatus() const
+{
+  return p->mAdfSensorStatus;
+}
+
+SANE_Status
+Scanner::checkAdfSensors(const sanecpp::option_set& opt) const
+{
+  if (!p->mPollAdfSensors)
+    return SANE_STATUS_GOOD;
+  return readAdfSensors(opt);
+}
+
 const std::string&
 Scanner::uuid() const
 {
@@ -720,6 +1192,12 @@ Scanner::saneName() const
   return p->mDeviceInfo.name;
 }
 
+const sanecpp::device_info&
+Scanner::deviceInfo() const
+{
+  return p->mDeviceInfo;
+}
+
 const std::string&
 Scanner::stableUniqueName() const
 {
@@ -762,27 +1240,31 @@ Scanner::adminUrl() const
   return p->mAdminUrl;
 }
 
-const std::string&
+std::string
 Scanner::iconFile() const
 {
+  std::lock_guard<std::mutex> lock(p->mDeviceOptionsMutex);
   return p->mDeviceOptions.icon;
 }
 
-const std::string&
+std::string
 Scanner::note() const
 {
+  std::lock_guard<std::mutex> lock(p->mDeviceOptionsMutex);
   return p->mDeviceOptions.note;
 }
 
 void
 Scanner::setIconUrl(const std::string& url)
 {
+  std::lock_guard<std::mutex> lock(p->mDeviceOptionsMutex);
   p->mIconUrl = url;
 }
 
-const std::string&
+std::string
 Scanner::iconUrl() const
 {
+  std::lock_guard<std::mutex> lock(p->mDeviceOptionsMutex);
   return p->mIconUrl;
 }
 
@@ -905,9 +1387,70 @@ Scanner::colorScanModeName() const
 }
 
 std::shared_ptr<sanecpp::session>
-Scanner::open()
-{
-  auto session = std::make_shared<sanecpp::session>(p->mDeviceInfo.name);
+Scanner::open(bool* pReused)
+{
+  // Waits for a poll in progress; the sensor state is stale once the
+  // device is in use.
+  std::lock_guard<std::mutex> pollLock(p->mPollMutex);
+  p->mAdfSensorStatus = SANE_STATUS_GOOD;
+  auto pWarm = p->mpWarmHandle;
+  sanecpp::device_handle handle;
+  std::shared_ptr<sanecpp::option_set> pOptions;
+  {
+    std::lock_guard<std::mutex> lock(pWarm->mMutex);
+    handle.swap(pWarm->mHandle);
+    pOptions.swap(pWarm->mpOptions);
+    if (handle)
+      ++pWarm->mStats.reuses;
+  }
+  if (!pOptions)
+    pOptions = std::make_shared<sanecpp::option_set>();
+  if (pReused)
+    *pReused = !!handle;
+  SANE_Status status = SANE_STATUS_GOOD;
+  if (handle) {
+    std::clog << p->mStableUniqueName << ": reusing open device" << std::endl;
+  } else {
+    p->mDeviceGamma = 1.0;
+    auto t0 = WarmHandle::Clock::now();
+    handle = sanecpp::open(p->mDeviceInfo, &status);
+    double seconds =
+      std::chrono::duration<double>(WarmHandle::Clock::now() - t0).count();
+    std::lock_guard<std::mutex> lock(pWarm->mMutex);
+    auto& stats = pWarm->mStats;
+    if (handle) {
+      ++stats.opens;
+      stats.lastSeconds = seconds;
+      stats.maxSeconds = std::max(stats.maxSeconds, seconds);
+      stats.totalSeconds += seconds;
+    } else {
+      ++stats.failures;
+    }
+  }
+  // When the session is done, its device handle and option table are kept
+  // for the next job.
+  std::weak_ptr<WarmHandle> wpWarm = pWarm;
+  auto session = std::shared_ptr<sanecpp::session>(
+    new sanecpp::session(handle, pOptions, status),
+    [wpWarm, handle, pOptions](sanecpp::session* pSession) mutable {
+      SANE_Status status = pSession->status();
+      bool reusable = status == SANE_STATUS_GOOD || status == SANE_STATUS_EOF
+                      || status == SANE_STATUS_NO_DOCS
+                      || status == SANE_STATUS_CANCELLED;
+      delete pSession;
+      auto pWarm = wpWarm.lock();
+      if (pWarm && handle && reusable) {
+        std::lock_guard<std::mutex> lock(pWarm->mMutex);
+        if (pWarm->mIdleTimeoutSeconds > 0 && !pWarm->mHandle) {
+          pWarm->mHandle = handle;
+          pWarm->mpOptions = pOptions;
+          pWarm->mIdleSince = WarmHandle::Clock::now();
+        }
+      }
+      // The deleter may outlive the session while weak references exist.
+      pOptions.reset();
+      handle.reset();
+    });
   p->mpSession = session;
   return session;
 }
@@ -918,6 +1461,120 @@ Scanner::isOpen() const
   return p->isOpen();
 }
 
+void
+Scanner::setIdleTimeoutSeconds(int seconds)
+{
+  std::lock_guard<std::mutex> lock(p->mpWarmHandle->mMutex);
+  p->mpWarmHandle->mIdleTimeoutSeconds = seconds;
+}
+
+bool
+Scanner::closeIfIdle()
+{
+  sanecpp::device_handle handle;
+  std::shared_ptr<sanecpp::option_set> pOptions;
+  {
+    auto pWarm = p->mpWarmHandle;
+    std::lock_guard<std::mutex> lock(pWarm->mMutex);
+    auto timeout = std::chrono::seconds(pWarm->mIdleTimeoutSeconds);
+    if (pWarm->mHandle && WarmHandle::Clock::now() - pWarm->mIdleSince >= timeout) {
+      handle.swap(pWarm->mHandle);
+      pOptions.swap(pWarm->mpOptions);
+    }
+  }
+  if (!handle)
+    return false;
+  std::clog << p->mStableUniqueName << ": closing idle device" << std::endl;
+  return true; // handle is closed when going out of scope
+}
+
+void
+Scanner::closeIdleDevice()
+{
+  sanecpp::device_handle handle;
+  std::shared_ptr<sanecpp::option_set> pOptions;
+  std::lock_guard<std::mutex> lock(p->mpWarmHandle->mMutex);
+  handle.swap(p->mpWarmHandle->mHandle);
+  pOptions.swap(p->mpWarmHandle->mpOptions);
+}
+
+double
+Scanner::deviceGamma() const
+{
+  return p->mDeviceGamma;
+}
+
+void
+Scanner::setDeviceGamma(double gamma)
+{
+  p->mDeviceGamma = gamma;
+}
+
+std::shared_ptr<const OptionPlan>
+Scanner::optionPlan(const std::string& key) const
+{
+  std::lock_guard<std::mutex> lock(p->mOptionPlansMutex);
+  auto i = p->mOptionPlans.find(key);
+  return i == p->mOptionPlans.end() ? nullptr : i->second;
+}
+
+void
+Scanner::cacheOptionPlan(const std::string& key,
+                         std::shared_ptr<const OptionPlan> pPlan)
+{
+  // Clients tend to use a few scan settings over and over, so a small
+  // cache is sufficient.
+  const size_t maxPlans = 32;
+  std::lock_guard<std::mutex> lock(p->mOptionPlansMutex);
+  if (p->mOptionPlans.size() >= maxPlans)
+    p->mOptionPlans.clear();
+  p->mOptionPlans[key] = pPlan;
+}
+
+Scanner::OpenStats
+Scanner::openStats() const
+{
+  std::lock_guard<std::mutex> lock(p->mpWarmHandle->mMutex);
+  OpenStats stats = p->mpWarmHandle->mStats;
+  stats.deviceOpen = !!p->mpWarmHandle->mHandle;
+  return stats;
+}
+
+void
+Scanner::setReadWatchdog(const ReadWatchdog& watchdog)
+{
+  std::lock_guard<std::mutex> lock(p->mWatchdogMutex);
+  p->mReadWatchdog = watchdog;
+}
+
+Scanner::ReadWatchdog
+Scanner::readWatchdog() const
+{
+  std::lock_guard<std::mutex> lock(p->mWatchdogMutex);
+  return p->mReadWatchdog;
+}
+
+void
+Scanner::recordStall(const std::string& reason, bool forcedClose, bool abandoned)
+{
+  std::lock_guard<std::mutex> lock(p->mWatchdogMutex);
+  auto& stats = p->mStallStats;
+  ++stats.stalls;
+  if (forcedClose)
+    ++stats.forcedCloses;
+  if (abandoned)
+    ++stats.abandoned;
+  stats.lastReason = reason;
+  stats.lastTime = ::time(nullptr);
+}
+
+Scanner::StallStats
+Scanner::stallStats() const
+{
+  std::lock_guard<std::mutex> lock(p->mWatchdogMutex);
+  return p->mStallStats;
+}
+
 void
 Scanner::writeScannerCapabilitiesXml(std::ostream& os) const
 {
@@ -930,7 +1587,12 @@ Scanner::createJobFromScanSettingsXml(const std::string& xml,
                                       bool autoselectFormat)
 {
   auto job = p->createJob();
-  job->initWithScanSettingsXml(xml, autoselectFormat, p->mDeviceOptions);
+  OptionsFile::Options options;
+  {
+    std::lock_guard<std::mutex> lock(p->mDeviceOptionsMutex);
+    options = p->mDeviceOptions;
+  }
+  job->initWithScanSettingsXml(xml, autoselectFormat, options);
   return job;
 }
 
@@ -945,11 +1607,11 @@ Scanner::getJob(const std::string& uuid)
 bool
 Scanner::cancelJob(const std::string& uuid)
 {
-  std::lock_guard<std::mutex> lock(p->mJobsMutex);
-  auto i = p->mJobs.find(uuid);
-  if (i == p->mJobs.end())
+  auto pJob = getJob(uuid);
+  if (!pJob)
     return false;
-  i->second->cancel();
+  // Waits until the device has been released.
+  pJob->cancel();
   return true;
 }
 
@@ -991,7 +1653,7 @@ Scanner::writeScannerStatusXml(std::ostream& os) const
      << "</pwg:State>\r\n";
 
   if (p->mpAdfSimplex || p->mpAdfDuplex)
-    os << "<scan:AdfState>" << p->temporaryAdfStatusString()
+    os << "<scan:AdfState>" << p->adfStatusString()
        << "</scan:AdfState>\r\n";
 
   os << "<scan:Jobs>\r\n";
@@ -19,6 +19,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef SCANNER_H
 #define SCANNER_H
 
+#include <ctime>
 #include <iostream>
 #include <memory>
 #include <string>
@@ -27,6 +28,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "sanecpp/sanecpp.h"
 
 class ScanJob;
+class CapabilityCache;
+class StartupProfile;
+class OptionPlan;
 
 class Scanner
 {
@@ -37,6 +41,16 @@ public:
   explicit Scanner(const sanecpp::device_info&);
   ~Scanner();
   bool initWithOptions(const OptionsFile&);
+  // Capabilities are stored into the cache when probed, and revalidated
+  // when the device is first opened after initialization from cache.
+  void setCapabilityCache(const std::shared_ptr<CapabilityCache>&);
+  bool initFromCache(const OptionsFile&);
+  // Timings and SANE call counts of initialization are added to the
+  // profile.
+  void setStartupProfile(const std::shared_ptr<StartupProfile>&);
+  // Updates device options used by future jobs. Returns true if options
+  // have changed.
+  bool updateOptions(const OptionsFile&);
 
 
   const char* error() const;
@@ -45,6 +59,7 @@ public:
   const std::string& uuid() const;
   const std::string& makeAndModel() const;
   const std::string& saneName() const;
+  const sanecpp::device_info& deviceInfo() const;
   const std::string& stableUniqueName() const;
 
   void setPublishedName(const std::string&);
@@ -55,10 +70,10 @@ public:
   void setAdminUrl(const std::string&);
   const std::string& adminUrl() const;
   void setIconUrl(const std::string&);
-  const std::string& iconUrl() const;
+  std::string iconUrl() const;
 
-  const std::string& iconFile() const;
-  const std::string& note() const;
+  std::string iconFile() const;
+  std::string note() const;
   
   const std::vector<std::string>& documentFormats() const;
   const std::vector<std::string>& txtColorSpaces() const;
@@ -93,8 +108,80 @@ public:
   JobList jobs() const;
   void setTemporaryAdfStatus(SANE_Status);
 
-  std::shared_ptr<sanecpp::session> open();
+  // While the device is idle, and kept open between jobs, its ADF sensors
+  // (page-loaded, cover-open) are read periodically, and their state is
+  // cached. Returns false if the device could not be polled.
+  void setPollAdfSensors(bool);
+  bool pollAdfSensors();
+  // SANE_STATUS_NO_DOCS or SANE_STATUS_COVER_OPEN as last polled, or
+  // SANE_STATUS_GOOD, also if unknown. Reported in ScannerStatus only, as
+  // it may be several seconds old.
+  SANE_Status adfSensorStatus() const;
+  // Reads the ADF sensors of a device in use, if sensors are polled.
+  SANE_Status checkAdfSensors(const sanecpp::option_set&) const;
+
+  // Capabilities read from the cache are checked against the device once,
+  // while it is idle. Returns true if a check is due, and should be run
+  // on a thread of its own, as probing takes a while.
+  bool beginCacheRevalidation();
+  void revalidateCache();
+
+  // The device handle is kept open after a session has finished, and
+  // reused by the next session, until idle for the given time.
+  // With 0, the device is closed after each session.
+  void setIdleTimeoutSeconds(int);
+  // If pReused is given, it is set to whether a device kept open
+  // by a previous session is used.
+  std::shared_ptr<sanecpp::session> open(bool* pReused = nullptr);
   bool isOpen() const;
+  // Closes a device that has been idle for longer than the idle timeout,
+  // so it may be used by other SANE frontends. Returns true if closed.
+  bool closeIfIdle();
+  void closeIdleDevice();
+
+  struct OpenStats
+  {
+    unsigned long opens = 0, reuses = 0, failures = 0;
+    double lastSeconds = 0, maxSeconds = 0, totalSeconds = 0;
+    bool deviceOpen = false; // kept open while idle
+  };
+  OpenStats openStats() const;
+
+  // Scans are aborted when the device delivers no data for
+  // firstDataSeconds after starting, no more data for stallSeconds, or
+  // less than minBytesPerSecond; 0 disables each check. With
+  // forceClose, a device that does not return from sane_cancel() is
+  // closed by terminating its SANE host process.
+  struct ReadWatchdog
+  {
+    int stallSeconds = 0, firstDataSeconds = 0, minBytesPerSecond = 0;
+    bool forceClose = false;
+  };
+  void setReadWatchdog(const ReadWatchdog&);
+  ReadWatchdog readWatchdog() const;
+
+  struct StallStats
+  {
+    unsigned long stalls = 0, forcedCloses = 0, abandoned = 0;
+    std::string lastReason;
+    ::time_t lastTime = 0;
+  };
+  // Records a scan aborted by the read watchdog. Abandoned means the
+  // device could not be recovered, and remains busy until the backend
+  // returns.
+  void recordStall(const std::string& reason, bool forcedClose, bool abandoned);
+  StallStats stallStats() const;
+
+  // Gamma correction applied by the device through its gamma options.
+  // It persists while the device is kept open between jobs, and is 1
+  // after the device has been opened; NaN if unknown.
+  double deviceGamma() const;
+  void setDeviceGamma(double);
+
+  // Option plans for scan tickets, cached until device options change.
+  std::shared_ptr<const OptionPlan> optionPlan(const std::string& key) const;
+  void cacheOptionPlan(const std::string& key,
+                       std::shared_ptr<const OptionPlan>);
 
   void writeScannerCapabilitiesXml(std::ostream&) const;
   void writeScannerStatusXml(std::ostream&) const;
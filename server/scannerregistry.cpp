@@ -0,0 +1,106 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "scannerregistry.h"
+
+#include <algorithm>
+
+ScannerRegistry::ScannerRegistry()
+  : mEnumerating(false)
+{}
+
+void
+ScannerRegistry::beginEnumeration()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mScanners.clear();
+  mPending.clear();
+  mEnumerating = true;
+}
+
+void
+ScannerRegistry::endEnumeration()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mEnumerating = false;
+}
+
+bool
+ScannerRegistry::enumerating() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mEnumerating;
+}
+
+void
+ScannerRegistry::addPending(const std::shared_ptr<Scanner>& pScanner)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mPending.push_back(pScanner);
+}
+
+void
+ScannerRegistry::removePending(const Scanner* pScanner)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  erasePending(pScanner);
+}
+
+void
+ScannerRegistry::addReady(const ScannerEntry& entry)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  erasePending(entry.pScanner.get());
+  mScanners.push_back(entry);
+}
+
+void
+ScannerRegistry::remove(const Scanner* pScanner)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  erasePending(pScanner);
+  mScanners.erase(std::remove_if(mScanners.begin(), mScanners.end(),
+                                 [pScanner](const ScannerEntry& entry) {
+                                   return entry.pScanner.get() == pScanner;
+                                 }),
+                  mScanners.end());
+}
+
+void
+ScannerRegistry::erasePending(const Scanner* pScanner)
+{
+  mPending.erase(std::remove_if(mPending.begin(), mPending.end(),
+                                [pScanner](const std::shared_ptr<Scanner>& p) {
+                                  return p.get() == pScanner;
+                                }),
+                 mPending.end());
+}
+
+ScannerList
+ScannerRegistry::scanners() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mScanners;
+}
+
+ScannerRegistry::PendingList
+ScannerRegistry::pendingScanners() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mPending;
+}
@@ -0,0 +1,78 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCANNER_REGISTRY_H
+#define SCANNER_REGISTRY_H
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "scanner.h"
+#include "zeroconf/mdnspublisher.h"
+
+struct ScannerEntry
+{
+  std::shared_ptr<Scanner> pScanner;
+  std::shared_ptr<MdnsPublisher::Service> pService;
+  // The name may change after publication due to an mDNS name collision.
+  std::string publishedName() const
+  {
+    return pService ? pService->name() : pScanner->publishedName();
+  }
+};
+typedef std::vector<ScannerEntry> ScannerList;
+
+// Keeps track of scanners while they are enumerated and initialized, and
+// of scanners that are ready to be used. All functions are thread-safe,
+// and return copies.
+class ScannerRegistry
+{
+  ScannerRegistry(const ScannerRegistry&) = delete;
+  ScannerRegistry& operator=(const ScannerRegistry&) = delete;
+
+public:
+  typedef std::vector<std::shared_ptr<Scanner>> PendingList;
+
+  ScannerRegistry();
+
+  // Removes all scanners, and marks the beginning of enumeration.
+  void beginEnumeration();
+  // Enumeration has finished, but some scanners may still be pending.
+  void endEnumeration();
+  bool enumerating() const;
+
+  void addPending(const std::shared_ptr<Scanner>&);
+  void removePending(const Scanner*);
+  // Adds a scanner that is ready, and removes it from the pending list.
+  void addReady(const ScannerEntry&);
+  void remove(const Scanner*);
+
+  ScannerList scanners() const;
+  PendingList pendingScanners() const;
+
+private:
+  void erasePending(const Scanner*);
+
+  mutable std::mutex mMutex;
+  bool mEnumerating;
+  ScannerList mScanners;
+  PendingList mPending;
+};
+
+#endif // SCANNER_REGISTRY_H
@@ -18,15 +18,20 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "server.h"
 
+#include <algorithm>
 #include <cstring>
 #include <cmath>
 #include <csignal>
 #include <ctime>
 #include <cstdint>
-#include <regex>
+#include <chrono>
+#include <condition_variable>
+#include <set>
 #include <sstream>
+#include <thread>
 #include <iomanip>
 #include <unistd.h>
+#include <net/if.h>
 
 #include "mainpage.h"
 #include "scannerpage.h"
@@ -34,8 +39,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "scanjob.h"
 #include "scanner.h"
 #include "purgethread.h"
+#include "probepool.h"
+#include "capabilitycache.h"
+#include "startupprofile.h"
+#include "basic/eventaggregator.h"
+#include "basic/filewatcher.h"
+#include "basic/json.h"
 #include "basic/url.h"
 #include "basic/uuid.h"
+#include "sanecpp/host.h"
 #include "zeroconf/hotplugnotifier.h"
 #include "zeroconf/networkhotplugnotifier.h"
 #include "web/accessfile.h"
@@ -54,21 +66,48 @@ std::string hostname()
   return buf;
 }
 
-struct Notifier : HotplugNotifier
+std::vector<std::string> splitList(const std::string& s)
+{
+  std::vector<std::string> list;
+  std::istringstream iss(s);
+  std::string item;
+  while (iss >> item)
+    list.push_back(item);
+  return list;
+}
+
+struct Reloader : EventAggregator
 {
   Server& server;
-  int reloadDelay;
-  Notifier(Server& s, int delay)
-    : server(s), reloadDelay(delay)
+  Reloader(Server& s, int quietPeriod, int maxDelay)
+    : server(s)
+  {
+    setQuietPeriodSeconds(quietPeriod);
+    setMaxDelaySeconds(maxDelay);
+  }
+  ~Reloader() { stop(); }
+  bool onEvents(const Summary& events) override
+  {
+    std::clog << "hotplug events: " << describe(events)
+              << ", reloading configuration" << std::endl;
+    return server.terminate(SIGHUP);
+  }
+};
+
+struct Notifier : HotplugNotifier
+{
+  Reloader& reloader;
+  explicit Notifier(Reloader& r)
+    : reloader(r)
   {}
   void onHotplugEvent(Event ev) override
   {
     switch (ev) {
       case deviceArrived:
+        reloader.post("usb device arrived");
+        break;
       case deviceLeft:
-        std::clog << "hotplug event, reloading configuration" << std::endl;
-        ::sleep(reloadDelay);
-        server.terminate(SIGHUP);
+        reloader.post("usb device left");
         break;
       case other:
         break;
@@ -76,22 +115,55 @@ struct Notifier : HotplugNotifier
   }
 };
 
-struct NetworkNotifier : NetworkHotplugNotifier
+struct ListenerUpdater : EventAggregator
 {
   Server& server;
-  int reloadDelay;
-  NetworkNotifier(Server& s, int delay)
-    : server(s), reloadDelay(delay)
+  std::string interface;
+  ListenerUpdater(Server& s, const std::string& interface, int quietPeriod, int maxDelay)
+    : server(s), interface(interface)
+  {
+    setQuietPeriodSeconds(quietPeriod);
+    setMaxDelaySeconds(maxDelay);
+  }
+  ~ListenerUpdater() { stop(); }
+  bool onEvents(const Summary& events) override
+  {
+    if (!interface.empty() && interface != "*") {
+      int index = ::if_nametoindex(interface.c_str());
+      if (index != server.interfaceIndex()) {
+        std::clog << "network events: " << describe(events)
+                  << ", interface " << interface
+                  << " changed, reloading configuration" << std::endl;
+        return server.terminate(SIGHUP);
+      }
+    }
+    // Only listening sockets need an update. mDNS services are bound to
+    // an interface index, and their address records are maintained by
+    // the mDNS responder.
+    std::clog << "network events: " << describe(events)
+              << ", updating listening sockets" << std::endl;
+    server.updateListeners();
+    return false;
+  }
+};
+
+struct NetworkNotifier : NetworkHotplugNotifier
+{
+  ListenerUpdater& updater;
+  explicit NetworkNotifier(ListenerUpdater& u)
+    : updater(u)
   {}
   void onHotplugEvent(Event ev) override
   {
     switch (ev) {
       case addressArrived:
+        updater.post("ip address arrived");
+        break;
       case addressLeft:
+        updater.post("ip address left");
+        break;
       case addressChange:
-        std::clog << "network hotplug event, reloading configuration" << std::endl;
-        ::sleep(reloadDelay);
-        server.terminate(SIGHUP);
+        updater.post("ip address changed");
         break;
       case other:
         break;
@@ -99,6 +171,39 @@ struct NetworkNotifier : NetworkHotplugNotifier
   }
 };
 
+struct ConfigReloader : EventAggregator
+{
+  Server& server;
+  ConfigReloader(Server& s, int quietPeriod, int maxDelay)
+    : server(s)
+  {
+    setQuietPeriodSeconds(quietPeriod);
+    setMaxDelaySeconds(maxDelay);
+  }
+  ~ConfigReloader() { stop(); }
+  bool onEvents(const Summary& events) override
+  {
+    for (const auto& event : events) {
+      std::clog << "configuration file changed: " << event.first << std::endl;
+      server.reloadConfigFile(event.first);
+    }
+    return false;
+  }
+};
+
+struct ConfigWatcher : FileWatcher
+{
+  ConfigReloader& reloader;
+  explicit ConfigWatcher(ConfigReloader& r)
+    : reloader(r)
+  {}
+  ~ConfigWatcher() { stop(); }
+  void onFileChanged(const std::string& path) override
+  {
+    reloader.post(path);
+  }
+};
+
 bool
 clientIsAirscan(const HttpServer::Request& req)
 {
@@ -109,25 +214,48 @@ clientIsAirscan(const HttpServer::Request& req)
 } // namespace
 
 Server::Server(int argc, char** argv)
-  : mAnnounce(true)
+  : mCompatiblepathTaken(false)
+  , mOptionsReloaded(false)
+  , mAnnounce(true)
   , mWebinterface(true)
   , mResetoption(false)
+  , mAdminpages(false)
   , mDiscloseversion(true)
   , mLocalonly(true)
   , mHotplug(true)
   , mNetworkhotplug(true)
+  , mConfigreload(true)
   , mRandompaths(false)
   , mCompatiblepath(false)
   , mReloadDelay(1)
+  , mReloadMaxDelay(10)
+  , mProbeThreads(4)
+  , mProbeTimeout(20)
+  , mProbeHangTimeout(120)
+  , mProbeRetries(2)
+  , mDiscoveryInterval(300)
+  , mDiscoveryTimeout(60)
   , mJobtimeout(0)
   , mPurgeinterval(0)
+  , mDeviceIdleTimeout(30)
+  , mReadStallTimeout(60)
+  , mReadFirstDataTimeout(300)
+  , mReadMinThroughput(0)
+  , mSaneHosts(sanecpp::host_mode::off)
   , mStartupTimeSeconds(0)
+  , mIgnoredScannersInUse(false)
   , mDoRun(true)
 {
   std::string port, interface, unixsocket, accesslog, hotplug, networkhotplug,
-     announce, webinterface, resetoption, discloseversion, localonly, optionsfile,
+     announce, webinterface, resetoption, adminpages, discloseversion, localonly, optionsfile,
      ignorelist, accessfile, randompaths, compatiblepath, debug, announcesecure,
-     reloaddelay, jobtimeout, purgeinterval, announcebaseurl;
+     reloaddelay, reloadmaxdelay, jobtimeout, purgeinterval, announcebaseurl,
+     networkhotplugignore, networkhotplugignoretypes, probethreads, probetimeout,
+     probehangtimeout, proberetries,
+     cachefile, discoveryinterval, discoverytimeout, sanebackends, configreload,
+     deviceidletimeout, sanehosts, readstalltimeout, readfirstdatatimeout,
+     readminthroughput,
+     readstallforceclose, polladfsensors;
   struct
   {
     const std::string name, def, info;
@@ -138,19 +266,41 @@ Server::Server(int argc, char** argv)
     { "unix-socket", "", "listen on named unix socket", unixsocket },
     { "access-log", "", "HTTP access log, - for stdout", accesslog },
     { "hotplug", "true", "repeat scanner search on hotplug event", hotplug },
-    { "reload-delay", "1", "how long a hotplug reload is delayed (seconds)", reloaddelay },
-    { "network-hotplug", "true", "restart server on network change", networkhotplug },
+    { "reload-delay", "1", "how long a hotplug reload is delayed after the last hotplug event (seconds)", reloaddelay },
+    { "reload-max-delay", "10", "maximum delay of a hotplug reload during a burst of events (seconds)", reloadmaxdelay },
+    { "network-hotplug", "true", "update listening sockets on network change", networkhotplug },
+    { "network-hotplug-ignore", "",
+      "ignore network changes on interfaces matching these patterns", networkhotplugignore },
+    { "network-hotplug-ignore-types", "",
+      "ignore network changes on interfaces of these types (loopback, pointopoint, virtual)", networkhotplugignoretypes },
+    { "config-reload", "true", "apply changes to options, access and ignore files while running", configreload },
+    { "probe-threads", "4", "number of scanners initialized in parallel", probethreads },
+    { "probe-timeout", "20", "time to wait for scanner initialization before publishing others (seconds)", probetimeout },
+    { "probe-hang-timeout", "120", "abandon a scanner initialization that takes longer (seconds)", probehangtimeout },
+    { "probe-retries", "2", "how often a failed scanner initialization is retried", proberetries },
+    { "cache-file", "/var/cache/airsane/capabilities", "scanner capability cache, empty to disable", cachefile },
+    { "network-discovery-interval", "300", "repeat discovery of network scanners (seconds, 0 to disable)", discoveryinterval },
+    { "network-discovery-timeout", "60", "maximum time spent in network discovery (seconds)", discoverytimeout },
     { "mdns-announce", "true", "announce scanners via mDNS", announce },
     { "announce-secure", "false", "announce secure connection", announcesecure },
     { "announce-base-url", "", "optional base url, overrides listen-port and announce-secure options", announcebaseurl },
     { "web-interface", "true", "enable web interface", webinterface },
     { "reset-option", "false", "allow server reset from web interface", resetoption },
+    { "admin-pages", "false", "serve diagnostic pages under /admin from web interface", adminpages },
     { "disclose-version", "true", "disclose version information in web interface", discloseversion },
     { "random-paths", "false", "prepend a random uuid to scanner paths", randompaths },
     { "compatible-path", "true", "use /eSCL as path for first scanner", compatiblepath },
+    { "sane-backends", "", "SANE backends to load, empty for all", sanebackends },
+    { "sane-hosts", "off", "run SANE backends in separate processes (off, backend, device)", sanehosts },
     { "local-scanners-only", "false", "ignore SANE network scanners", localonly },
     { "job-timeout", "120", "timeout for idle jobs (seconds)", jobtimeout },
     { "purge-interval", "5", "how often job lists are purged (seconds)", purgeinterval },
+    { "device-idle-timeout", "30", "keep devices open between jobs (seconds, 0 to close after each job)", deviceidletimeout },
+    { "read-stall-timeout", "60", "abort a scan when the device delivers no more data for this time (seconds, 0 to disable)", readstalltimeout },
+    { "read-first-data-timeout", "300", "abort a scan when the device delivers no data at all for this time (seconds, 0 to disable)", readfirstdatatimeout },
+    { "read-min-throughput", "0", "abort a scan when the device delivers fewer bytes per second (0 to disable)", readminthroughput },
+    { "read-stall-force-close", "true", "terminate the SANE host of a stalled device that does not respond to cancel", readstallforceclose },
+    { "poll-adf-sensors", "true", "read ADF sensors of idle devices kept open, at the purge interval", polladfsensors },
     { "options-file",
 #ifdef __FreeBSD__
       "/usr/local/etc/airsane/options.conf",
@@ -208,12 +358,30 @@ Server::Server(int argc, char** argv)
 
   mHotplug = (hotplug == "true");
   mNetworkhotplug = (networkhotplug == "true");
+  mConfigreload = (configreload == "true");
+  mNetworkhotplugIgnore = splitList(networkhotplugignore);
+  mNetworkhotplugIgnoreTypes = splitList(networkhotplugignoretypes);
+  mInterface = interface;
+  mCachefile = cachefile;
+  mSaneBackends = splitList(sanebackends);
+  if (!sanecpp::parse_host_mode(sanehosts, mSaneHosts)) {
+    std::cerr << "invalid sane-hosts mode: " << sanehosts << std::endl;
+    mDoRun = false;
+  }
+#ifdef __linux__
+  mExecutable = "/proc/self/exe";
+#else
+  mExecutable = argv[0];
+#endif
   mAnnounce = (announce == "true");
   mAnnouncesecure = (announcesecure == "true");
   mWebinterface = (webinterface == "true");
   mResetoption = (resetoption == "true");
+  mAdminpages = (adminpages == "true");
   mRandompaths = (randompaths == "true");
   mCompatiblepath = (compatiblepath == "true");
+  mReadStallForceClose = (readstallforceclose == "true");
+  mPollAdfSensors = (polladfsensors == "true");
   mDiscloseversion = (discloseversion == "true");
   mLocalonly = (localonly == "true");
   mOptionsfile = optionsfile;
@@ -266,6 +434,38 @@ Server::Server(int argc, char** argv)
     std::cerr << "invalid reload delay: " << mReloadDelay << std::endl;
     mDoRun = false;
   }
+  if (!(std::istringstream(reloadmaxdelay) >> mReloadMaxDelay) || mReloadMaxDelay < 0) {
+    std::cerr << "invalid reload max delay: " << mReloadMaxDelay << std::endl;
+    mDoRun = false;
+  } else if (mReloadMaxDelay < mReloadDelay) {
+    std::cerr << "reload max delay " << mReloadMaxDelay
+              << " is less than reload delay, using " << mReloadDelay << std::endl;
+    mReloadMaxDelay = mReloadDelay;
+  }
+  if (!(std::istringstream(probethreads) >> mProbeThreads) || mProbeThreads < 1) {
+    std::cerr << "invalid number of probe threads: " << mProbeThreads << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(probetimeout) >> mProbeTimeout) || mProbeTimeout < 1) {
+    std::cerr << "invalid probe timeout: " << mProbeTimeout << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(probehangtimeout) >> mProbeHangTimeout) || mProbeHangTimeout < 1) {
+    std::cerr << "invalid probe hang timeout: " << mProbeHangTimeout << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(proberetries) >> mProbeRetries) || mProbeRetries < 0) {
+    std::cerr << "invalid number of probe retries: " << mProbeRetries << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(discoveryinterval) >> mDiscoveryInterval) || mDiscoveryInterval < 0) {
+    std::cerr << "invalid network discovery interval: " << mDiscoveryInterval << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(discoverytimeout) >> mDiscoveryTimeout) || mDiscoveryTimeout < 1) {
+    std::cerr << "invalid network discovery timeout: " << mDiscoveryTimeout << std::endl;
+    mDoRun = false;
+  }
   if (!(std::istringstream(jobtimeout) >> mJobtimeout) || mJobtimeout < 1) {
     std::cerr << "invalid job timeout: " << mJobtimeout << std::endl;
     mDoRun = false;
@@ -274,6 +474,22 @@ Server::Server(int argc, char** argv)
     std::cerr << "invalid purge interval: " << mPurgeinterval << std::endl;
     mDoRun = false;
   }
+  if (!(std::istringstream(deviceidletimeout) >> mDeviceIdleTimeout) || mDeviceIdleTimeout < 0) {
+    std::cerr << "invalid device idle timeout: " << mDeviceIdleTimeout << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(readstalltimeout) >> mReadStallTimeout) || mReadStallTimeout < 0) {
+    std::cerr << "invalid read stall timeout: " << mReadStallTimeout << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(readfirstdatatimeout) >> mReadFirstDataTimeout) || mReadFirstDataTimeout < 0) {
+    std::cerr << "invalid read first data timeout: " << mReadFirstDataTimeout << std::endl;
+    mDoRun = false;
+  }
+  if (!(std::istringstream(readminthroughput) >> mReadMinThroughput) || mReadMinThroughput < 0) {
+    std::cerr << "invalid read min throughput: " << mReadMinThroughput << std::endl;
+    mDoRun = false;
+  }
   if (mJobtimeout <= mPurgeinterval) {
     std::cerr << "job timeout must be greater than purge interval" << std::endl;
   }
@@ -310,16 +526,37 @@ Server::run()
   if (!mDoRun)
     return false;
 
+  std::shared_ptr<Reloader> pReloader;
   std::shared_ptr<Notifier> pNotifier;
-  if (mHotplug)
-    pNotifier = std::make_shared<Notifier>(*this, mReloadDelay);
+  if (mHotplug) {
+    pReloader = std::make_shared<Reloader>(*this, mReloadDelay, mReloadMaxDelay);
+    pNotifier = std::make_shared<Notifier>(*pReloader);
+  }
 
+  std::shared_ptr<ListenerUpdater> pListenerUpdater;
   std::shared_ptr<NetworkNotifier> pNetworkNotifier;
-  if (mNetworkhotplug)
-    pNetworkNotifier = std::make_shared<NetworkNotifier>(*this, mReloadDelay);
+  // Network changes only matter to listeners on IP addresses. When listening
+  // on a named interface, the notifier filters out all other interfaces.
+  if (mNetworkhotplug && unixSocket().empty()) {
+    pListenerUpdater = std::make_shared<ListenerUpdater>(
+      *this, mInterface, mReloadDelay, mReloadMaxDelay);
+    pNetworkNotifier = std::make_shared<NetworkNotifier>(*pListenerUpdater);
+    pNetworkNotifier->setInterface(mInterface);
+    pNetworkNotifier->setIgnoredInterfaces(mNetworkhotplugIgnore);
+    pNetworkNotifier->setIgnoredInterfaceTypes(mNetworkhotplugIgnoreTypes);
+  }
 
   bool ok = false, done = false;
   do {
+    if (pReloader)
+      pReloader->beginProcessing();
+    if (pListenerUpdater)
+      pListenerUpdater->beginProcessing();
+    if (!mInterface.empty())
+      setInterfaceName(mInterface); // interface index may have changed
+
+    auto pStartupProfile = std::make_shared<StartupProfile>();
+    auto configBegin = StartupProfile::Clock::now();
     if (unixSocket().empty()) {
       AccessFile accessfile(mAccessfile);
       if (!accessfile.errors().empty()) {
@@ -329,84 +566,78 @@ Server::run()
       HttpServer::applyAccessFile(accessfile);
     }
 
-    struct timespec t = { 0 };
-    ::clock_gettime(CLOCK_MONOTONIC, &t);
-    float t0 = 1.0 * t.tv_sec + 1e-9 * t.tv_nsec;
-    std::clog << "start time is " << std::fixed << std::setprecision(2) << t0 << std::endl;
-
-    OptionsFile optionsfile(mOptionsfile);
-    std::clog << "enumerating " << (mLocalonly ? "local " : " ") << "devices..."
-              << std::endl;
+    auto pOptionsfile = std::make_shared<const OptionsFile>(mOptionsfile);
     std::string pathPrefix = "/";
     if (mRandompaths)
       pathPrefix += Uuid::Random().toString() + "/";
+    std::shared_ptr<CapabilityCache> pCapabilityCache;
+    if (!mCachefile.empty())
+      pCapabilityCache = std::make_shared<CapabilityCache>(mCachefile);
+    {
+      std::lock_guard<std::mutex> lock(mConfigMutex);
+      mpOptionsfile = pOptionsfile;
+      mOptionsReloaded = false;
+      mpIgnorelist = std::make_shared<const IgnoreList>(mIgnorelist);
+      mIgnoredDevices.clear();
+      mPathPrefix = pathPrefix;
+      mpCapabilityCache = pCapabilityCache;
+      mpStartupProfile = pStartupProfile;
+    }
+    pStartupProfile->addPhase("read_config", configBegin, StartupProfile::Clock::now());
 
-    sanecpp::init saneinit; // init/deinit after every iteration of the do/while loop
-
-    auto scanners = sanecpp::enumerate_devices(mLocalonly);
-    int scannerCount = 0;
-    for (const auto& s : scanners) {
-      std::clog << "found: " << s.name << " (" << s.vendor << " " << s.model
-                << ")" << std::endl;
-      if (matchIgnorelist(s)) {
-        std::clog << "ignoring " << s.name << std::endl;
-        continue;
-      }
-      auto pScanner = std::make_shared<Scanner>(s);
-      std::clog << "stable unique name: " << pScanner->stableUniqueName()
+    // A SANE call abandoned in a previous iteration keeps SANE initialized,
+    // so backends cannot be reloaded. Requests still finishing on
+    // connection threads may hold devices for a moment.
+    for (int i = 0; i < 50 && sanecpp::initialized(); ++i)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (sanecpp::initialized()) {
+      std::string warning = "SANE is still in use by a call that did not "
+                            "return, not reloading backends and host settings";
+      std::cerr << "error: " << warning << "; restart airsaned to reload them"
                 << std::endl;
-      std::clog << "uuid: " << pScanner->uuid() << std::endl;
-
-      chooseUniquePublishedName(pScanner.get());
-
-      if (!pScanner->initWithOptions(optionsfile)) {
-        std::clog << "error: " << pScanner->error() << std::endl;
-      }
-      else {
-        if (scannerCount++ == 0 && mCompatiblepath)
-            pScanner->setUri("/eSCL");
-        else
-            pScanner->setUri(pathPrefix + pScanner->uuid());
-        std::ostringstream url;
-        url << "http";
-        if (mAnnouncesecure)
-          url << "s";
-        url << "://" << mHostname << ":" << port() << mBasePath
-            << pScanner->uri();
-        if (mWebinterface)
-          pScanner->setAdminUrl(url.str());
-        if (!pScanner->iconFile().empty()) {
-          url << "/ScannerIcon";
-          pScanner->setIconUrl(url.str());
-        }
-
-        std::shared_ptr<MdnsPublisher::Service> pService;
-        if (mAnnounce && !pScanner->error()) {
-          pService = buildMdnsService(pScanner.get());
-          pService->setPort(port());
-          if (pService->announce()) {
-            std::clog << "published as '" << pService->name() << "'" << std::endl;
-              // may have changed due to collision
-            pScanner->setPublishedName(pService->name());
-          } else
-            pService.reset();
-          }
-          if (pService && !pScanner->error())
-            mScanners.push_back(ScannerEntry({ pScanner, pService }));
-      }
+      pStartupProfile->addWarning(warning);
+    } else {
+      sanecpp::set_host_mode(mSaneHosts, mExecutable);
+      sanecpp::set_backends(saneBackends(*pOptionsfile));
     }
+    setSaneConcurrency(*pOptionsfile);
+    auto saneInitBegin = StartupProfile::Clock::now();
+    sanecpp::init saneinit; // init/deinit after every iteration of the do/while loop
+    pStartupProfile->addPhase("sane_init", saneInitBegin, StartupProfile::Clock::now());
 
-    ::clock_gettime(CLOCK_MONOTONIC, &t);
-    float t1 = 1.0 * t.tv_sec + 1e-9 * t.tv_nsec;
-    std::clog << "end time is " << t1 << std::endl;
-    mStartupTimeSeconds = t1 - t0;
-    std::clog << "startup took " << mStartupTimeSeconds << " secconds" << std::endl;
+    std::shared_ptr<ConfigReloader> pConfigReloader;
+    std::shared_ptr<ConfigWatcher> pConfigWatcher;
+    if (mConfigreload) {
+      pConfigReloader = std::make_shared<ConfigReloader>(*this, mReloadDelay, mReloadMaxDelay);
+      pConfigWatcher = std::make_shared<ConfigWatcher>(*pConfigReloader);
+      pConfigWatcher->watch(mOptionsfile);
+      pConfigWatcher->watch(mIgnorelist);
+      if (unixSocket().empty())
+        pConfigWatcher->watch(mAccessfile);
+    }
 
+    // Scanners are discovered while the server is already listening,
+    // and become available one by one.
+    mRegistry.beginEnumeration();
+    std::promise<void> serverDone;
+    std::shared_future<void> serverDoneFuture = serverDone.get_future();
+    std::thread discoveryThread([&]() {
+      discoverScanners(pOptionsfile, pathPrefix, pNotifier.get(), serverDoneFuture);
+    });
     {
-      PurgeThread purgethread(mScanners, mPurgeinterval, mJobtimeout);
+      PurgeThread purgethread([this]() { return scanners(); },
+                              mPurgeinterval, mJobtimeout, [this]() {
+                                if (mIgnoredScannersInUse)
+                                  removeIgnoredScanners(false);
+                              });
       ok = HttpServer::run();
     }
-    mScanners.clear();
+    pConfigWatcher.reset();
+    pConfigReloader.reset();
+    serverDone.set_value();
+    discoveryThread.join();
+    mRegistry.beginEnumeration(); // clears the registry
+    mRegistry.endEnumeration();
     if (ok && terminationStatus() == SIGHUP) {
       std::clog << "received SIGHUP, reloading" << std::endl;
     } else if (ok && terminationStatus() == SIGTERM) {
@@ -427,6 +658,549 @@ Server::run()
   return ok;
 }
 
+void
+Server::discoverScanners(const std::shared_ptr<const OptionsFile>& pOptionsfile,
+                         const std::string& pathPrefix,
+                         HotplugNotifier* pNotifier,
+                         std::shared_future<void> serverDone)
+{
+  const OptionsFile& optionsfile = *pOptionsfile;
+  struct timespec t = { 0 };
+  ::clock_gettime(CLOCK_MONOTONIC, &t);
+  float t0 = 1.0 * t.tv_sec + 1e-9 * t.tv_nsec;
+  std::clog << "start time is " << std::fixed << std::setprecision(2) << t0 << std::endl;
+
+  std::clog << "enumerating " << (mLocalonly ? "local " : " ") << "devices..."
+            << std::endl;
+  StartupProfile* pProfile = mpStartupProfile.get();
+  std::vector<sanecpp::device_info> devices;
+  {
+    StartupProfile::Phase phase(pProfile, "sane_get_devices");
+    devices = sanecpp::enumerate_devices(mLocalonly);
+  }
+  ::clock_gettime(CLOCK_MONOTONIC, &t);
+  std::clog << "enumeration took " << 1.0 * t.tv_sec + 1e-9 * t.tv_nsec - t0
+            << " seconds";
+  auto backends = saneBackends(optionsfile);
+  if (!backends.empty()) {
+    int systemCount = sanecpp::system_backend_count();
+    std::clog << ", loading " << backends.size() << " backend(s)";
+    if (systemCount >= 0)
+      std::clog << ", skipping "
+                << std::max<int>(systemCount - backends.size(), 0)
+                << " of " << systemCount << " configured backend(s)";
+  }
+  std::clog << std::endl;
+  std::vector<std::shared_ptr<Scanner>> candidates;
+  for (const auto& s : devices) {
+    std::clog << "found: " << s.name << " (" << s.vendor << " " << s.model
+              << ")" << std::endl;
+    if (matchIgnorelist(s)) {
+      std::clog << "ignoring " << s.name << std::endl;
+      rememberIgnored(s);
+      continue;
+    }
+    // Stable unique names depend on construction order, so scanners
+    // are constructed here rather than on probe threads.
+    auto pScanner = std::make_shared<Scanner>(s);
+    std::clog << "stable unique name: " << pScanner->stableUniqueName()
+              << std::endl;
+    std::clog << "uuid: " << pScanner->uuid() << std::endl;
+    pScanner->setUri(pathPrefix + pScanner->uuid());
+    mRegistry.addPending(pScanner);
+    candidates.push_back(pScanner);
+  }
+
+  if (pNotifier) {
+    std::vector<std::string> names;
+    for (const auto& pScanner : candidates)
+      names.push_back(pScanner->saneName());
+    pNotifier->setKnownDevices(names);
+    pNotifier->setAllowList(optionsfile.globalOptionList("hotplug-allow"));
+    pNotifier->setDenyList(optionsfile.globalOptionList("hotplug-deny"));
+  }
+
+  std::vector<std::shared_ptr<Scanner>> cached, uncached;
+  auto cacheBegin = StartupProfile::Clock::now();
+  for (const auto& pScanner : candidates) {
+    pScanner->setCapabilityCache(mpCapabilityCache);
+    pScanner->setStartupProfile(mpStartupProfile);
+    if (pScanner->initFromCache(optionsfile)) {
+      std::clog << pScanner->stableUniqueName()
+                << ": initialized from capability cache" << std::endl;
+      cached.push_back(pScanner);
+    }
+    else
+      uncached.push_back(pScanner);
+  }
+  if (pProfile)
+    pProfile->addPhase("cache_lookup", cacheBegin, StartupProfile::Clock::now());
+
+  auto onInitialized = [this, pathPrefix](const std::shared_ptr<Scanner>& pScanner) {
+    if (pScanner->error())
+      mRegistry.removePending(pScanner.get());
+    else
+      publishScanner(pScanner, pathPrefix);
+  };
+
+  mCompatiblepathTaken = false;
+  auto probeBegin = StartupProfile::Clock::now();
+  auto pProbePool = std::make_shared<ProbePool>(uncached, pOptionsfile,
+    mProbeThreads, mProbeHangTimeout, mProbeRetries);
+  for (const auto& pScanner : cached)
+    publishScanner(pScanner, pathPrefix);
+  auto deadline = ProbePool::Clock::now() + std::chrono::seconds(mProbeTimeout);
+  for (const auto& pScanner : pProbePool->waitForResults(deadline, onInitialized))
+    onInitialized(pScanner);
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    mpProbePool = pProbePool;
+  }
+  mRegistry.endEnumeration();
+  if (pProfile) {
+    pProfile->addPhase("probe", probeBegin, StartupProfile::Clock::now());
+    pProfile->finish();
+    pProfile->writeLog(std::clog);
+  }
+
+  ::clock_gettime(CLOCK_MONOTONIC, &t);
+  float t1 = 1.0 * t.tv_sec + 1e-9 * t.tv_nsec;
+  std::clog << "end time is " << t1 << std::endl;
+  mStartupTimeSeconds = t1 - t0;
+  std::clog << "startup took " << mStartupTimeSeconds << " secconds" << std::endl;
+
+  // Keep the probe pool alive for late results until the server is done.
+  if (mLocalonly || mDiscoveryInterval < 1) {
+    serverDone.wait();
+  } else {
+    // A discovery thread is detached, so that a network enumeration that
+    // never returns does not hold up reload or shutdown for longer than
+    // the discovery timeout. Until it returns, SANE cannot be reloaded.
+    struct Discovery
+    {
+      std::mutex mutex;
+      std::condition_variable condition;
+      bool done = false;
+      DeviceLists lists;
+      ProbePool::Clock::time_point deadline;
+    };
+    std::shared_ptr<Discovery> pDiscovery;
+    std::set<std::string> networkDevices;
+    auto interval = std::chrono::seconds(mDiscoveryInterval);
+    bool serverRunning = true;
+    while (serverDone.wait_for(interval) == std::future_status::timeout) {
+      if (pDiscovery) {
+        std::clog << "network discovery is still running" << std::endl;
+      } else {
+        pDiscovery = std::make_shared<Discovery>();
+        pDiscovery->deadline =
+          ProbePool::Clock::now() + std::chrono::seconds(mDiscoveryTimeout);
+        auto pSlot = pDiscovery;
+        std::thread([pSlot]() {
+          sanecpp::init saneinit; // the thread may outlive the server loop
+          // Devices found without network discovery are local devices.
+          DeviceLists lists;
+          lists.first = sanecpp::enumerate_devices(false);
+          lists.second = sanecpp::enumerate_devices(true);
+          std::lock_guard<std::mutex> lock(pSlot->mutex);
+          pSlot->lists.swap(lists);
+          pSlot->done = true;
+          pSlot->condition.notify_all();
+        }).detach();
+      }
+      auto timeout = pDiscovery->deadline;
+      bool done = false;
+      while (serverRunning && !done && ProbePool::Clock::now() < timeout) {
+        serverRunning = serverDone.wait_for(std::chrono::seconds(1))
+                        == std::future_status::timeout;
+        std::lock_guard<std::mutex> lock(pDiscovery->mutex);
+        done = pDiscovery->done;
+      }
+      if (!serverRunning)
+        break;
+      if (!done) {
+        std::clog << "network discovery did not finish within "
+                  << mDiscoveryTimeout << " seconds" << std::endl;
+        continue;
+      }
+      DeviceLists lists;
+      {
+        std::lock_guard<std::mutex> lock(pDiscovery->mutex);
+        lists.swap(pDiscovery->lists);
+      }
+      pDiscovery.reset();
+      updateNetworkScanners(lists, networkDevices);
+    }
+    // SANE is re-initialized once the server loop is done, which requires
+    // a running discovery to have finished.
+    if (pDiscovery) {
+      std::unique_lock<std::mutex> lock(pDiscovery->mutex);
+      if (!pDiscovery->done) {
+        std::clog << "waiting for network discovery to finish" << std::endl;
+        auto pSlot = pDiscovery;
+        if (!pDiscovery->condition.wait_until(lock, pDiscovery->deadline,
+                                              [pSlot]() { return pSlot->done; }))
+          std::cerr << "network discovery did not finish within "
+                    << mDiscoveryTimeout << " seconds" << std::endl;
+      }
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    mpProbePool.reset();
+  }
+  pProbePool->discardLateResults();
+}
+
+void
+Server::updateNetworkScanners(const DeviceLists& lists,
+                              std::set<std::string>& networkDevices)
+{
+  std::set<std::string> local, found;
+  for (const auto& device : lists.second)
+    local.insert(device.name);
+
+  std::set<std::string> known;
+  for (const auto& entry : mRegistry.scanners())
+    known.insert(entry.pScanner->saneName());
+  for (const auto& pScanner : mRegistry.pendingScanners())
+    known.insert(pScanner->saneName());
+
+  for (const auto& device : lists.first) {
+    if (local.find(device.name) != local.end())
+      continue;
+    found.insert(device.name);
+    if (known.find(device.name) != known.end())
+      continue;
+    if (matchIgnorelist(device)) {
+      rememberIgnored(device);
+      continue;
+    }
+    std::clog << "network discovery found: " << device.name << " ("
+              << device.vendor << " " << device.model << ")" << std::endl;
+    addScanner(device);
+  }
+
+  for (const auto& entry : mRegistry.scanners()) {
+    const auto& name = entry.pScanner->saneName();
+    if (found.find(name) != found.end() || local.find(name) != local.end())
+      continue;
+    // Only remove devices that were previously seen by network discovery,
+    // and that are not in use.
+    if (networkDevices.find(name) == networkDevices.end())
+      continue;
+    if (entry.pScanner->isOpen()) {
+      found.insert(name);
+      continue;
+    }
+    std::clog << "network discovery lost: " << name << std::endl;
+    mRegistry.remove(entry.pScanner.get());
+  }
+  networkDevices = found;
+}
+
+bool
+Server::addScanner(const sanecpp::device_info& device)
+{
+  std::string pathPrefix;
+  std::shared_ptr<CapabilityCache> pCapabilityCache;
+  std::shared_ptr<ProbePool> pProbePool;
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    pathPrefix = mPathPrefix;
+    pCapabilityCache = mpCapabilityCache;
+    pProbePool = mpProbePool;
+  }
+  auto pScanner = std::make_shared<Scanner>(device);
+  pScanner->setUri(pathPrefix + pScanner->uuid());
+  pScanner->setCapabilityCache(pCapabilityCache);
+  mRegistry.addPending(pScanner);
+  auto pOptionsfile = currentOptions();
+  if (pScanner->initFromCache(*pOptionsfile)) {
+    publishScanner(pScanner, pathPrefix);
+    return true;
+  }
+  // The probe pool applies its timeout and retries, and publishes the
+  // scanner once initialized.
+  if (pProbePool) {
+    pProbePool->add(pScanner);
+    return true;
+  }
+  if (!pScanner->initWithOptions(*pOptionsfile)) {
+    std::clog << "error: " << pScanner->error() << std::endl;
+    mRegistry.removePending(pScanner.get());
+    return false;
+  }
+  publishScanner(pScanner, pathPrefix);
+  return true;
+}
+
+void
+Server::reloadConfigFile(const std::string& path)
+{
+  if (path == mAccessfile)
+    reloadAccessFile();
+  if (path == mOptionsfile)
+    reloadOptionsFile();
+  if (path == mIgnorelist)
+    reloadIgnorelist();
+}
+
+void
+Server::reloadAccessFile()
+{
+  AccessFile accessfile(mAccessfile);
+  if (!accessfile.errors().empty()) {
+    std::cerr << "errors in accessfile:\n" << accessfile.errors()
+              << " keeping previous access rules" << std::endl;
+    return;
+  }
+  HttpServer::applyAccessFile(accessfile);
+  std::clog << "applied access rules from " << mAccessfile << std::endl;
+}
+
+void
+Server::reloadOptionsFile()
+{
+  auto pOptionsfile = std::make_shared<const OptionsFile>(mOptionsfile);
+  auto pPrevious = currentOptions();
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    mpOptionsfile = pOptionsfile;
+    mOptionsReloaded = true;
+  }
+  if (pOptionsfile->serverOptions() != pPrevious->serverOptions()) {
+    // Backends and hotplug filters are set up for all scanners at once.
+    std::clog << "server options changed, reloading configuration" << std::endl;
+    terminate(SIGHUP);
+    return;
+  }
+  for (const auto& entry : mRegistry.scanners()) {
+    if (!entry.pScanner->updateOptions(*pOptionsfile))
+      continue;
+    std::clog << entry.pScanner->stableUniqueName()
+              << ": updated device options" << std::endl;
+    // Only metadata is affected, so the TXT record is updated in place.
+    updateIconUrl(entry.pScanner.get());
+    if (entry.pService) {
+      setMdnsTxt(entry.pService.get(), entry.pScanner.get());
+      entry.pService->updateTxt();
+    }
+  }
+}
+
+void
+Server::reloadIgnorelist()
+{
+  auto pIgnorelist = std::make_shared<const IgnoreList>(mIgnorelist);
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    mpIgnorelist = pIgnorelist;
+  }
+  removeIgnoredScanners(true);
+  // Pending scanners are checked when published.
+  std::vector<sanecpp::device_info> ignored;
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    ignored = mIgnoredDevices;
+  }
+  for (const auto& info : ignored) {
+    if (matchIgnorelist(info))
+      continue;
+    {
+      std::lock_guard<std::mutex> lock(mConfigMutex);
+      auto i = std::find_if(mIgnoredDevices.begin(), mIgnoredDevices.end(),
+        [&info](const sanecpp::device_info& d) { return d.name == info.name; });
+      if (i != mIgnoredDevices.end())
+        mIgnoredDevices.erase(i);
+    }
+    std::clog << "no longer ignoring " << info.name << std::endl;
+    addScanner(info);
+  }
+}
+
+void
+Server::removeIgnoredScanners(bool reportInUse)
+{
+  bool inUse = false;
+  for (const auto& entry : mRegistry.scanners()) {
+    const auto& info = entry.pScanner->deviceInfo();
+    if (!matchIgnorelist(info))
+      continue;
+    if (entry.pScanner->isOpen()) {
+      if (reportInUse)
+        std::clog << info.name << " is in use, ignoring it when idle" << std::endl;
+      inUse = true;
+      continue;
+    }
+    std::clog << "ignoring " << info.name << std::endl;
+    mRegistry.remove(entry.pScanner.get());
+    rememberIgnored(info);
+  }
+  mIgnoredScannersInUse = inUse;
+}
+
+std::shared_ptr<const OptionsFile>
+Server::currentOptions() const
+{
+  std::lock_guard<std::mutex> lock(mConfigMutex);
+  return mpOptionsfile;
+}
+
+void
+Server::rememberIgnored(const sanecpp::device_info& info)
+{
+  std::lock_guard<std::mutex> lock(mConfigMutex);
+  for (const auto& device : mIgnoredDevices)
+    if (device.name == info.name)
+      return;
+  mIgnoredDevices.push_back(info);
+}
+
+void
+Server::publishScanner(const std::shared_ptr<Scanner>& pScanner,
+                       const std::string& pathPrefix)
+{
+  // The ignore list or options file may have changed while the scanner
+  // was initialized.
+  if (matchIgnorelist(pScanner->deviceInfo())) {
+    std::clog << "ignoring " << pScanner->saneName() << std::endl;
+    rememberIgnored(pScanner->deviceInfo());
+    mRegistry.removePending(pScanner.get());
+    return;
+  }
+  std::shared_ptr<const OptionsFile> pReloaded;
+  std::shared_ptr<StartupProfile> pProfile;
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    if (mOptionsReloaded)
+      pReloaded = mpOptionsfile;
+    pProfile = mpStartupProfile;
+  }
+  StartupProfile::Phase phase(pProfile.get(), "publish", pScanner->saneName());
+  if (pReloaded)
+    pScanner->updateOptions(*pReloaded);
+  pScanner->setIdleTimeoutSeconds(mDeviceIdleTimeout);
+  Scanner::ReadWatchdog watchdog;
+  watchdog.stallSeconds = mReadStallTimeout;
+  watchdog.firstDataSeconds = mReadFirstDataTimeout;
+  watchdog.minBytesPerSecond = mReadMinThroughput;
+  watchdog.forceClose = mReadStallForceClose;
+  pScanner->setReadWatchdog(watchdog);
+  pScanner->setPollAdfSensors(mPollAdfSensors);
+
+  std::lock_guard<std::mutex> lock(mPublishMutex);
+  chooseUniquePublishedName(pScanner.get());
+  if (!mCompatiblepathTaken && mCompatiblepath) {
+    pScanner->setUri("/eSCL");
+    mCompatiblepathTaken = true;
+  }
+  else
+    pScanner->setUri(pathPrefix + pScanner->uuid());
+  if (mWebinterface)
+    pScanner->setAdminUrl(scannerUrl(pScanner.get()));
+  updateIconUrl(pScanner.get());
+
+  std::shared_ptr<MdnsPublisher::Service> pService;
+  if (mAnnounce && !pScanner->error()) {
+    pService = buildMdnsService(pScanner.get());
+    pService->setPort(port());
+  }
+  if (pService && !pScanner->error()) {
+    // Announcement is asynchronous, so the scanner is reachable before
+    // mDNS probing has finished.
+    mRegistry.addReady(ScannerEntry({ pScanner, pService }));
+    if (pService->announce())
+      std::clog << "announcing as '" << pService->name() << "'" << std::endl;
+    else
+      mRegistry.remove(pScanner.get());
+  }
+  else
+    mRegistry.removePending(pScanner.get());
+}
+
+std::string
+Server::scannerUrl(const Scanner* pScanner) const
+{
+  std::ostringstream url;
+  url << "http";
+  if (mAnnouncesecure)
+    url << "s";
+  url << "://" << mHostname << ":" << port() << mBasePath
+      << pScanner->uri();
+  return url.str();
+}
+
+void
+Server::updateIconUrl(Scanner* pScanner) const
+{
+  if (pScanner->iconFile().empty())
+    pScanner->setIconUrl("");
+  else
+    pScanner->setIconUrl(scannerUrl(pScanner) + "/ScannerIcon");
+}
+
+ScannerList
+Server::scanners() const
+{
+  return mRegistry.scanners();
+}
+
+std::vector<std::string>
+Server::saneBackends(const OptionsFile& optionsfile) const
+{
+  // options.conf takes precedence over the command line
+  auto backends = optionsfile.globalOptionList("sane-backends");
+  if (backends.empty())
+    backends = mSaneBackends;
+  return backends;
+}
+
+void
+Server::setSaneConcurrency(const OptionsFile& optionsfile) const
+{
+  // Backends that talk to each device over its own network connection,
+  // and keep no shared state, may serve several devices in parallel.
+  static const char* parallelBackends[] = { "escl", "airscan" };
+  sanecpp::clear_concurrency();
+  for (auto backend : parallelBackends)
+    sanecpp::set_concurrency(backend, sanecpp::concurrency::parallel);
+  for (const auto& entry : optionsfile.globalOptionList("sane-concurrency")) {
+    size_t pos = entry.rfind(':');
+    sanecpp::concurrency level;
+    if (pos == std::string::npos || pos == 0
+        || !sanecpp::parse_concurrency(entry.substr(pos + 1), level)) {
+      std::cerr << "invalid sane-concurrency entry: " << entry << std::endl;
+      continue;
+    }
+    std::string backend = entry.substr(0, pos);
+    sanecpp::set_concurrency(backend, level);
+    std::clog << "SANE backend " << backend << ": "
+              << sanecpp::concurrency_name(level) << " concurrency" << std::endl;
+  }
+}
+
+bool
+Server::scannerNotReady(const std::string& uri) const
+{
+  // While enumerating, any unknown URI may belong to a scanner
+  // that is yet to be found.
+  if (mRegistry.enumerating())
+    return true;
+  auto pending = mRegistry.pendingScanners();
+  if (pending.empty())
+    return false;
+  if (mCompatiblepath && uri.find(mBasePath + "/eSCL") == 0) {
+    std::lock_guard<std::mutex> lock(mPublishMutex);
+    if (!mCompatiblepathTaken)
+      return true;
+  }
+  for (const auto& pScanner : pending)
+    if (uri.find(mBasePath + pScanner->uri()) == 0)
+      return true;
+  return false;
+}
+
 void
 Server::chooseUniquePublishedName(Scanner* pScanner) const
 {
@@ -441,8 +1215,8 @@ Server::chooseUniquePublishedName(Scanner* pScanner) const
 bool
 Server::publishedNameExists(const std::string& name) const
 {
-  for (const auto& entry : mScanners)
-    if (entry.pScanner->publishedName() == name)
+  for (const auto& entry : mRegistry.scanners())
+    if (entry.publishedName() == name)
       return true;
   return false;
 }
@@ -450,22 +1224,12 @@ Server::publishedNameExists(const std::string& name) const
 bool
 Server::matchIgnorelist(const sanecpp::device_info& info) const
 {
-  std::ifstream file(mIgnorelist);
-  std::string line;
-  while (std::getline(file, line)) {
-    if (line.find('#') == 0)
-      continue;
-    if (line.find("//") == 0)
-      continue;
-    if (line.find(' ') == 0)
-      continue;
-    if (std::regex_match(info.name, std::regex(line))) {
-      std::clog << mIgnorelist << ": regex '" << line << "'"
-                << " matches device name '" << info.name << "'" << std::endl;
-      return true;
-    }
+  std::shared_ptr<const IgnoreList> pIgnorelist;
+  {
+    std::lock_guard<std::mutex> lock(mConfigMutex);
+    pIgnorelist = mpIgnorelist;
   }
-  return false;
+  return pIgnorelist && pIgnorelist->matches(info.name);
 }
 
 std::shared_ptr<MdnsPublisher::Service>
@@ -478,6 +1242,13 @@ Server::buildMdnsService(const Scanner* pScanner)
   pService->setType(type);
   pService->setName(pScanner->publishedName());
   pService->setInterfaceIndex(interfaceIndex());
+  setMdnsTxt(pService.get(), pScanner);
+  return pService;
+}
+
+void
+Server::setMdnsTxt(MdnsPublisher::Service* pService, const Scanner* pScanner) const
+{
   pService->setTxt("txtvers", "1");
   pService->setTxt("vers", "2.0");
   std::string s;
@@ -513,8 +1284,8 @@ Server::buildMdnsService(const Scanner* pScanner)
     pService->setTxt("adminurl", pScanner->adminUrl());
   if (!pScanner->iconUrl().empty())
     pService->setTxt("representation", pScanner->iconUrl());
-
-  return pService;
+  else
+    pService->removeTxt("representation");
 }
 
 void
@@ -524,14 +1295,56 @@ Server::onRequest(const Request& request, Response& response)
       if (request.uri() == mBasePath + "/") {
         response.setStatus(HttpServer::HTTP_OK);
         response.setHeader(HttpServer::HTTP_HEADER_CONTENT_TYPE, "text/html");
-        MainPage(mScanners, mResetoption, mDiscloseversion)
+        ScannerList scanners = this->scanners();
+        MainPage(scanners, mResetoption, mDiscloseversion)
+          .setPendingCount(mRegistry.pendingScanners().size(), mRegistry.enumerating())
           .setTitle("AirSane Server on " + mPublisher.hostname())
           .render(request, response);
-      } else if (request.uri() == "/reset" && mResetoption) {
+      } else if (request.uri() == mBasePath + "/admin/startup" && mAdminpages) {
+        std::shared_ptr<StartupProfile> pProfile;
+        {
+          std::lock_guard<std::mutex> lock(mConfigMutex);
+          pProfile = mpStartupProfile;
+        }
+        if (pProfile) {
+          response.setStatus(HttpServer::HTTP_OK);
+          response.setHeader(HttpServer::HTTP_HEADER_CONTENT_TYPE, "application/json");
+          pProfile->writeJson(response.send());
+          return;
+        }
+      } else if (request.uri() == mBasePath + "/admin/devices" && mAdminpages) {
+        response.setStatus(HttpServer::HTTP_OK);
+        response.setHeader(HttpServer::HTTP_HEADER_CONTENT_TYPE, "application/json");
+        std::ostream& os = response.send();
+        os << "[";
+        const char* sep = "\n";
+        for (const auto& entry : scanners()) {
+          auto stats = entry.pScanner->openStats();
+          auto stalls = entry.pScanner->stallStats();
+          os << sep << " {\"name\":\"" << jsonEscape(entry.pScanner->saneName())
+             << "\",\"uri\":\"" << jsonEscape(entry.pScanner->uri())
+             << "\",\"inUse\":" << (entry.pScanner->isOpen() ? "true" : "false")
+             << ",\"keptOpen\":" << (stats.deviceOpen ? "true" : "false")
+             << ",\"opens\":" << stats.opens
+             << ",\"reuses\":" << stats.reuses
+             << ",\"failures\":" << stats.failures
+             << ",\"lastOpenSeconds\":" << stats.lastSeconds
+             << ",\"maxOpenSeconds\":" << stats.maxSeconds
+             << ",\"totalOpenSeconds\":" << stats.totalSeconds
+             << ",\"stalls\":" << stalls.stalls
+             << ",\"stallsForceClosed\":" << stalls.forcedCloses
+             << ",\"stallsAbandoned\":" << stalls.abandoned
+             << ",\"lastStall\":\"" << jsonEscape(stalls.lastReason)
+             << "\",\"lastStallTime\":" << stalls.lastTime << "}";
+          sep = ",\n";
+        }
+        os << "\n]\n";
+        return;
+      } else if (request.uri() == mBasePath + "/reset" && mResetoption) {
         response.setStatus(HttpServer::HTTP_OK);
         response.setHeader(HttpServer::HTTP_HEADER_CONTENT_TYPE, "text/html");
         std::ostringstream oss;
-        oss << ::ceil(mStartupTimeSeconds) + 1 << "; url=/";
+        oss << ::ceil(mStartupTimeSeconds) + 1 << "; url=" << mBasePath << "/";
         response.setHeader(HttpServer::HTTP_HEADER_REFRESH, oss.str());
         struct : WebPage
         {
@@ -549,13 +1362,19 @@ Server::onRequest(const Request& request, Response& response)
         this->terminate(SIGHUP);
       }
   }
-  for (auto entry : mScanners) {// copy of entry is intended to protect scanner object
+  for (auto entry : scanners()) {// copy of entry is intended to protect scanner object
     if (request.uri().find(mBasePath + entry.pScanner->uri()) == 0) {
       std::string remainder = request.uri().substr((mBasePath + entry.pScanner->uri()).length());
       handleScannerRequest(entry, remainder, request, response);
       return;
     }
   }
+  if (!response.sent() && scannerNotReady(request.uri())) {
+    response.setStatus(HttpServer::HTTP_SERVICE_UNAVAILABLE);
+    response.setHeader(HttpServer::HTTP_HEADER_RETRY_AFTER, 5);
+    response.send();
+    return;
+  }
   HttpServer::onRequest(request, response);
 }
 
@@ -566,7 +1385,7 @@ Server::handleScannerRequest(ScannerList::value_type entry, const std::string& p
     response.setStatus(HttpServer::HTTP_OK);
     response.setHeader(HttpServer::HTTP_HEADER_CONTENT_TYPE, "text/html");
     ScannerPage(*entry.pScanner.get())
-      .setTitle(entry.pScanner->publishedName() + " on " + mPublisher.hostname())
+      .setTitle(entry.publishedName() + " on " + mPublisher.hostname())
       .render(request, response);
     return;
   }
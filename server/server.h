@@ -19,20 +19,25 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef SERVER_H
 #define SERVER_H
 
+#include "devicerules.h"
 #include "scanner.h"
+#include "scannerregistry.h"
+#include "sanecpp/host.h"
 #include "web/httpserver.h"
 #include "zeroconf/mdnspublisher.h"
+#include <atomic>
 #include <fstream>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <tuple>
 #include <vector>
 
-struct ScannerEntry
-{
-  std::shared_ptr<Scanner> pScanner;
-  std::shared_ptr<MdnsPublisher::Service> pService;
-};
-typedef std::vector<ScannerEntry> ScannerList;
+class HotplugNotifier;
+class CapabilityCache;
+class ProbePool;
+class StartupProfile;
 
 class Server : public HttpServer
 {
@@ -40,15 +45,43 @@ public:
   Server(int argc, char** argv);
   ~Server();
   bool run();
+  // Applies changes to options, access, or ignore file without reloading
+  // all scanners.
+  void reloadConfigFile(const std::string& path);
 
 protected:
   void onRequest(const Request&, Response&) override;
 
 private:
+  void discoverScanners(const std::shared_ptr<const OptionsFile>&,
+                        const std::string& pathPrefix,
+                        HotplugNotifier*,
+                        std::shared_future<void> serverDone);
+  // all devices, and local devices only
+  typedef std::pair<std::vector<sanecpp::device_info>,
+                    std::vector<sanecpp::device_info>> DeviceLists;
+  void updateNetworkScanners(const DeviceLists&,
+                             std::set<std::string>& networkDevices);
+  bool addScanner(const sanecpp::device_info&);
+  void reloadAccessFile();
+  void reloadOptionsFile();
+  void reloadIgnorelist();
+  // Removes scanners that match the ignore list, unless they are in use.
+  void removeIgnoredScanners(bool reportInUse);
+  std::shared_ptr<const OptionsFile> currentOptions() const;
+  void rememberIgnored(const sanecpp::device_info&);
+  void publishScanner(const std::shared_ptr<Scanner>&, const std::string& pathPrefix);
+  ScannerList scanners() const;
+  bool scannerNotReady(const std::string& uri) const;
+  std::vector<std::string> saneBackends(const OptionsFile&) const;
+  void setSaneConcurrency(const OptionsFile&) const;
   void chooseUniquePublishedName(Scanner*) const;
   bool publishedNameExists(const std::string&) const;
   bool matchIgnorelist(const sanecpp::device_info&) const;
   std::shared_ptr<MdnsPublisher::Service> buildMdnsService(const Scanner*);
+  void setMdnsTxt(MdnsPublisher::Service*, const Scanner*) const;
+  std::string scannerUrl(const Scanner*) const;
+  void updateIconUrl(Scanner*) const;
   // must pass ScannerList element by value to achieve protection during
   // request
   void handleScannerRequest(ScannerList::value_type,
@@ -57,13 +90,38 @@ private:
                             HttpServer::Response&);
 
   MdnsPublisher mPublisher;
-  ScannerList mScanners;
+  ScannerRegistry mRegistry;
+  mutable std::mutex mPublishMutex;
+  bool mCompatiblepathTaken;
+  // Set for each iteration of the server loop, the options file may be
+  // replaced when changed.
+  mutable std::mutex mConfigMutex;
+  std::shared_ptr<const OptionsFile> mpOptionsfile;
+  std::shared_ptr<const IgnoreList> mpIgnorelist;
+  bool mOptionsReloaded;
+  std::vector<sanecpp::device_info> mIgnoredDevices;
+  std::string mPathPrefix;
+  std::shared_ptr<CapabilityCache> mpCapabilityCache;
+  std::shared_ptr<StartupProfile> mpStartupProfile;
+  // Initializes scanners found after startup.
+  std::shared_ptr<ProbePool> mpProbePool;
   std::filebuf mLogfile;
-  bool mAnnounce, mWebinterface, mResetoption, mDiscloseversion,
-    mLocalonly, mHotplug, mNetworkhotplug, mRandompaths, mCompatiblepath, mAnnouncesecure;
+  bool mAnnounce, mWebinterface, mResetoption, mAdminpages, mDiscloseversion,
+    mLocalonly, mHotplug, mNetworkhotplug, mConfigreload, mRandompaths, mCompatiblepath, mAnnouncesecure;
   std::string mOptionsfile, mAccessfile, mIgnorelist, mHostname, mBasePath;
-  int mReloadDelay, mJobtimeout, mPurgeinterval;
-  float mStartupTimeSeconds;
+  std::string mInterface, mCachefile, mExecutable;
+  std::vector<std::string> mNetworkhotplugIgnore, mNetworkhotplugIgnoreTypes,
+    mSaneBackends;
+  int mReloadDelay, mReloadMaxDelay, mProbeThreads, mProbeTimeout,
+    mProbeHangTimeout, mProbeRetries,
+    mDiscoveryInterval, mDiscoveryTimeout, mJobtimeout, mPurgeinterval,
+    mDeviceIdleTimeout, mReadStallTimeout, mReadFirstDataTimeout,
+    mReadMinThroughput;
+  bool mReadStallForceClose, mPollAdfSensors;
+  sanecpp::host_mode mSaneHosts;
+  std::atomic<float> mStartupTimeSeconds;
+  // Scanners that are ignored, but in use, are removed when idle.
+  std::atomic<bool> mIgnoredScannersInUse;
   bool mDoRun;
 };
 
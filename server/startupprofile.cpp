@@ -0,0 +1,170 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "startupprofile.h"
+#include "basic/json.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <locale>
+#include <sstream>
+
+StartupProfile::Phase::Phase(StartupProfile* pProfile,
+                             const std::string& name,
+                             const std::string& device)
+  : mpProfile(pProfile)
+  , mName(name)
+  , mDevice(device)
+  , mBegin(Clock::now())
+{}
+
+StartupProfile::Phase::~Phase()
+{
+  if (mpProfile)
+    mpProfile->addPhase(mName, mBegin, Clock::now(), mDevice);
+}
+
+StartupProfile::StartupProfile()
+  : mBegin(Clock::now())
+  , mTotal(0)
+  , mFinished(false)
+{}
+
+double
+StartupProfile::seconds(Clock::time_point t) const
+{
+  return std::chrono::duration<double>(t - mBegin).count();
+}
+
+void
+StartupProfile::addPhase(const std::string& name,
+                         Clock::time_point begin,
+                         Clock::time_point end,
+                         const std::string& device)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  Timing timing = { name, seconds(begin), seconds(end) - seconds(begin) };
+  if (device.empty()) {
+    mPhases.push_back(timing);
+    return;
+  }
+  auto i = std::find_if(mDevices.begin(), mDevices.end(),
+    [&device](const std::pair<std::string, Device>& d) { return d.first == device; });
+  if (i == mDevices.end()) {
+    mDevices.push_back(std::make_pair(device, Device()));
+    i = mDevices.end() - 1;
+  }
+  i->second.phases.push_back(timing);
+}
+
+void
+StartupProfile::addCount(const std::string& device,
+                         const std::string& name,
+                         unsigned long count)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  auto i = std::find_if(mDevices.begin(), mDevices.end(),
+    [&device](const std::pair<std::string, Device>& d) { return d.first == device; });
+  if (i == mDevices.end()) {
+    mDevices.push_back(std::make_pair(device, Device()));
+    i = mDevices.end() - 1;
+  }
+  i->second.counts[name] += count;
+}
+
+void
+StartupProfile::addWarning(const std::string& warning)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mWarnings.push_back(warning);
+}
+
+void
+StartupProfile::finish()
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mTotal = seconds(Clock::now());
+  mFinished = true;
+}
+
+void
+StartupProfile::writeJson(std::ostream& os) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  std::ostringstream oss;
+  oss.imbue(std::locale("C"));
+  oss << std::fixed << std::setprecision(3);
+  auto writePhases = [&oss](const std::vector<Timing>& phases, const char* indent) {
+    oss << "[";
+    for (size_t i = 0; i < phases.size(); ++i)
+      oss << (i ? "," : "") << "\n" << indent << "{ \"name\": \""
+          << jsonEscape(phases[i].name) << "\", \"start\": " << phases[i].start
+          << ", \"duration\": " << phases[i].duration << " }";
+    oss << "]";
+  };
+  oss << "{\n  \"finished\": " << (mFinished ? "true" : "false") << ",\n";
+  oss << "  \"total\": " << (mFinished ? mTotal : seconds(Clock::now())) << ",\n";
+  oss << "  \"warnings\": [";
+  for (size_t i = 0; i < mWarnings.size(); ++i)
+    oss << (i ? "," : "") << "\n    \"" << jsonEscape(mWarnings[i]) << "\"";
+  oss << "],\n";
+  oss << "  \"phases\": ";
+  writePhases(mPhases, "    ");
+  oss << ",\n  \"devices\": [";
+  for (size_t i = 0; i < mDevices.size(); ++i) {
+    const auto& device = mDevices[i];
+    oss << (i ? "," : "") << "\n    {\n      \"name\": \""
+        << jsonEscape(device.first) << "\",\n      \"phases\": ";
+    writePhases(device.second.phases, "        ");
+    oss << ",\n      \"counts\": {";
+    bool first = true;
+    for (const auto& count : device.second.counts) {
+      oss << (first ? " " : ", ") << "\"" << jsonEscape(count.first)
+          << "\": " << count.second;
+      first = false;
+    }
+    oss << " }\n    }";
+  }
+  oss << "]\n}\n";
+  os << oss.str();
+}
+
+void
+StartupProfile::writeLog(std::ostream& os) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  std::ostringstream oss;
+  oss << std::fixed << std::setprecision(3);
+  oss << "startup profile (seconds):\n";
+  for (const auto& warning : mWarnings)
+    oss << "  warning: " << warning << "\n";
+  for (const auto& phase : mPhases)
+    oss << "  " << phase.name << ": " << phase.duration
+        << " (at " << phase.start << ")\n";
+  for (const auto& device : mDevices) {
+    oss << "  " << device.first << ":\n";
+    for (const auto& phase : device.second.phases)
+      oss << "    " << phase.name << ": " << phase.duration
+          << " (at " << phase.start << ")\n";
+    for (const auto& count : device.second.counts)
+      oss << "    " << count.first << ": " << count.second << "\n";
+  }
+  if (mFinished)
+    oss << "  total: " << mTotal << "\n";
+  os << oss.str() << std::flush;
+}
@@ -0,0 +1,93 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STARTUP_PROFILE_H
+#define STARTUP_PROFILE_H
+
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Collects timings of startup phases, overall and per device, and
+// counters per device. All functions are thread-safe.
+class StartupProfile
+{
+  StartupProfile(const StartupProfile&) = delete;
+  StartupProfile& operator=(const StartupProfile&) = delete;
+
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  StartupProfile();
+
+  // Measures a phase from construction to destruction. A null profile
+  // is allowed, and ignored.
+  class Phase
+  {
+    Phase(const Phase&) = delete;
+    Phase& operator=(const Phase&) = delete;
+
+  public:
+    Phase(StartupProfile*, const std::string& name, const std::string& device = "");
+    ~Phase();
+
+  private:
+    StartupProfile* mpProfile;
+    std::string mName, mDevice;
+    Clock::time_point mBegin;
+  };
+
+  void addPhase(const std::string& name,
+                Clock::time_point begin,
+                Clock::time_point end,
+                const std::string& device = "");
+  void addCount(const std::string& device, const std::string& name, unsigned long);
+  void addWarning(const std::string&);
+  // Marks the end of startup.
+  void finish();
+
+  void writeJson(std::ostream&) const;
+  void writeLog(std::ostream&) const;
+
+private:
+  struct Timing
+  {
+    std::string name;
+    double start, duration;
+  };
+  struct Device
+  {
+    std::vector<Timing> phases;
+    std::map<std::string, unsigned long> counts;
+  };
+
+  double seconds(Clock::time_point) const;
+
+  mutable std::mutex mMutex;
+  Clock::time_point mBegin;
+  double mTotal;
+  bool mFinished;
+  std::vector<Timing> mPhases;
+  std::vector<std::string> mWarnings;
+  std::vector<std::pair<std::string, Device>> mDevices;
+};
+
+#endif // STARTUP_PROFILE_H
@@ -18,7 +18,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "httpserver.h"
 
+#include <algorithm>
 #include <atomic>
+#include <climits>
 #include <cstring>
 #include <ctime>
 #include <sstream>
@@ -58,6 +60,7 @@ const char* HttpServer::HTTP_HEADER_CONNECTION = "connection";
 const char* HttpServer::HTTP_HEADER_TRANSFER_ENCODING = "transfer-encoding";
 const char* HttpServer::HTTP_HEADER_CONTENT_DISPOSITION = "content-disposition";
 const char* HttpServer::HTTP_HEADER_REFRESH = "refresh";
+const char* HttpServer::HTTP_HEADER_RETRY_AFTER = "retry-after";
 
 const char* HttpServer::MIME_TYPE_JPEG = "image/jpeg";
 const char* HttpServer::MIME_TYPE_PDF = "application/pdf";
@@ -129,6 +132,30 @@ describeAddress(const HttpServer::Sockaddr& address)
   return oss.str();
 }
 
+// Written into the internal pipe instead of a termination status.
+const int updateListenersMessage = INT_MIN;
+// Addresses that cannot be bound yet, e.g. tentative IPv6 addresses during
+// duplicate address detection, are retried with increasing delay.
+const int minListenRetryMs = 500, maxListenRetryMs = 30000;
+
+// Compares addresses, ignoring port numbers.
+bool
+sameAddress(const HttpServer::Sockaddr& a, const HttpServer::Sockaddr& b)
+{
+  if (a.sa.sa_family != b.sa.sa_family)
+    return false;
+  switch (a.sa.sa_family) {
+    case AF_INET:
+      return !::memcmp(&a.in.sin_addr, &b.in.sin_addr, sizeof(a.in.sin_addr));
+    case AF_INET6:
+      return !::memcmp(&a.in6.sin6_addr, &b.in6.sin6_addr, sizeof(a.in6.sin6_addr))
+             && a.in6.sin6_scope_id == b.in6.sin6_scope_id;
+    case AF_UNIX:
+      return !::strcmp(a.un.sun_path, b.un.sun_path);
+  }
+  return false;
+}
+
 std::vector<HttpServer::Sockaddr>
 interfaceAddresses(const char* if_name)
 {
@@ -285,6 +312,77 @@ struct HttpServer::Private
     return sockfd;
   }
 
+  // Sets unavailable if an address could not be bound yet.
+  int openListeners(std::vector<Sockaddr>& addresses,
+                    std::vector<struct pollfd>& pfds,
+                    std::vector<Sockaddr>& listening,
+                    bool& unavailable)
+  {
+    int err = 0;
+    unavailable = false;
+    for (auto& address : addresses) {
+      int sockfd = createListeningSocket(address);
+      if (sockfd < 0) {
+        if (errno == EADDRNOTAVAIL) { // may occur due to race condition at network reconfiguration
+          std::clog << "cannot listen on " << describeAddress(address)
+                    << " yet" << std::endl;
+          unavailable = true;
+        } else
+          err = errno;
+      } else {
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        pfds.push_back(pfd);
+        listening.push_back(address);
+        std::clog << "listening on " << describeAddress(address)
+                  << std::endl;
+      }
+    }
+    return err;
+  }
+
+  // Closes listening sockets for addresses that are gone, and opens sockets
+  // for new addresses. Accepted connections are not affected. Returns true
+  // if an address could not be bound yet.
+  bool updateListeners(std::vector<struct pollfd>& pfds,
+                       std::vector<Sockaddr>& listening)
+  {
+    std::vector<Sockaddr> addresses;
+    int err = determineAddresses(addresses);
+    if (err && err != EINVAL) {
+      std::cerr << "could not update listening sockets: "
+                << ::strerror(err) << std::endl;
+      return false;
+    }
+    for (size_t i = 0; i < listening.size();) {
+      bool found = false;
+      for (const auto& address : addresses)
+        found = found || sameAddress(address, listening[i]);
+      if (found) {
+        ++i;
+      } else {
+        std::clog << "no longer listening on "
+                  << describeAddress(listening[i]) << std::endl;
+        ::close(pfds[i + 1].fd);
+        pfds.erase(pfds.begin() + i + 1);
+        listening.erase(listening.begin() + i);
+      }
+    }
+    std::vector<Sockaddr> added;
+    for (const auto& address : addresses) {
+      bool found = false;
+      for (const auto& l : listening)
+        found = found || sameAddress(address, l);
+      if (!found)
+        added.push_back(address);
+    }
+    bool unavailable = false;
+    err = openListeners(added, pfds, listening, unavailable);
+    if (err)
+      std::cerr << "could not open listening socket: "
+                << ::strerror(err) << std::endl;
+    return unavailable;
+  }
+
   bool run()
   {
     bool wasRunning = false;
@@ -310,27 +408,31 @@ struct HttpServer::Private
       std::vector<struct pollfd> pfds(1);
       pfds[0].fd = pipeReadFd;
       pfds[0].events = POLLIN;
-      for (auto& address : addresses) {
-        int sockfd = createListeningSocket(address);
-        if (sockfd < 0 && errno != EADDRNOTAVAIL) // may occur due to race condition at network reconfiguration
-          err = errno;
-        else {
-          struct pollfd pfd = { sockfd, POLLIN, 0 };
-          pfds.push_back(pfd);
-          std::clog << "listening on " << describeAddress(address)
-                    << std::endl;
-        }
-      }
+      // listening[i] is the address of pfds[i + 1]
+      std::vector<Sockaddr> listening;
+      bool unavailable = false;
+      err = openListeners(addresses, pfds, listening, unavailable);
+      // No retry is pending while negative.
+      int retryMs = unavailable ? minListenRetryMs : -1;
       bool done = (err != 0);
       while (!done) {
-        int r = ::poll(pfds.data(), pfds.size(), -1);
-        if (r > 0 && pfds[0].revents) {
-          done = true;
+        int r = ::poll(pfds.data(), pfds.size(), retryMs);
+        if (r == 0) {
+          if (updateListeners(pfds, listening))
+            retryMs = std::min(2 * retryMs, maxListenRetryMs);
+          else
+            retryMs = -1;
+        } else if (r > 0 && pfds[0].revents) {
           int value;
           if (::read(pipeReadFd, &value, sizeof(value)) != sizeof(value)) {
+            done = true;
             err = errno ? errno : EBADMSG;
             std::cerr << "error reading from internal pipe" << std::endl;
+          } else if (value == updateListenersMessage) {
+            bool unavailable = updateListeners(pfds, listening);
+            retryMs = unavailable ? minListenRetryMs : -1;
           } else {
+            done = true;
             mTerminationStatus = value;
           }
         } else if (r > 0) {
@@ -374,6 +476,14 @@ struct HttpServer::Private
            sizeof(mTerminationStatus);
   }
 
+  bool updateListeners()
+  {
+    if (!mRunning)
+      return true;
+    int message = updateListenersMessage;
+    return ::write(mPipeWriteFd, &message, sizeof(message)) == sizeof(message);
+  }
+
   void handleRequest(int fd, Sockaddr address)
   {
     std::unique_lock<std::mutex> lock(mAccessFileMutex);
@@ -583,6 +693,12 @@ HttpServer::terminate(int status)
   return p->terminate(status);
 }
 
+bool
+HttpServer::updateListeners()
+{
+  return p->updateListeners();
+}
+
 int
 HttpServer::terminationStatus() const
 {
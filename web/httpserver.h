@@ -50,7 +50,7 @@ public:
     *HTTP_HEADER_LOCATION, *HTTP_HEADER_ACCEPT, *HTTP_HEADER_USER_AGENT,
     *HTTP_HEADER_REFERER, *HTTP_HEADER_TRANSFER_ENCODING,
     *HTTP_HEADER_CONNECTION, *HTTP_HEADER_CONTENT_DISPOSITION,
-    *HTTP_HEADER_REFRESH;
+    *HTTP_HEADER_REFRESH, *HTTP_HEADER_RETRY_AFTER;
 
   static const char *MIME_TYPE_JPEG, *MIME_TYPE_PDF, *MIME_TYPE_PNG;
   static std::string fileExtension(const std::string& mimeType);
@@ -92,6 +92,9 @@ public:
 
   bool run();
   bool terminate(int status);
+  // Makes a running server listen on the current set of interface addresses,
+  // without interrupting connections.
+  bool updateListeners();
   int terminationStatus() const;
   int lastError() const;
 
@@ -20,6 +20,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <atomic>
 #include <csignal>
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <sstream>
 #ifdef __FreeBSD__
 #include <libusb.h>
 #else
@@ -28,15 +34,87 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <pthread.h>
 #include <thread>
 
+namespace {
+
+struct UsbId
+{
+  int vendor, product; // -1 matches any
+
+  bool parse(const std::string& s)
+  {
+    size_t pos = s.find(':');
+    if (pos == std::string::npos)
+      return false;
+    return parsePart(s.substr(0, pos), vendor) &&
+           parsePart(s.substr(pos + 1), product);
+  }
+
+  bool matches(uint16_t v, uint16_t p) const
+  {
+    return (vendor < 0 || vendor == v) && (product < 0 || product == p);
+  }
+
+  static bool parsePart(const std::string& s, int& value)
+  {
+    if (s == "*") {
+      value = -1;
+      return true;
+    }
+    char* end = nullptr;
+    long l = ::strtol(s.c_str(), &end, 16);
+    if (s.empty() || *end || l < 0 || l > 0xffff)
+      return false;
+    value = l;
+    return true;
+  }
+};
+
+std::vector<UsbId>
+parseUsbIds(const std::vector<std::string>& list)
+{
+  std::vector<UsbId> ids;
+  for (const auto& entry : list) {
+    UsbId id;
+    if (id.parse(entry))
+      ids.push_back(id);
+    else
+      std::cerr << "invalid usb vendor:product id: " << entry << std::endl;
+  }
+  return ids;
+}
+
+bool
+isImagingClass(uint8_t c)
+{
+  return c == LIBUSB_CLASS_IMAGE || c == LIBUSB_CLASS_VENDOR_SPEC;
+}
+
+std::string
+describeUsbId(uint16_t vendor, uint16_t product)
+{
+  std::ostringstream oss;
+  oss << std::hex << std::setfill('0') << std::setw(4) << vendor << ":"
+      << std::setw(4) << product;
+  return oss.str();
+}
+
+} // namespace
+
 struct HotplugNotifier::Private
 {
+  HotplugNotifier* mpNotifier;
   libusb_context* mpContext;
   std::thread mThread;
   ::libusb_hotplug_callback_handle mCbHandle;
   std::atomic<bool> mTerminate;
 
+  std::mutex mFilterMutex;
+  std::set<uint32_t> mKnownIds;
+  std::vector<UsbId> mAllowList, mDenyList;
+
   Private(HotplugNotifier* pNotifier)
-    : mpContext(nullptr)
+    : mpNotifier(pNotifier)
+    , mpContext(nullptr)
     , mCbHandle(0)
     , mTerminate(false)
   {
@@ -50,7 +128,7 @@ struct HotplugNotifier::Private
                                        LIBUSB_HOTPLUG_MATCH_ANY,
                                        LIBUSB_HOTPLUG_MATCH_ANY,
                                        &Private::hotplugCallback,
-                                       pNotifier,
+                                       this,
                                        &mCbHandle);
     mThread = std::thread([this]() { hotplugThread(); });
   }
@@ -80,8 +158,85 @@ struct HotplugNotifier::Private
     }
   }
 
+  void setKnownDevices(const std::vector<std::string>& saneNames)
+  {
+    std::set<std::pair<int, int>> locations;
+    for (const auto& name : saneNames) {
+      size_t pos = name.find("libusb:");
+      int bus = 0, address = 0;
+      if (pos != std::string::npos &&
+          ::sscanf(name.c_str() + pos, "libusb:%d:%d", &bus, &address) == 2)
+        locations.insert(std::make_pair(bus, address));
+    }
+    std::set<uint32_t> ids;
+    libusb_device** pList = nullptr;
+    ssize_t count = ::libusb_get_device_list(mpContext, &pList);
+    for (ssize_t i = 0; i < count; ++i) {
+      auto location = std::make_pair(int(::libusb_get_bus_number(pList[i])),
+                                     int(::libusb_get_device_address(pList[i])));
+      libusb_device_descriptor desc;
+      if (locations.find(location) != locations.end() &&
+          ::libusb_get_device_descriptor(pList[i], &desc) == 0) {
+        std::clog << "usb id of known scanner: "
+                  << describeUsbId(desc.idVendor, desc.idProduct) << std::endl;
+        ids.insert(desc.idVendor << 16 | desc.idProduct);
+      }
+    }
+    if (pList)
+      ::libusb_free_device_list(pList, 1);
+    std::lock_guard<std::mutex> lock(mFilterMutex);
+    mKnownIds = ids;
+  }
+
+  bool hasImagingInterface(libusb_device* pDevice)
+  {
+    libusb_config_descriptor* pConfig = nullptr;
+    if (::libusb_get_active_config_descriptor(pDevice, &pConfig) != 0 &&
+        ::libusb_get_config_descriptor(pDevice, 0, &pConfig) != 0)
+      return true; // cannot tell, so we must assume it is a scanner
+    bool found = false;
+    for (int i = 0; !found && i < pConfig->bNumInterfaces; ++i) {
+      const libusb_interface& interface = pConfig->interface[i];
+      for (int j = 0; !found && j < interface.num_altsetting; ++j)
+        found = isImagingClass(interface.altsetting[j].bInterfaceClass);
+    }
+    ::libusb_free_config_descriptor(pConfig);
+    return found;
+  }
+
+  bool isRelevant(libusb_device* pDevice)
+  {
+    libusb_device_descriptor desc;
+    if (::libusb_get_device_descriptor(pDevice, &desc) != 0)
+      return true;
+    std::string id = describeUsbId(desc.idVendor, desc.idProduct);
+    std::unique_lock<std::mutex> lock(mFilterMutex);
+    for (const auto& entry : mDenyList)
+      if (entry.matches(desc.idVendor, desc.idProduct)) {
+        std::clog << "usb device " << id << " is in deny list" << std::endl;
+        return false;
+      }
+    for (const auto& entry : mAllowList)
+      if (entry.matches(desc.idVendor, desc.idProduct)) {
+        std::clog << "usb device " << id << " is in allow list" << std::endl;
+        return true;
+      }
+    if (mKnownIds.find(desc.idVendor << 16 | desc.idProduct) != mKnownIds.end()) {
+      std::clog << "usb device " << id << " is a known scanner" << std::endl;
+      return true;
+    }
+    lock.unlock();
+    if (isImagingClass(desc.bDeviceClass))
+      return true;
+    if (desc.bDeviceClass == LIBUSB_CLASS_PER_INTERFACE &&
+        hasImagingInterface(pDevice))
+      return true;
+    std::clog << "usb device " << id << " is not an imaging device" << std::endl;
+    return false;
+  }
+
   static int hotplugCallback(libusb_context*,
-                             libusb_device*,
+                             libusb_device* pDevice,
                              libusb_hotplug_event libusbevent,
                              void* p)
   {
@@ -94,7 +249,11 @@ struct HotplugNotifier::Private
         event = deviceLeft;
         break;
     }
-    static_cast<HotplugNotifier*>(p)->onHotplugEvent(event);
+    auto pPrivate = static_cast<Private*>(p);
+    if (pPrivate->isRelevant(pDevice))
+      pPrivate->mpNotifier->onHotplugEvent(event);
+    else
+      std::clog << "ignoring usb hotplug event" << std::endl;
     return 0;
   }
 };
@@ -107,3 +266,25 @@ HotplugNotifier::~HotplugNotifier()
 {
   delete p;
 }
+
+void
+HotplugNotifier::setKnownDevices(const std::vector<std::string>& saneNames)
+{
+  p->setKnownDevices(saneNames);
+}
+
+void
+HotplugNotifier::setAllowList(const std::vector<std::string>& list)
+{
+  auto ids = parseUsbIds(list);
+  std::lock_guard<std::mutex> lock(p->mFilterMutex);
+  p->mAllowList = ids;
+}
+
+void
+HotplugNotifier::setDenyList(const std::vector<std::string>& list)
+{
+  auto ids = parseUsbIds(list);
+  std::lock_guard<std::mutex> lock(p->mFilterMutex);
+  p->mDenyList = ids;
+}
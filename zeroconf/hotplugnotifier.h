@@ -19,6 +19,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef HOTPLUGNOTIFIER_H
 #define HOTPLUGNOTIFIER_H
 
+#include <string>
+#include <vector>
+
 class HotplugNotifier
 {
   HotplugNotifier(const HotplugNotifier&) = delete;
@@ -28,6 +31,18 @@ public:
   HotplugNotifier();
   virtual ~HotplugNotifier();
 
+  // Events are only reported for devices that may be scanners:
+  // devices listed in the allow list, devices with a vendor/product id
+  // of a known scanner, and devices with an imaging or vendor-specific
+  // interface. Devices in the deny list are never reported.
+  // Known scanners are given as SANE device names, USB devices are
+  // identified by their "libusb:<bus>:<address>" part.
+  void setKnownDevices(const std::vector<std::string>& saneNames);
+  // List entries are vendor:product ids in hex notation, with * matching
+  // any vendor or product.
+  void setAllowList(const std::vector<std::string>&);
+  void setDenyList(const std::vector<std::string>&);
+
 protected:
   enum Event
   {
@@ -0,0 +1,120 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "interfacefilter.h"
+
+#include <iostream>
+
+#include <fnmatch.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <unistd.h>
+
+namespace {
+
+int
+interfaceFlags(const std::string& name)
+{
+  int flags = 0;
+  ifaddrs* pAddrs = nullptr;
+  if (::getifaddrs(&pAddrs) < 0)
+    return flags;
+  for (ifaddrs* p = pAddrs; p != nullptr; p = p->ifa_next) {
+    if (p->ifa_name && name == p->ifa_name) {
+      flags = p->ifa_flags;
+      break;
+    }
+  }
+  ::freeifaddrs(pAddrs);
+  return flags;
+}
+
+bool
+isVirtualInterface(const std::string& name)
+{
+#if __linux__
+  std::string path = "/sys/devices/virtual/net/" + name;
+  return ::access(path.c_str(), F_OK) == 0;
+#else
+  return false;
+#endif
+}
+
+} // namespace
+
+InterfaceFilter::InterfaceFilter()
+  : mIgnoredFlags(0)
+  , mIgnoreVirtual(false)
+{}
+
+void
+InterfaceFilter::setInterface(const std::string& s)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mInterface = (s == "*") ? "" : s;
+}
+
+void
+InterfaceFilter::setIgnoredNames(const std::vector<std::string>& patterns)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mIgnoredNames = patterns;
+}
+
+void
+InterfaceFilter::setIgnoredTypes(const std::vector<std::string>& types)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mIgnoredFlags = 0;
+  mIgnoreVirtual = false;
+  for (const auto& type : types) {
+    if (type == "loopback")
+      mIgnoredFlags |= IFF_LOOPBACK;
+    else if (type == "pointopoint")
+      mIgnoredFlags |= IFF_POINTOPOINT;
+    else if (type == "virtual")
+      mIgnoreVirtual = true;
+    else
+      std::cerr << "unknown interface type: " << type << std::endl;
+  }
+}
+
+bool
+InterfaceFilter::isRelevant(const std::string& name) const
+{
+  return reasonToIgnore(name).empty();
+}
+
+std::string
+InterfaceFilter::reasonToIgnore(const std::string& name) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (!mInterface.empty())
+    return name == mInterface ? "" : "not listening on " + name;
+  for (const auto& pattern : mIgnoredNames)
+    if (::fnmatch(pattern.c_str(), name.c_str(), 0) == 0)
+      return name + " matches " + pattern;
+  int flags = interfaceFlags(name) & mIgnoredFlags;
+  if (flags & IFF_LOOPBACK)
+    return name + " is a loopback interface";
+  if (flags & IFF_POINTOPOINT)
+    return name + " is a point-to-point interface";
+  if (mIgnoreVirtual && isVirtualInterface(name))
+    return name + " is a virtual interface";
+  return "";
+}
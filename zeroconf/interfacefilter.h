@@ -0,0 +1,54 @@
+/*
+AirSane Imaging Daemon
+Copyright (C) 2018-2023 Simul Piscator
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef INTERFACE_FILTER_H
+#define INTERFACE_FILTER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Decides whether address changes on a network interface are relevant to
+// the server, i.e. whether the server listens on the interface. If an
+// interface has been set, only that interface is listened on, and relevant.
+// Otherwise, the server listens on all interfaces, so all are relevant
+// unless the user chose to ignore them by name pattern (shell wildcards)
+// or by type ("loopback", "pointopoint", "virtual"). Nothing is ignored by
+// default.
+class InterfaceFilter
+{
+public:
+  InterfaceFilter();
+
+  void setInterface(const std::string&);
+  void setIgnoredNames(const std::vector<std::string>& patterns);
+  void setIgnoredTypes(const std::vector<std::string>& types);
+
+  bool isRelevant(const std::string& interfaceName) const;
+  // Returns a description of why an interface is ignored, or an empty string.
+  std::string reasonToIgnore(const std::string& interfaceName) const;
+
+private:
+  mutable std::mutex mMutex;
+  std::string mInterface;
+  std::vector<std::string> mIgnoredNames;
+  int mIgnoredFlags;
+  bool mIgnoreVirtual;
+};
+
+#endif // INTERFACE_FILTER_H
@@ -23,16 +23,28 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <avahi-common/alternative.h>
 #include <avahi-common/error.h>
 #include <avahi-common/malloc.h>
+#include <avahi-common/strlst.h>
 #include <avahi-common/thread-watch.h>
+#include <avahi-common/timeval.h>
 
 #include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <iostream>
 #include <list>
+#include <vector>
 
 namespace {
 
+// Services announced within this period are committed together. Each
+// service has an entry group of its own, so it can be withdrawn or renamed
+// without affecting others, but Avahi combines the probes of groups that
+// are committed together into the same packets.
+const int BatchDelayMs = 200;
+// Services that could not be registered are retried after this delay,
+// doubled after each failure.
+const int MinRetryDelayMs = 1000, MaxRetryDelayMs = 60000;
+
 class AvahiThreadedPollGuard
 {
 public:
@@ -47,135 +59,52 @@ private:
   AvahiThreadedPoll* mpThread;
 };
 
-struct ServiceEntry
+AvahiStringList*
+txtList(const MdnsPublisher::Service* pService)
 {
-  MdnsPublisher::Service* mpService;
-  AvahiEntryGroup* mpEntryGroup;
-
-  ServiceEntry(MdnsPublisher::Service* p)
-    : mpService(p)
-    , mpEntryGroup(nullptr)
-  {}
-
-  ~ServiceEntry() { unannounce(); }
-
-  bool announce(AvahiClient* pClient)
-  {
-    unannounce();
-    int err;
-    do {
-      err = doAnnounce(pClient);
-      if (err == AVAHI_ERR_COLLISION)
-        renameService();
-    } while (err == AVAHI_ERR_COLLISION);
-    if (err) {
-      std::cerr << "Avahi error when adding service: " << ::avahi_strerror(err)
-                << " (" << err << ")" << std::endl;
-    }
-    return !err;
-  }
-
-  int doAnnounce(AvahiClient* pClient)
-  {
-    if (!pClient) {
-      std::cerr << "No avahi client instance available, not registering service"
-                << std::endl;
-      return AVAHI_ERR_FAILURE;
-    }
-    if (mpEntryGroup)
-      ::avahi_entry_group_free(mpEntryGroup);
-    mpEntryGroup = ::avahi_entry_group_new(pClient, &entryGroupCallback, this);
-    if (!mpEntryGroup)
-      return ::avahi_client_errno(pClient);
-    int err = ::avahi_entry_group_add_service(mpEntryGroup,
-                                              mpService->interfaceIndex(),
-                                              AVAHI_PROTO_UNSPEC,
-                                              AvahiPublishFlags(0),
-                                              mpService->name().c_str(),
-                                              mpService->type().c_str(),
-                                              nullptr,
-                                              nullptr,
-                                              mpService->port(),
-                                              nullptr);
-    if (!err)
-      err = ::avahi_entry_group_commit(mpEntryGroup);
-    if (!err) {
-      AvahiStringList* txt = nullptr;
-      for (const auto& entry : mpService->txtRecord())
-        txt = ::avahi_string_list_add_pair(
-          txt, entry.first.c_str(), entry.second.c_str());
-      err = ::avahi_entry_group_update_service_txt_strlst(
-        mpEntryGroup,
-        mpService->interfaceIndex(),
-        AVAHI_PROTO_UNSPEC,
-        AvahiPublishFlags(0),
-        mpService->name().c_str(),
-        mpService->type().c_str(),
-        nullptr,
-        txt);
-      ::avahi_string_list_free(txt);
-    }
-    return err;
-  }
-
-  void unannounce()
-  {
-    if (mpEntryGroup) {
-      ::avahi_entry_group_free(mpEntryGroup);
-      mpEntryGroup = nullptr;
-    }
-  }
+  AvahiStringList* txt = nullptr;
+  for (const auto& entry : pService->txtRecord())
+    txt = ::avahi_string_list_add_pair(
+      txt, entry.first.c_str(), entry.second.c_str());
+  // avahi_string_list_add_pair() prepends
+  return ::avahi_string_list_reverse(txt);
+}
 
-  void renameService()
-  {
-    char* altname = ::avahi_alternative_service_name(mpService->name().c_str());
-    mpService->setName(altname);
-    ::avahi_free(altname);
-  }
+} // namespace
 
-  void onCollision()
+struct MdnsPublisher::Private
+{
+  struct Group
   {
-    renameService();
-    announce(::avahi_entry_group_get_client(mpEntryGroup));
-  }
-
-  void onError() { unannounce(); }
+    Private* p;
+    AvahiEntryGroup* mpEntryGroup;
+  };
 
-  static void entryGroupCallback(AvahiEntryGroup*,
-                                 AvahiEntryGroupState state,
-                                 void* instance)
+  struct ServiceEntry
   {
-    auto p = static_cast<ServiceEntry*>(instance);
-    switch (state) {
-      case AVAHI_ENTRY_GROUP_COLLISION:
-        p->onCollision();
-        break;
-      case AVAHI_ENTRY_GROUP_FAILURE:
-        p->onError();
-        break;
-      case AVAHI_ENTRY_GROUP_UNCOMMITED:
-      case AVAHI_ENTRY_GROUP_REGISTERING:
-      case AVAHI_ENTRY_GROUP_ESTABLISHED:
-        break;
-    }
-  }
-};
+    Service* mpService;
+    Group* mpGroup; // null while waiting to be committed
+    bool mFailed;
+  };
 
-} // namespace
-
-struct MdnsPublisher::Private
-{
   AvahiThreadedPoll* mpThread;
   AvahiClient* mpClient;
   AvahiClientState mState;
+  AvahiTimeout* mpCommitTimeout;
+  AvahiTimeout* mpRetryTimeout;
+  int mRetryDelayMs;
 
   std::string mHostnameFqdn, mHostname;
   std::list<ServiceEntry> mServices;
+  std::list<Group> mGroups;
 
   Private()
     : mpThread(nullptr)
     , mpClient(nullptr)
     , mState(AVAHI_CLIENT_CONNECTING)
+    , mpCommitTimeout(nullptr)
+    , mpRetryTimeout(nullptr)
+    , mRetryDelayMs(MinRetryDelayMs)
   {
     mpThread = ::avahi_threaded_poll_new();
     if (mpThread) {
@@ -205,7 +134,7 @@ struct MdnsPublisher::Private
         case AVAHI_CLIENT_S_COLLISION:
         case AVAHI_CLIENT_S_REGISTERING:
         case AVAHI_CLIENT_S_RUNNING:
-          p->onConnected();
+          p->onConnected(client);
           break;
         case AVAHI_CLIENT_FAILURE:
         case AVAHI_CLIENT_CONNECTING:
@@ -246,18 +175,25 @@ struct MdnsPublisher::Private
 
   void destroyClient()
   {
-    if (mpClient) {
-      for (auto& entry : mServices)
-        entry.unannounce();
+    cancelTimeout(mpCommitTimeout);
+    cancelTimeout(mpRetryTimeout);
+    while (!mGroups.empty())
+      releaseGroup(&mGroups.front());
+    if (mpClient)
       ::avahi_client_free(mpClient);
-    }
     mpClient = nullptr;
   }
 
-  void onConnected()
+  void onConnected(AvahiClient* pClient)
   {
+    // May be called from within avahi_client_new().
+    mpClient = pClient;
     for (auto& entry : mServices)
-      entry.announce(mpClient);
+      entry.mFailed = false;
+    mRetryDelayMs = MinRetryDelayMs;
+    cancelTimeout(mpCommitTimeout);
+    cancelTimeout(mpRetryTimeout);
+    commitQueued();
   }
 
   void onDisconnected()
@@ -281,6 +217,198 @@ struct MdnsPublisher::Private
                           });
     return i;
   }
+
+  AvahiTimeout* newTimeout(int delayMs, AvahiTimeoutCallback callback)
+  {
+    struct timeval tv;
+    ::avahi_elapse_time(&tv, delayMs, 0);
+    const AvahiPoll* pPoll = ::avahi_threaded_poll_get(mpThread);
+    return pPoll->timeout_new(pPoll, &tv, callback, this);
+  }
+
+  void cancelTimeout(AvahiTimeout*& pTimeout)
+  {
+    if (pTimeout) {
+      const AvahiPoll* pPoll = ::avahi_threaded_poll_get(mpThread);
+      pPoll->timeout_free(pTimeout);
+      pTimeout = nullptr;
+    }
+  }
+
+  void scheduleCommit()
+  {
+    if (mpClient && !mpCommitTimeout)
+      mpCommitTimeout = newTimeout(BatchDelayMs, &commitCallback);
+  }
+
+  static void commitCallback(AvahiTimeout*, void* instance)
+  {
+    auto p = static_cast<Private*>(instance);
+    p->cancelTimeout(p->mpCommitTimeout);
+    p->commitQueued();
+  }
+
+  void scheduleRetry()
+  {
+    if (!mpClient || mpRetryTimeout)
+      return;
+    std::clog << "retrying failed mDNS services in " << mRetryDelayMs << " ms"
+              << std::endl;
+    mpRetryTimeout = newTimeout(mRetryDelayMs, &retryCallback);
+    mRetryDelayMs = std::min(2 * mRetryDelayMs, MaxRetryDelayMs);
+  }
+
+  static void retryCallback(AvahiTimeout*, void* instance)
+  {
+    auto p = static_cast<Private*>(instance);
+    p->cancelTimeout(p->mpRetryTimeout);
+    for (auto& entry : p->mServices)
+      entry.mFailed = false;
+    p->commitQueued();
+  }
+
+  void commitQueued()
+  {
+    if (!mpClient)
+      return;
+    int count = 0;
+    bool failed = false;
+    for (auto& entry : mServices) {
+      if (entry.mpGroup || entry.mFailed)
+        continue;
+      if (commitService(&entry))
+        ++count;
+      else
+        failed = true;
+    }
+    if (count > 0)
+      std::clog << "committed " << count << " mDNS service(s)" << std::endl;
+    if (failed)
+      scheduleRetry();
+  }
+
+  bool commitService(ServiceEntry* pEntry)
+  {
+    mGroups.push_back(Group{ this, nullptr });
+    Group* pGroup = &mGroups.back();
+    pGroup->mpEntryGroup =
+      ::avahi_entry_group_new(mpClient, &entryGroupCallback, pGroup);
+    if (!pGroup->mpEntryGroup) {
+      int err = ::avahi_client_errno(mpClient);
+      std::cerr << "Avahi error when creating entry group: "
+                << ::avahi_strerror(err) << " (" << err << ")" << std::endl;
+      mGroups.pop_back();
+      pEntry->mFailed = true;
+      return false;
+    }
+    int err;
+    do {
+      err = addService(pGroup, pEntry->mpService);
+      if (err == AVAHI_ERR_COLLISION)
+        renameService(pEntry->mpService);
+    } while (err == AVAHI_ERR_COLLISION);
+    if (err)
+      std::cerr << "Avahi error when adding service: "
+                << ::avahi_strerror(err) << " (" << err << ")" << std::endl;
+    else
+      err = ::avahi_entry_group_commit(pGroup->mpEntryGroup);
+    if (err) {
+      std::cerr << "Avahi error when committing service: "
+                << ::avahi_strerror(err) << " (" << err << ")" << std::endl;
+      pEntry->mFailed = true;
+      releaseGroup(pGroup);
+      return false;
+    }
+    pEntry->mpGroup = pGroup;
+    return true;
+  }
+
+  int addService(Group* pGroup, const Service* pService)
+  {
+    AvahiStringList* txt = txtList(pService);
+    int err = ::avahi_entry_group_add_service_strlst(pGroup->mpEntryGroup,
+                                                     pService->interfaceIndex(),
+                                                     AVAHI_PROTO_UNSPEC,
+                                                     AvahiPublishFlags(0),
+                                                     pService->name().c_str(),
+                                                     pService->type().c_str(),
+                                                     nullptr,
+                                                     nullptr,
+                                                     pService->port(),
+                                                     txt);
+    ::avahi_string_list_free(txt);
+    return err;
+  }
+
+  // Withdraws the service in the group. It is committed again with the
+  // next batch, unless marked as failed.
+  void releaseGroup(Group* pGroup)
+  {
+    if (pGroup->mpEntryGroup)
+      ::avahi_entry_group_free(pGroup->mpEntryGroup);
+    for (auto& entry : mServices)
+      if (entry.mpGroup == pGroup)
+        entry.mpGroup = nullptr;
+    mGroups.remove_if([pGroup](const Group& g) { return &g == pGroup; });
+  }
+
+  static void renameService(Service* pService)
+  {
+    char* altname = ::avahi_alternative_service_name(pService->name().c_str());
+    pService->setName(altname);
+    ::avahi_free(altname);
+  }
+
+  void onCollision(Group* pGroup)
+  {
+    for (auto& entry : mServices) {
+      if (entry.mpGroup == pGroup) {
+        renameService(entry.mpService);
+        std::clog << "mDNS name collision, renamed service to '"
+                  << entry.mpService->name() << "'" << std::endl;
+      }
+    }
+    releaseGroup(pGroup);
+    commitQueued();
+  }
+
+  void onEstablished(Group*)
+  {
+    mRetryDelayMs = MinRetryDelayMs;
+  }
+
+  void onFailure(Group* pGroup)
+  {
+    int err = ::avahi_client_errno(mpClient);
+    std::cerr << "Avahi error when registering service: "
+              << ::avahi_strerror(err) << " (" << err << ")" << std::endl;
+    for (auto& entry : mServices)
+      if (entry.mpGroup == pGroup)
+        entry.mFailed = true;
+    releaseGroup(pGroup);
+    scheduleRetry();
+  }
+
+  static void entryGroupCallback(AvahiEntryGroup*,
+                                 AvahiEntryGroupState state,
+                                 void* instance)
+  {
+    auto pGroup = static_cast<Group*>(instance);
+    switch (state) {
+      case AVAHI_ENTRY_GROUP_COLLISION:
+        pGroup->p->onCollision(pGroup);
+        break;
+      case AVAHI_ENTRY_GROUP_FAILURE:
+        pGroup->p->onFailure(pGroup);
+        break;
+      case AVAHI_ENTRY_GROUP_ESTABLISHED:
+        pGroup->p->onEstablished(pGroup);
+        break;
+      case AVAHI_ENTRY_GROUP_UNCOMMITED:
+      case AVAHI_ENTRY_GROUP_REGISTERING:
+        break;
+    }
+  }
 };
 
 MdnsPublisher::MdnsPublisher()
@@ -308,15 +436,12 @@ bool
 MdnsPublisher::announce(MdnsPublisher::Service* pService)
 {
   AvahiThreadedPollGuard guard(p->mpThread);
-  bool ok = false;
   auto i = p->findService(pService);
-  if (i != p->mServices.end()) {
-    ok = true;
-  } else {
-    p->mServices.push_back(ServiceEntry(pService));
-    ok = p->mServices.back().announce(p->mpClient);
+  if (i == p->mServices.end()) {
+    p->mServices.push_back(Private::ServiceEntry{ pService, nullptr, false });
+    p->scheduleCommit();
   }
-  return ok;
+  return true;
 }
 
 bool
@@ -327,8 +452,36 @@ MdnsPublisher::unannounce(MdnsPublisher::Service* pService)
   auto i = p->findService(pService);
   if (i != p->mServices.end()) {
     ok = true;
-    i->unannounce();
+    Private::Group* pGroup = i->mpGroup;
     p->mServices.erase(i);
+    if (pGroup)
+      p->releaseGroup(pGroup);
   }
   return ok;
 }
+
+bool
+MdnsPublisher::updateTxt(MdnsPublisher::Service* pService)
+{
+  AvahiThreadedPollGuard guard(p->mpThread);
+  auto i = p->findService(pService);
+  if (i == p->mServices.end())
+    return false;
+  if (!i->mpGroup)
+    return true; // TXT record is read when committed
+  AvahiStringList* txt = txtList(pService);
+  int err = ::avahi_entry_group_update_service_txt_strlst(
+    i->mpGroup->mpEntryGroup,
+    pService->interfaceIndex(),
+    AVAHI_PROTO_UNSPEC,
+    AvahiPublishFlags(0),
+    pService->name().c_str(),
+    pService->type().c_str(),
+    nullptr,
+    txt);
+  ::avahi_string_list_free(txt);
+  if (err)
+    std::cerr << "Avahi error when updating TXT record: "
+              << ::avahi_strerror(err) << " (" << err << ")" << std::endl;
+  return !err;
+}
@@ -95,11 +95,9 @@ struct ServiceEntry
 
   ~ServiceEntry() { unannounce(); }
 
-  bool announce()
+  bool createTxtRecord(TXTRecordRef& txtRecord)
   {
-    unannounce();
     bool ok = true;
-    TXTRecordRef txtRecord;
     ::TXTRecordCreate(&txtRecord, 0, nullptr);
     for (const auto& entry : mpService->txtRecord()) {
       DNSServiceErrorType err = ::TXTRecordSetValue(&txtRecord,
@@ -113,6 +111,14 @@ struct ServiceEntry
                   << std::endl;
       }
     }
+    return ok;
+  }
+
+  bool announce()
+  {
+    unannounce();
+    TXTRecordRef txtRecord;
+    bool ok = createTxtRecord(txtRecord);
     int ifindex = mpService->interfaceIndex();
     if (ifindex < 0)
       ifindex = 0;
@@ -147,6 +153,28 @@ struct ServiceEntry
     return ok;
   }
 
+  bool updateTxt()
+  {
+    if (!mDNSServiceRef)
+      return false;
+    TXTRecordRef txtRecord;
+    bool ok = createTxtRecord(txtRecord);
+    DNSServiceErrorType err =
+      ::DNSServiceUpdateRecord(mDNSServiceRef,
+                               nullptr,
+                               0,
+                               ::TXTRecordGetLength(&txtRecord),
+                               ::TXTRecordGetBytesPtr(&txtRecord),
+                               0);
+    if (err != kDNSServiceErr_NoError) {
+      ok = false;
+      std::cerr << "Could not update txtRecord of " << mpService->name()
+                << " (" << dnssd_strerr(err) << ")" << std::endl;
+    }
+    ::TXTRecordDeallocate(&txtRecord);
+    return ok;
+  }
+
   void unannounce()
   {
     if (mDNSServiceRef) {
@@ -241,3 +269,12 @@ MdnsPublisher::unannounce(MdnsPublisher::Service* pService)
   }
   return ok;
 }
+
+bool
+MdnsPublisher::updateTxt(MdnsPublisher::Service* pService)
+{
+  auto i = p->findService(pService);
+  if (i == p->mServices.end())
+    return false;
+  return i->updateTxt();
+}
@@ -23,7 +23,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 MdnsPublisher::Service&
 MdnsPublisher::Service::setName(const std::string& s)
 {
-  std::lock_guard<std::mutex> lock(mNameMutex);
+  std::lock_guard<std::mutex> lock(mMutex);
   mName = s;
   return *this;
 }
@@ -31,13 +31,14 @@ MdnsPublisher::Service::setName(const std::string& s)
 std::string
 MdnsPublisher::Service::name() const
 {
-  std::lock_guard<std::mutex> lock(mNameMutex);
+  std::lock_guard<std::mutex> lock(mMutex);
   return mName;
 }
 
 MdnsPublisher::Service&
 MdnsPublisher::Service::setTxt(const std::string& key, const std::string& value)
 {
+  std::lock_guard<std::mutex> lock(mMutex);
   if (!key.empty()) {
     auto i = std::find_if(
       mTxtRecord.begin(),
@@ -50,3 +51,23 @@ MdnsPublisher::Service::setTxt(const std::string& key, const std::string& value)
   }
   return *this;
 }
+
+MdnsPublisher::Service&
+MdnsPublisher::Service::removeTxt(const std::string& key)
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  mTxtRecord.erase(std::remove_if(mTxtRecord.begin(),
+                                  mTxtRecord.end(),
+                                  [key](const TxtRecord::value_type& v) {
+                                    return v.first == key;
+                                  }),
+                   mTxtRecord.end());
+  return *this;
+}
+
+MdnsPublisher::Service::TxtRecord
+MdnsPublisher::Service::txtRecord() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mTxtRecord;
+}
@@ -37,8 +37,12 @@ public:
   const std::string& hostnameFqdn() const;
 
   class Service;
+  // Announcement is asynchronous. Services announced in short succession
+  // may be committed together.
   bool announce(Service*);
   bool unannounce(Service*);
+  // Publishes a changed TXT record of an announced service.
+  bool updateTxt(Service*);
 
 public:
   class Service
@@ -76,11 +80,12 @@ public:
     uint16_t port() const { return mPort; }
 
     Service& setTxt(const std::string&, const std::string&);
-    const std::string& txt(const std::string&) const;
-    const TxtRecord& txtRecord() const { return mTxtRecord; }
+    Service& removeTxt(const std::string&);
+    TxtRecord txtRecord() const;
 
     bool announce() { return mpPublisher->announce(this); }
     bool unannounce() { return mpPublisher->unannounce(this); }
+    bool updateTxt() { return mpPublisher->updateTxt(this); }
 
   private:
     MdnsPublisher* mpPublisher;
@@ -88,7 +93,8 @@ public:
     int mIfIndex;
     uint16_t mPort;
     TxtRecord mTxtRecord;
-    mutable std::mutex mNameMutex;
+    // name may change on collision, and TXT record on update
+    mutable std::mutex mMutex;
   };
 
 private:
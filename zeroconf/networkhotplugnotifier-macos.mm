@@ -17,6 +17,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "networkhotplugnotifier.h"
+#include "interfacefilter.h"
 
 #import <Foundation/Foundation.h>
 #import <SystemConfiguration/SystemConfiguration.h>
@@ -34,6 +35,7 @@ struct NetworkHotplugNotifier::Private
   NetworkHotplugNotifier* mpNotifier;
   std::atomic<CFRunLoopRef> mRunLoop{NULL};
   std::atomic<bool> mTerminate{false};
+  InterfaceFilter mFilter;
 
   Private(NetworkHotplugNotifier* pNotifier)
   : mpNotifier(pNotifier)
@@ -56,7 +58,7 @@ struct NetworkHotplugNotifier::Private
   {
     mRunLoop = ::CFRunLoopGetCurrent();
     
-    NSArray *SCMonitoringInterfacePatterns = @[@"State:/Network/Global/IPv[46]"];
+    NSArray *SCMonitoringInterfacePatterns = @[@"State:/Network/Interface/[^/]+/IPv[46]"];
     @autoreleasepool {
         SCDynamicStoreContext ctx = {0};
         ctx.info = this;
@@ -84,7 +86,28 @@ struct NetworkHotplugNotifier::Private
 #endif
 
       auto p = static_cast<Private*>(info);
-      p->mpNotifier->onHotplugEvent(addressChange);
+      bool relevant = false;
+      CFIndex count = ::CFArrayGetCount(changedKeys);
+      for (CFIndex i = 0; i < count; ++i) {
+        // Keys are of the form State:/Network/Interface/<name>/IPv4
+        CFStringRef key = (CFStringRef)::CFArrayGetValueAtIndex(changedKeys, i);
+        char buf[256] = { 0 };
+        if (!::CFStringGetCString(key, buf, sizeof(buf), kCFStringEncodingUTF8))
+          continue;
+        std::string name = buf;
+        size_t end = name.rfind('/');
+        size_t begin = name.rfind('/', end - 1);
+        if (end == std::string::npos || begin == std::string::npos)
+          continue;
+        name = name.substr(begin + 1, end - begin - 1);
+        std::string reason = p->mFilter.reasonToIgnore(name);
+        if (reason.empty())
+          relevant = true;
+        else
+          std::clog << "Ignoring address change: " << reason << std::endl;
+      }
+      if (relevant)
+        p->mpNotifier->onHotplugEvent(addressChange);
   }
 };
 
@@ -96,3 +119,21 @@ NetworkHotplugNotifier::~NetworkHotplugNotifier()
 {
   delete p;
 }
+
+void
+NetworkHotplugNotifier::setInterface(const std::string& s)
+{
+  p->mFilter.setInterface(s);
+}
+
+void
+NetworkHotplugNotifier::setIgnoredInterfaces(const std::vector<std::string>& patterns)
+{
+  p->mFilter.setIgnoredNames(patterns);
+}
+
+void
+NetworkHotplugNotifier::setIgnoredInterfaceTypes(const std::vector<std::string>& types)
+{
+  p->mFilter.setIgnoredTypes(types);
+}
@@ -17,11 +17,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include "networkhotplugnotifier.h"
+#include "interfacefilter.h"
 
 #include "web/httpserver.h"
 
 #include <iostream>
-#include <set>
+#include <map>
 #include <thread>
 
 #include <poll.h>
@@ -86,7 +87,9 @@ struct NetworkHotplugNotifier::Private
   NetworkHotplugNotifier* mpNotifier;
   int mPipeWriteFd, mPipeReadFd;
 
-  std::set<HttpServer::Sockaddr, CompareAddresses> mAddresses;
+  InterfaceFilter mFilter;
+  // Known addresses, and the interface they belong to.
+  std::map<HttpServer::Sockaddr, std::string, CompareAddresses> mAddresses;
 
   Private(NetworkHotplugNotifier* pNotifier)
   : mpNotifier(pNotifier), mPipeWriteFd(-1), mPipeReadFd(-1)
@@ -133,11 +136,53 @@ struct NetworkHotplugNotifier::Private
         }
       }
       if (address.sa.sa_family != AF_UNSPEC)
-        mAddresses.insert(address);
+        mAddresses[address] = p->ifa_name ? p->ifa_name : "";
     }
     ::freeifaddrs(pAddrs);
   }
 
+  static std::string interfaceName(unsigned int index)
+  {
+    char buf[IF_NAMESIZE] = { 0 };
+    if (::if_indextoname(index, buf))
+      return buf;
+    return "";
+  }
+
+  void onAddressArrived(const HttpServer::Sockaddr& address, unsigned int index)
+  {
+    if (mAddresses.find(address) != mAddresses.end())
+      return;
+    std::string name = interfaceName(index);
+    mAddresses[address] = name;
+    std::string reason = mFilter.reasonToIgnore(name);
+    if (!reason.empty()) {
+      std::clog << "Ignoring new IP address " << HttpServer::ipString(address)
+                << ": " << reason << std::endl;
+      return;
+    }
+    std::clog << "New IP address: " << HttpServer::ipString(address)
+              << " on " << name << std::endl;
+    mpNotifier->onHotplugEvent(addressArrived);
+  }
+
+  void onAddressLeft(const HttpServer::Sockaddr& address, unsigned int index)
+  {
+    auto i = mAddresses.find(address);
+    std::string name = (i == mAddresses.end()) ? interfaceName(index) : i->second;
+    if (i != mAddresses.end())
+      mAddresses.erase(i);
+    std::string reason = mFilter.reasonToIgnore(name);
+    if (!reason.empty()) {
+      std::clog << "Ignoring removed IP address " << HttpServer::ipString(address)
+                << ": " << reason << std::endl;
+      return;
+    }
+    std::clog << "IP address gone: " << HttpServer::ipString(address)
+              << " on " << name << std::endl;
+    mpNotifier->onHotplugEvent(addressLeft);
+  }
+
   void hotplugThread()
   {
     int sock = ::socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
@@ -197,18 +242,10 @@ struct NetworkHotplugNotifier::Private
                 RTA_NEXT(pRta, ifalen);
               }
               if (address.sa.sa_family != AF_UNSPEC) {
-                if (data.n->nlmsg_type == RTM_NEWADDR) {
-                  if (mAddresses.find(address) == mAddresses.end()) {
-                    mAddresses.insert(address);
-                    std::clog << "New IP address: " << HttpServer::ipString(address) << std::endl;
-                    mpNotifier->onHotplugEvent(addressArrived);
-                  }
-                }
-                else if(data.n->nlmsg_type == RTM_DELADDR) {
-                  mAddresses.erase(address);
-                  std::clog << "IP address gone: " << HttpServer::ipString(address) << std::endl;
-                  mpNotifier->onHotplugEvent(addressLeft);
-                }
+                if (data.n->nlmsg_type == RTM_NEWADDR)
+                  onAddressArrived(address, pIfa->ifa_index);
+                else if (data.n->nlmsg_type == RTM_DELADDR)
+                  onAddressLeft(address, pIfa->ifa_index);
               }
             }
             NLMSG_NEXT(data.n, len);
@@ -227,3 +264,21 @@ NetworkHotplugNotifier::~NetworkHotplugNotifier()
 {
   delete p;
 }
+
+void
+NetworkHotplugNotifier::setInterface(const std::string& s)
+{
+  p->mFilter.setInterface(s);
+}
+
+void
+NetworkHotplugNotifier::setIgnoredInterfaces(const std::vector<std::string>& patterns)
+{
+  p->mFilter.setIgnoredNames(patterns);
+}
+
+void
+NetworkHotplugNotifier::setIgnoredInterfaceTypes(const std::vector<std::string>& types)
+{
+  p->mFilter.setIgnoredTypes(types);
+}
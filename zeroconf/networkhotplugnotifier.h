@@ -19,6 +19,9 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef NETWORK_HOTPLUGNOTIFIER_H
 #define NETWORK_HOTPLUGNOTIFIER_H
 
+#include <string>
+#include <vector>
+
 class NetworkHotplugNotifier
 {
   NetworkHotplugNotifier(const NetworkHotplugNotifier&) = delete;
@@ -28,6 +31,12 @@ public:
   NetworkHotplugNotifier();
   virtual ~NetworkHotplugNotifier();
 
+  // Address changes are reported only for relevant interfaces,
+  // see InterfaceFilter for details.
+  void setInterface(const std::string&);
+  void setIgnoredInterfaces(const std::vector<std::string>& patterns);
+  void setIgnoredInterfaceTypes(const std::vector<std::string>& types);
+
 protected:
   enum Event
   {